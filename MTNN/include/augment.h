@@ -0,0 +1,185 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "random.h"
+#include "simd.h"
+
+//Elastic plus affine distortion of an image (Simard et al.), as an augmentation stage for idx_loader or on its own. A uniform random
+//displacement field is smoothed by a gaussian (separably, a row pass then a column pass, both vectorized) and scaled by the elasticity,
+//then a random stretch and rotation about the center are added. Every feature of the map is resampled with the same field by a
+//bilinear gather from a copy padded with the background, so points outside the image need no bounds checks
+class elastic_distortion
+{
+public:
+    //kernel_size taps with standard deviation sigma, max_rotation in degrees. Points sampled outside the image read background
+    elastic_distortion(size_t kernel_size = 5, float sigma = 8.0f, float elasticity = 0.5f, float max_stretch = 0.15f, float max_rotation = 15.0f, float background = -1.0f)
+        : taps(kernel_size | 1), stretch(max_stretch), rotation(max_rotation * 3.1415926f / 180), fill(background)
+    {
+        //the 2d kernel exp(-d^2 / 2 sigma^2) / (2 pi sigma^2) is the outer product of this with itself
+        size_t half = taps / 2;
+        row_kernel.resize(taps);
+        for (size_t k = 0; k < taps; ++k)
+        {
+            float d = static_cast<float>(k) - half;
+            row_kernel[k] = std::exp(-d * d / (2 * sigma * sigma)) / (std::sqrt(2 * 3.1415926f) * sigma);
+        }
+        //the elasticity goes in with the second pass
+        column_kernel = row_kernel;
+        for (size_t k = 0; k < taps; ++k)
+            column_kernel[k] *= elasticity;
+    }
+
+    //distorts image in place with draws from rng
+    template<typename map_type> void operator()(map_type& image, philox_stream& rng) const
+    {
+        constexpr size_t rows = map_type::rows();
+        constexpr size_t cols = map_type::cols();
+        constexpr size_t plane = rows * cols;
+        constexpr size_t padded_cols = cols + 3;
+
+        //per thread scratch: two fields, the pass in between, a padded row and a padded image
+        thread_local std::vector<float> scratch;
+        thread_local std::vector<float> columns;
+        scratch.resize(3 * plane + cols + taps + (rows + 3) * padded_cols);
+        float* field_i = scratch.data();
+        float* field_j = field_i + plane;
+        float* pass = field_j + plane;
+        float* row = pass + plane;
+        float* padded = row + cols + taps;
+        //j - center of every column, for the affine part
+        columns.resize(cols);
+        for (size_t j = 0; j < cols; ++j)
+            columns[j] = static_cast<float>(j) - static_cast<float>(cols / 2);
+
+        //both fields are next to each other
+        rng.uniform(field_i, 2 * plane, -1.0f, 1.0f);
+        smooth(field_i, pass, row, rows, cols);
+        smooth(field_j, pass, row, rows, cols);
+
+        float affine[3];
+        rng.uniform(affine, 3, -1.0f, 1.0f);
+        float vertical_stretch = stretch * affine[0];
+        float horizontal_stretch = stretch * affine[1];
+        float angle = rotation * affine[2];
+        float sin_a = std::sin(angle);
+        float cos_a = std::cos(angle);
+
+        //fields become the source coordinates of every output pixel
+        for (size_t i = 0; i < rows; ++i)
+        {
+            float up = static_cast<float>(rows / 2) - static_cast<float>(i);
+            size_t j = 0;
+            for (; j + simd_float::width <= cols; j += simd_float::width)
+                source_span<simd_float>(field_i + i * cols + j, field_j + i * cols + j, columns.data() + j, static_cast<float>(i), static_cast<float>(cols / 2), up, vertical_stretch + cos_a - 1, horizontal_stretch + cos_a - 1, sin_a);
+            for (; j < cols; ++j)
+                source_span<scalar_float>(field_i + i * cols + j, field_j + i * cols + j, columns.data() + j, static_cast<float>(i), static_cast<float>(cols / 2), up, vertical_stretch + cos_a - 1, horizontal_stretch + cos_a - 1, sin_a);
+        }
+
+        //one border of background before each row and column, two after, so every tap of a clamped coordinate is in the buffer
+        std::fill(padded, padded + (rows + 3) * padded_cols, fill);
+        for (size_t f = 0; f < map_type::size(); ++f)
+        {
+            float* out = image.data() + f * plane;
+            for (size_t i = 0; i < rows; ++i)
+                std::copy(out + i * cols, out + (i + 1) * cols, padded + (i + 1) * padded_cols + 1);
+            size_t i = 0;
+            for (; i + simd_float::width <= plane; i += simd_float::width)
+                warp_span<simd_float>(field_i + i, field_j + i, padded, out + i, rows, cols);
+            for (; i < plane; ++i)
+                warp_span<scalar_float>(field_i + i, field_j + i, padded, out + i, rows, cols);
+        }
+        image.touch();
+    }
+
+private:
+    size_t taps;
+    float stretch;
+    float rotation;
+    float fill;
+    std::vector<float> row_kernel;
+    std::vector<float> column_kernel;
+
+    //gaussian over a rows * cols field with zeros outside it, in place (pass holds the row pass, row one padded row)
+    void smooth(float* field, float* pass, float* row, size_t rows, size_t cols) const
+    {
+        size_t half = taps / 2;
+        const float* g = row_kernel.data();
+        std::fill(row, row + cols + taps, 0.0f);
+        for (size_t i = 0; i < rows; ++i)
+        {
+            std::copy(field + i * cols, field + (i + 1) * cols, row + half);
+            float* out = pass + i * cols;
+            size_t j = 0;
+            for (; j + simd_float::width <= cols; j += simd_float::width)
+            {
+                simd_float sum = simd_float::zero();
+                for (size_t k = 0; k < taps; ++k)
+                    sum = fmadd(simd_float::set1(g[k]), simd_float::load(row + j + k), sum);
+                sum.store(out + j);
+            }
+            for (; j < cols; ++j)
+            {
+                float sum = 0.0f;
+                for (size_t k = 0; k < taps; ++k)
+                    sum += g[k] * row[j + k];
+                out[j] = sum;
+            }
+        }
+
+        g = column_kernel.data();
+        for (size_t i = 0; i < rows; ++i)
+        {
+            //taps that fall inside the field
+            size_t first = i < half ? half - i : 0;
+            size_t last = std::min(taps, rows + half - i);
+            float* out = field + i * cols;
+            size_t j = 0;
+            for (; j + simd_float::width <= cols; j += simd_float::width)
+            {
+                simd_float sum = simd_float::zero();
+                for (size_t k = first; k < last; ++k)
+                    sum = fmadd(simd_float::set1(g[k]), simd_float::load(pass + (i + k - half) * cols + j), sum);
+                sum.store(out + j);
+            }
+            for (; j < cols; ++j)
+            {
+                float sum = 0.0f;
+                for (size_t k = first; k < last; ++k)
+                    sum += g[k] * pass[(i + k - half) * cols + j];
+                out[j] = sum;
+            }
+        }
+    }
+
+    //displacements to source coordinates for part of row i, up is center row - i and x the columns' offsets from the center column
+    template<typename vec> static inline void source_span(float* src_i, float* src_j, const float* x, float i, float center, float up, float vertical, float horizontal, float sin_a)
+    {
+        vec xs = vec::load(x);
+        (vec::set1(i + up * vertical) - vec::load(src_i) + xs * vec::set1(sin_a)).store(src_i);
+        (vec::set1(center + up * sin_a) + xs - vec::load(src_j) - xs * vec::set1(horizontal)).store(src_j);
+    }
+
+    //bilinear samples of the padded image at the source coordinates
+    template<typename vec> static inline void warp_span(const float* src_i, const float* src_j, const float* padded, float* out, size_t rows, size_t cols)
+    {
+        size_t padded_cols = cols + 3;
+        vec ci = min(max(vec::load(src_i), vec::set1(-1.0f)), vec::set1(static_cast<float>(rows)));
+        vec cj = min(max(vec::load(src_j), vec::set1(-1.0f)), vec::set1(static_cast<float>(cols)));
+        vec fi = vec::floor(ci);
+        vec fj = vec::floor(cj);
+        vec wi = ci - fi;
+        vec wj = cj - fj;
+
+        int index[vec::width];
+        ((fi + vec::set1(1.0f)) * vec::set1(static_cast<float>(padded_cols)) + fj + vec::set1(1.0f)).store_int(index);
+        vec top = vec::gather(padded, index);
+        top = top + wj * (vec::gather(padded + 1, index) - top);
+        vec bottom = vec::gather(padded + padded_cols, index);
+        bottom = bottom + wj * (vec::gather(padded + padded_cols + 1, index) - bottom);
+        (top + wi * (bottom - top)).store(out);
+    }
+};
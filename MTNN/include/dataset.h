@@ -0,0 +1,477 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "imatrix.h"
+#include "modelfile.h"
+#include "random.h"
+
+//element type byte of an unsigned byte IDX file, the only kind read
+#define MTNN_IDX_UBYTE 0x08
+
+//One IDX file (the MNIST format) mapped in place: two zero bytes, the element type, the number of dimensions, one big
+//endian uint32 per dimension (the first one counts the samples), then the elements, sample after sample
+class idx_file
+{
+public:
+    //maps and checks path, false if it isn't an unsigned byte IDX file or is shorter than its header says
+    bool open(const char* path)
+    {
+        close();
+        if (!mapping.map(path))
+            return false;
+
+        const unsigned char* p = mapping.data();
+        size_t bytes = mapping.size();
+        if (bytes < 4 || p[0] != 0 || p[1] != 0 || p[2] != MTNN_IDX_UBYTE || p[3] == 0 || bytes < 4 + 4 * static_cast<size_t>(p[3]))
+        {
+            close();
+            return false;
+        }
+
+        size_t total = 1;
+        for (size_t d = 0; d < p[3]; ++d)
+        {
+            const unsigned char* dim = p + 4 + 4 * d;
+            dims.push_back((static_cast<size_t>(dim[0]) << 24) | (static_cast<size_t>(dim[1]) << 16) | (static_cast<size_t>(dim[2]) << 8) | dim[3]);
+            total *= dims.back();
+        }
+        header = 4 + 4 * dims.size();
+        if (bytes - header < total)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        mapping.unmap();
+        dims.clear();
+        header = 0;
+    }
+
+    bool is_open() const
+    {
+        return mapping.is_mapped();
+    }
+
+    //number of samples (the first dimension)
+    size_t count() const
+    {
+        return dims.empty() ? 0 : dims[0];
+    }
+
+    size_t dimensions() const
+    {
+        return dims.size();
+    }
+
+    size_t dimension(size_t d) const
+    {
+        return dims[d];
+    }
+
+    //bytes per sample, the product of all but the first dimension
+    size_t sample_size() const
+    {
+        size_t size = 1;
+        for (size_t d = 1; d < dims.size(); ++d)
+            size *= dims[d];
+        return size;
+    }
+
+    //first byte of sample i
+    const unsigned char* sample(size_t i) const
+    {
+        return mapping.data() + header + i * sample_size();
+    }
+
+private:
+    model_mapping mapping;
+    std::vector<size_t> dims;
+    size_t header = 0;
+};
+
+//How the bytes of an IDX file become inputs and targets
+struct idx_decoding
+{
+    //pixel p becomes p * scale + shift
+    float scale = 1.0f / 255;
+    float shift = 0.0f;
+
+    //if not negative pixels above threshold become high and the rest low instead
+    int threshold = -1;
+    float high = 1.0f;
+    float low = 0.0f;
+
+    //where the image goes when the input map is larger, and the value around it
+    size_t top = 0;
+    size_t left = 0;
+    float background = 0.0f;
+
+    //one hot targets, label k sets element k of the label map to on and the rest to off
+    float label_on = 1.0f;
+    float label_off = 0.0f;
+};
+
+//Minibatches of an IDX image file and (optionally) its IDX label file. Both files stay mapped, batches are decoded by
+//background threads into the back one of two buffers while the caller trains on the front one, so the next batch is
+//usually ready when next() is called. The sample order of an epoch is either the file order or a permutation that only
+//depends on the seed and the epoch number. An augmentation stage (eg elastic_distortion) can run on the decoded images there too
+template<typename input_map_type, typename label_map_type> class idx_loader
+{
+public:
+    using input_vector_type = std::vector<input_map_type>;
+    using label_vector_type = std::vector<label_map_type>;
+
+    //starts n_decoders threads, each decodes its share of every batch
+    idx_loader(size_t n_decoders = 1) : generation(0), pending(0), stopping(false), job_slot(0), job_begin(0), job_end(0)
+    {
+        decoders = std::max<size_t>(n_decoders, 1);
+        for (size_t w = 0; w < decoders; ++w)
+            threads.emplace_back(&idx_loader<input_map_type, label_map_type>::decoder_loop, this, w);
+    }
+
+    //joins the decoders
+    ~idx_loader()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+    }
+
+    idx_loader(const idx_loader&) = delete;
+    idx_loader& operator=(const idx_loader&) = delete;
+
+    //maps the files and checks they fit the maps (the image's features, rows and columns and every label), labels_path
+    //can be nullptr for unlabeled data. False if anything doesn't match
+    bool open(const char* images_path, const char* labels_path, const idx_decoding& decode_params = idx_decoding())
+    {
+        wait();
+        queued = false;
+        batch_count = 0;
+        order.clear();
+        labels_file.close();
+        if (!images_file.open(images_path) || images_file.dimensions() < 3)
+        {
+            images_file.close();
+            return false;
+        }
+
+        //n, [features...], rows, cols
+        size_t dims = images_file.dimensions();
+        image_rows = images_file.dimension(dims - 2);
+        image_cols = images_file.dimension(dims - 1);
+        if (image_rows == 0 || image_cols == 0)
+        {
+            images_file.close();
+            return false;
+        }
+        size_t features = images_file.sample_size() / (image_rows * image_cols);
+        if (features != input_map_type::size() || decode_params.top + image_rows > input_map_type::rows() || decode_params.left + image_cols > input_map_type::cols())
+        {
+            images_file.close();
+            return false;
+        }
+
+        if (labels_path != nullptr)
+        {
+            bool ok = labels_file.open(labels_path) && labels_file.dimensions() == 1 && labels_file.count() == images_file.count();
+            for (size_t i = 0; ok && i < labels_file.count(); ++i)
+                ok = *labels_file.sample(i) < label_map_type::elements();
+            if (!ok)
+            {
+                labels_file.close();
+                images_file.close();
+                return false;
+            }
+        }
+
+        decoding = decode_params;
+        for (size_t p = 0; p < 256; ++p)
+        {
+            if (decoding.threshold >= 0)
+                table[p] = static_cast<int>(p) > decoding.threshold ? decoding.high : decoding.low;
+            else
+                table[p] = p * decoding.scale + decoding.shift;
+        }
+        return true;
+    }
+
+    //number of samples
+    size_t size() const
+    {
+        return images_file.count();
+    }
+
+    bool has_labels() const
+    {
+        return labels_file.is_open();
+    }
+
+    //batches in the current epoch (the last one can be smaller)
+    size_t batches() const
+    {
+        return batch_count;
+    }
+
+    //decodes sample i on the calling thread
+    void decode(size_t i, input_map_type& image) const
+    {
+        const unsigned char* in = images_file.sample(i);
+        float* out = image.data();
+        constexpr size_t rows = input_map_type::rows();
+        constexpr size_t cols = input_map_type::cols();
+        if (image_rows != rows || image_cols != cols)
+            std::fill(out, out + input_map_type::elements(), decoding.background);
+        for (size_t f = 0; f < input_map_type::size(); ++f)
+        {
+            for (size_t r = 0; r < image_rows; ++r)
+            {
+                float* row = out + (f * rows + decoding.top + r) * cols + decoding.left;
+                for (size_t c = 0; c < image_cols; ++c)
+                    row[c] = table[in[c]];
+                in += image_cols;
+            }
+        }
+        image.touch();
+    }
+
+    //label of sample i, 0 without a label file
+    size_t label(size_t i) const
+    {
+        return has_labels() ? *labels_file.sample(i) : 0;
+    }
+
+    //one hot target of sample i
+    void decode_label(size_t i, label_map_type& target) const
+    {
+        float* out = target.data();
+        std::fill(out, out + label_map_type::elements(), decoding.label_off);
+        out[label(i)] = decoding.label_on;
+        target.touch();
+    }
+
+    //runs (*stage)(image, rng) on every batch image after it's decoded, on the decoder threads. rng is a philox_stream of
+    //start_epoch's seed just for that sample and epoch, so an epoch comes out the same for any number of decoders. The
+    //stage has to outlive the loader or the next call, nullptr turns augmentation off. Not used by decode()
+    template<typename stage_type> void set_augmentation(const stage_type* stage)
+    {
+        wait();
+        augmentation = stage;
+        augmentation_invoke = stage != nullptr ? &call_stage<stage_type> : nullptr;
+    }
+
+    void set_augmentation(std::nullptr_t)
+    {
+        wait();
+        augmentation = nullptr;
+        augmentation_invoke = nullptr;
+    }
+
+    //starts an epoch of batch_size batches and queues the first one. The order is the file order, or with shuffle a
+    //permutation drawn from (seed, epoch) that is the same on every platform
+    void start_epoch(size_t batch_size, bool shuffle = false, uint64_t seed = 0, size_t epoch = 0)
+    {
+        wait();
+        queued = false;
+        epoch_seed = seed;
+        epoch_index = epoch;
+
+        size_t n = size();
+        order.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            order[i] = static_cast<uint32_t>(i);
+        //fisher yates, the last sample id of the epoch's streams is the shuffle's
+        if (shuffle)
+        {
+            philox_stream rng(seed, stream(0xFFFFFFFFu));
+            for (size_t i = n; i > 1; --i)
+                std::swap(order[i - 1], order[static_cast<size_t>((static_cast<uint64_t>(rng()) * i) >> 32)]);
+        }
+
+        batch_length = std::max<size_t>(batch_size, 1);
+        batch_count = (n + batch_length - 1) / batch_length;
+        upcoming = 0;
+        if (upcoming < batch_count)
+            dispatch();
+    }
+
+    //waits for the batch being decoded, makes it the current one (images(), labels()) and starts decoding the one after
+    //it. False at the end of the epoch. The previous batch's buffers are reused, so don't hold on to them
+    bool next()
+    {
+        wait();
+        if (!queued)
+            return false;
+        front = 1 - front;
+        queued = false;
+        if (upcoming < batch_count)
+            dispatch();
+        return true;
+    }
+
+    //current batch
+    input_vector_type& images()
+    {
+        return slots[front].images;
+    }
+
+    //current batch's targets, empty without a label file
+    label_vector_type& labels()
+    {
+        return slots[front].labels;
+    }
+
+    //index in the file of sample i of the current batch
+    size_t sample_index(size_t i) const
+    {
+        return slots[front].indices[i];
+    }
+
+private:
+    struct batch_slot
+    {
+        input_vector_type images;
+        label_vector_type labels;
+        std::vector<uint32_t> indices;
+    };
+
+    idx_file images_file;
+    idx_file labels_file;
+    idx_decoding decoding;
+    size_t image_rows = 0;
+    size_t image_cols = 0;
+    //byte to input value
+    float table[256];
+
+    //augmentation stage, type erased without std::function
+    const void* augmentation = nullptr;
+    void(*augmentation_invoke)(const void*, input_map_type&, philox_stream&) = nullptr;
+    //start_epoch's seed and epoch, for the random streams
+    uint64_t epoch_seed = 0;
+    size_t epoch_index = 0;
+
+    //stream id of a sample in the current epoch
+    uint64_t stream(uint32_t sample) const
+    {
+        return MTNN_STREAM_LOADER | (static_cast<uint64_t>(epoch_index & 0x3FFFFFFF) << 32) | sample;
+    }
+
+    template<typename stage_type> static void call_stage(const void* stage, input_map_type& image, philox_stream& rng)
+    {
+        (*static_cast<const stage_type*>(stage))(image, rng);
+    }
+
+    //sample order of the epoch
+    std::vector<uint32_t> order;
+    size_t batch_length = 1;
+    size_t batch_count = 0;
+    //next batch to dispatch
+    size_t upcoming = 0;
+    //whether the back slot holds (or is getting) a batch next() hasn't handed out
+    bool queued = false;
+
+    //front is the caller's, the other one is the decoders'
+    batch_slot slots[2];
+    size_t front = 0;
+
+    size_t decoders = 1;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    //bumped for every batch so sleeping decoders know there is work
+    size_t generation;
+    //decoders still working on the current batch
+    size_t pending;
+    bool stopping;
+    //current job: order[job_begin...job_end) into slots[job_slot]
+    size_t job_slot;
+    size_t job_begin;
+    size_t job_end;
+
+    //sizes the back slot for the next batch (on the calling thread, so the decoders never allocate) and wakes the decoders
+    void dispatch()
+    {
+        size_t slot = 1 - front;
+        size_t begin = upcoming * batch_length;
+        size_t end = std::min(begin + batch_length, order.size());
+        slots[slot].images.resize(end - begin);
+        slots[slot].labels.resize(has_labels() ? end - begin : 0);
+        slots[slot].indices.assign(order.begin() + begin, order.begin() + end);
+        ++upcoming;
+        queued = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job_slot = slot;
+            job_begin = begin;
+            job_end = end;
+            pending = decoders;
+            ++generation;
+        }
+        start_cv.notify_all();
+    }
+
+    //blocks until the decoders are idle
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return pending == 0; });
+    }
+
+    void decoder_loop(size_t w)
+    {
+        size_t seen = 0;
+        while (true)
+        {
+            size_t slot = 0;
+            size_t begin = 0;
+            size_t end = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [this, seen] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                slot = job_slot;
+                begin = job_begin;
+                end = job_end;
+            }
+
+            //contiguous share of the batch
+            size_t n = end - begin;
+            size_t first = n * w / decoders;
+            size_t last = n * (w + 1) / decoders;
+            batch_slot& batch = slots[slot];
+            for (size_t i = first; i < last; ++i)
+            {
+                decode(batch.indices[i], batch.images[i]);
+                if (augmentation_invoke != nullptr)
+                {
+                    philox_stream rng(epoch_seed, stream(batch.indices[i]));
+                    augmentation_invoke(augmentation, batch.images[i], rng);
+                }
+                if (has_labels())
+                    decode_label(batch.indices[i], batch.labels[i]);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                done_cv.notify_all();
+        }
+    }
+};
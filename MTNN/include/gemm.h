@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "imatrix.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+//register tile of C (rows of A x cols of B kept in registers by the micro kernel)
+#define MTNN_GEMM_MR 6
+#define MTNN_GEMM_NR 16
+//cache tiles: MC x KC block of A stays in L2, KC x NC panel of B in L3
+#define MTNN_GEMM_MC 96
+#define MTNN_GEMM_KC 256
+#define MTNN_GEMM_NC 2048
+
+//packed, register blocked, cache tiled single precision matrix multiply. All matrices are row major
+struct sgemm_impl
+{
+    //element i, j of op(A)
+    static inline float get(const float* a, size_t lda, bool trans, size_t i, size_t j)
+    {
+        return trans ? a[j * lda + i] : a[i * lda + j];
+    }
+
+    //pack an mc x kc block of op(A) into MR row panels (k major inside a panel), scaled by alpha, zero padded
+    static void pack_a(bool trans_a, size_t mc, size_t kc, const float* a, size_t lda, size_t i_0, size_t k_0, float alpha, float* packed)
+    {
+        for (size_t p = 0; p < mc; p += MTNN_GEMM_MR)
+        {
+            size_t m_rem = std::min<size_t>(MTNN_GEMM_MR, mc - p);
+            for (size_t k = 0; k < kc; ++k)
+            {
+                for (size_t i = 0; i < m_rem; ++i)
+                    packed[k * MTNN_GEMM_MR + i] = alpha * get(a, lda, trans_a, i_0 + p + i, k_0 + k);
+                for (size_t i = m_rem; i < MTNN_GEMM_MR; ++i)
+                    packed[k * MTNN_GEMM_MR + i] = 0.0f;
+            }
+            packed += MTNN_GEMM_MR * kc;
+        }
+    }
+
+    //pack a kc x nc panel of op(B) into NR column panels (k major inside a panel), zero padded
+    static void pack_b(bool trans_b, size_t kc, size_t nc, const float* b, size_t ldb, size_t k_0, size_t j_0, float* packed)
+    {
+        for (size_t p = 0; p < nc; p += MTNN_GEMM_NR)
+        {
+            size_t n_rem = std::min<size_t>(MTNN_GEMM_NR, nc - p);
+            for (size_t k = 0; k < kc; ++k)
+            {
+                if (!trans_b && n_rem == MTNN_GEMM_NR)
+                {
+                    const float* src = b + (k_0 + k) * ldb + j_0 + p;
+                    for (size_t j = 0; j < MTNN_GEMM_NR; ++j)
+                        packed[k * MTNN_GEMM_NR + j] = src[j];
+                }
+                else
+                {
+                    for (size_t j = 0; j < n_rem; ++j)
+                        packed[k * MTNN_GEMM_NR + j] = get(b, ldb, trans_b, k_0 + k, j_0 + p + j);
+                    for (size_t j = n_rem; j < MTNN_GEMM_NR; ++j)
+                        packed[k * MTNN_GEMM_NR + j] = 0.0f;
+                }
+            }
+            packed += MTNN_GEMM_NR * kc;
+        }
+    }
+
+    //C(m_rem x n_rem) += packed A panel * packed B panel (or = if overwrite)
+    static void micro_kernel(size_t kc, const float* a, const float* b, float* c, size_t ldc, size_t m_rem, size_t n_rem, bool overwrite)
+    {
+#if defined(__AVX__)
+        __m256 acc[MTNN_GEMM_MR][2];
+        for (size_t i = 0; i < MTNN_GEMM_MR; ++i)
+            acc[i][0] = acc[i][1] = _mm256_setzero_ps();
+
+        for (size_t k = 0; k < kc; ++k)
+        {
+            __m256 b_0 = _mm256_loadu_ps(b + k * MTNN_GEMM_NR);
+            __m256 b_1 = _mm256_loadu_ps(b + k * MTNN_GEMM_NR + 8);
+            for (size_t i = 0; i < MTNN_GEMM_MR; ++i)
+            {
+                __m256 a_i = _mm256_broadcast_ss(a + k * MTNN_GEMM_MR + i);
+#if defined(__FMA__)
+                acc[i][0] = _mm256_fmadd_ps(a_i, b_0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(a_i, b_1, acc[i][1]);
+#else
+                acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_mul_ps(a_i, b_0));
+                acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_mul_ps(a_i, b_1));
+#endif
+            }
+        }
+
+        //full tile goes straight to C
+        if (m_rem == MTNN_GEMM_MR && n_rem == MTNN_GEMM_NR)
+        {
+            for (size_t i = 0; i < MTNN_GEMM_MR; ++i)
+            {
+                float* c_i = c + i * ldc;
+                _mm256_storeu_ps(c_i, overwrite ? acc[i][0] : _mm256_add_ps(_mm256_loadu_ps(c_i), acc[i][0]));
+                _mm256_storeu_ps(c_i + 8, overwrite ? acc[i][1] : _mm256_add_ps(_mm256_loadu_ps(c_i + 8), acc[i][1]));
+            }
+            return;
+        }
+
+        float tile[MTNN_GEMM_MR][MTNN_GEMM_NR];
+        for (size_t i = 0; i < MTNN_GEMM_MR; ++i)
+        {
+            _mm256_storeu_ps(tile[i], acc[i][0]);
+            _mm256_storeu_ps(tile[i] + 8, acc[i][1]);
+        }
+#else
+        //plain version, the j loops are simple enough for the compiler to vectorize
+        float tile[MTNN_GEMM_MR][MTNN_GEMM_NR] = {};
+        for (size_t k = 0; k < kc; ++k)
+        {
+            const float* b_k = b + k * MTNN_GEMM_NR;
+            for (size_t i = 0; i < MTNN_GEMM_MR; ++i)
+            {
+                float a_i = a[k * MTNN_GEMM_MR + i];
+                for (size_t j = 0; j < MTNN_GEMM_NR; ++j)
+                    tile[i][j] += a_i * b_k[j];
+            }
+        }
+#endif
+        for (size_t i = 0; i < m_rem; ++i)
+            for (size_t j = 0; j < n_rem; ++j)
+                c[i * ldc + j] = overwrite ? tile[i][j] : c[i * ldc + j] + tile[i][j];
+    }
+};
+
+//C = alpha * op(A) * op(B) + beta * C, op(A) is m x k, op(B) is k x n, C is m x n. All row major with leading dimensions lda, ldb, ldc
+inline void sgemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k, float alpha, const float* a, size_t lda, const float* b, size_t ldb, float beta, float* c, size_t ldc)
+{
+    //scale C once, the kernels only accumulate. With beta == 0 the first k block overwrites C instead
+    bool overwrite_first = beta == 0.0f && k != 0 && alpha != 0.0f;
+    if (beta != 1.0f && !overwrite_first)
+        for (size_t i = 0; i < m; ++i)
+            for (size_t j = 0; j < n; ++j)
+                c[i * ldc + j] = beta == 0.0f ? 0.0f : beta * c[i * ldc + j];
+
+    if (m == 0 || n == 0 || k == 0 || alpha == 0.0f)
+        return;
+
+    //packing buffers, one set per thread so thread nets can multiply concurrently
+    static thread_local std::vector<float, aligned_allocator<float>> packed_a(MTNN_GEMM_MC * MTNN_GEMM_KC);
+    static thread_local std::vector<float, aligned_allocator<float>> packed_b(MTNN_GEMM_KC * MTNN_GEMM_NC);
+
+    for (size_t j_c = 0; j_c < n; j_c += MTNN_GEMM_NC)
+    {
+        size_t nc = std::min<size_t>(MTNN_GEMM_NC, n - j_c);
+        for (size_t p_c = 0; p_c < k; p_c += MTNN_GEMM_KC)
+        {
+            size_t kc = std::min<size_t>(MTNN_GEMM_KC, k - p_c);
+            sgemm_impl::pack_b(trans_b, kc, nc, b, ldb, p_c, j_c, packed_b.data());
+
+            for (size_t i_c = 0; i_c < m; i_c += MTNN_GEMM_MC)
+            {
+                size_t mc = std::min<size_t>(MTNN_GEMM_MC, m - i_c);
+                sgemm_impl::pack_a(trans_a, mc, kc, a, lda, i_c, p_c, alpha, packed_a.data());
+
+                //walk register tiles
+                for (size_t j_r = 0; j_r < nc; j_r += MTNN_GEMM_NR)
+                    for (size_t i_r = 0; i_r < mc; i_r += MTNN_GEMM_MR)
+                        sgemm_impl::micro_kernel(kc, packed_a.data() + i_r * kc, packed_b.data() + j_r * kc,
+                            c + (i_c + i_r) * ldc + j_c + j_r, ldc,
+                            std::min<size_t>(MTNN_GEMM_MR, mc - i_r), std::min<size_t>(MTNN_GEMM_NR, nc - j_r), overwrite_first && p_c == 0);
+            }
+        }
+    }
+}
+
+//y = alpha * op(A) * x + beta * y, A is m x n row major (single sample path, packing isn't worth it)
+inline void sgemv(bool trans_a, size_t m, size_t n, float alpha, const float* a, size_t lda, const float* x, float beta, float* y)
+{
+    size_t y_size = trans_a ? n : m;
+    for (size_t i = 0; i < y_size; ++i)
+        y[i] = beta == 0.0f ? 0.0f : beta * y[i];
+
+    if (!trans_a)
+    {
+        //dot product of every row
+        for (size_t i = 0; i < m; ++i)
+        {
+            const float* a_i = a + i * lda;
+            float sum = 0.0f;
+            for (size_t j = 0; j < n; ++j)
+                sum += a_i[j] * x[j];
+            y[i] += alpha * sum;
+        }
+    }
+
+    else
+    {
+        //axpy of every row
+        for (size_t i = 0; i < m; ++i)
+        {
+            const float* a_i = a + i * lda;
+            float x_i = alpha * x[i];
+            for (size_t j = 0; j < n; ++j)
+                y[j] += x_i * a_i[j];
+        }
+    }
+}
+
+//A += alpha * x * y^T, A is m x n row major
+inline void sger(size_t m, size_t n, float alpha, const float* x, const float* y, float* a, size_t lda)
+{
+    for (size_t i = 0; i < m; ++i)
+    {
+        float* a_i = a + i * lda;
+        float x_i = alpha * x[i];
+        for (size_t j = 0; j < n; ++j)
+            a_i[j] += x_i * y[j];
+    }
+}
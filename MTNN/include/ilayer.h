@@ -1,6 +1,11 @@
 #pragma once
 
 #include "imatrix.h"
+#include "gemm.h"
+#include "simd.h"
+#include "parallel.h"
+#include "random.h"
+#include "statistics.h"
 
 ////All of the types etc.
 
@@ -34,180 +39,557 @@
 #define MTNN_DATA_WEIGHT_AUXDATA 5
 #define MTNN_DATA_BIAS_AUXDATA 6
 
-//// HELPER FUNCTIONS //// CLASS DEFINITIONS START AT LINE 395
+//// HELPER FUNCTIONS //// CLASS DEFINITIONS START AT "START ACTUAL LAYERS"
 
 template<size_t f, size_t r, size_t c, typename T = float> using FeatureMapVector = std::vector<FeatureMap<f, r, c, T>>;
 
-//abstract class for padding, non padding variants; even or odd kernels shouldn't matter
-template <size_t r, size_t c, size_t kernel_r, size_t kernel_c, size_t s, bool use_pad> struct conv_helper_funcs
+//lowers a whole convolution layer to GEMM. im2col unrolls every receptive field of every input map into one column of a (features * k * k) x (out_r * out_c) matrix
+//so that output = kernels * columns, with the padding resolved once per kernel offset instead of per multiply-add
+template<size_t features, size_t r, size_t c, size_t k, size_t s, bool use_pad> struct conv_gemm_funcs
 {
-    static Matrix2D<float, (use_pad ? r : (r - kernel_r) / s + 1), (use_pad ? c : (c - kernel_c) / s + 1)> convolve(Matrix2D<float, r, c>& input, Matrix2D<float, kernel_r, kernel_c>& kernel);
-    static void back_prop_kernel(Matrix2D<float, r, c>& input, Matrix2D<float, (use_pad ? r : (r - kernel_r) / s + 1), (use_pad ? c : (c - kernel_c) / s + 1)>& output, Matrix2D<float, kernel_r, kernel_c>& kernel_gradient);
-    static Matrix2D<float, r, c> convolve_back(Matrix2D<float, (use_pad ? r : (r - kernel_r) / s + 1), (use_pad ? c : (c - kernel_c) / s + 1)>& input, Matrix2D<float, kernel_r, kernel_c>& kernel);
-};
+    static constexpr size_t pad = use_pad ? (k - 1) / 2 : 0;
+    static constexpr size_t out_r = use_pad ? (r - 1) / s + 1 : (r - k) / s + 1;
+    static constexpr size_t out_c = use_pad ? (c - 1) / s + 1 : (c - k) / s + 1;
+    //rows of the column matrix
+    static constexpr size_t patch_size = features * k * k;
+    //columns of the column matrix (per sample)
+    static constexpr size_t out_size = out_r * out_c;
 
-//no padding specifications (most common)
-template<size_t r, size_t c, size_t kernel_r, size_t kernel_c, size_t s> struct conv_helper_funcs<r, c, kernel_r, kernel_c, s, false>
-{
-    //feed forward
-    static Matrix2D<float, (r - kernel_r) / s + 1, (c - kernel_c) / s + 1> convolve(Matrix2D<float, r, c>& input, Matrix2D<float, kernel_r, kernel_c>& kernel)
+    //first output index whose tap at kernel offset m lands inside the input, and one past the last
+    static inline size_t valid_begin(size_t m, size_t out_length)
+    {
+        size_t begin = m >= pad ? 0 : (pad - m + s - 1) / s;
+        return begin < out_length ? begin : out_length;
+    }
+    static inline size_t valid_end(size_t m, size_t length, size_t out_length)
     {
-        constexpr size_t out_r = (r - kernel_r) / s + 1;
-        constexpr size_t out_c = (c - kernel_c) / s + 1;
-        Matrix2D<float, out_r, out_c> output = { 0 };
+        size_t begin = valid_begin(m, out_length);
+        size_t end = length + pad <= m ? 0 : (length + pad - m - 1) / s + 1;
+        end = end < out_length ? end : out_length;
+        return end > begin ? end : begin;
+    }
 
-        for (size_t i = 0; i < r - kernel_r; i += s)//change top left of overlayed kernel
+    //unroll input (features x r x c) into col (patch_size x out_size), ld_col is the row stride of col so a batch can sit side by side
+    static void im2col(const float* input, float* col, size_t ld_col)
+    {
+        for (size_t f = 0; f < features; ++f)
         {
-            for (size_t j = 0; j < c - kernel_c; j += s)
+            for (size_t n = 0; n < k; ++n)
             {
-                //iterate over kernel
-                float sum = 0;
-                for (int n = 0; n < kernel_r; n++)
-                    for (int m = 0; m < kernel_c; m++)
-                        sum += input.at(i + n, j + m) * kernel.at(n, m);
-                output.at(i / s, j / s) = sum;
+                size_t i_begin = valid_begin(n, out_r);
+                size_t i_end = valid_end(n, r, out_r);
+                for (size_t m = 0; m < k; ++m)
+                {
+                    size_t j_begin = valid_begin(m, out_c);
+                    size_t j_end = valid_end(m, c, out_c);
+                    float* dst = col + ((f * k + n) * k + m) * ld_col;
+
+                    for (size_t i_0 = 0; i_0 < out_r; ++i_0)
+                    {
+                        float* dst_row = dst + i_0 * out_c;
+                        if (i_0 < i_begin || i_0 >= i_end)
+                        {
+                            std::fill(dst_row, dst_row + out_c, 0.0f);
+                            continue;
+                        }
+
+                        //zero padding on either side, straight strided copy in between
+                        const float* src = input + (f * r + i_0 * s + n - pad) * c + j_begin * s + m - pad;
+                        std::fill(dst_row, dst_row + j_begin, 0.0f);
+                        for (size_t j_0 = j_begin; j_0 < j_end; ++j_0)
+                            dst_row[j_0] = src[(j_0 - j_begin) * s];
+                        std::fill(dst_row + j_end, dst_row + out_c, 0.0f);
+                    }
+                }
             }
         }
-        return output;
     }
 
-    //accumulates gradients on kernel
-    static void back_prop_kernel(Matrix2D<float, r, c>& input, Matrix2D<float, (r - kernel_r) / s + 1, (c - kernel_c) / s + 1>& output, Matrix2D<float, kernel_r, kernel_c>& kernel_gradient)
+    //inverse of im2col: scatter-add col (patch_size x out_size) back into output (features x r x c), for input maps [f_begin, f_end)
+    static void col2im(const float* col, size_t ld_col, float* output, size_t f_begin, size_t f_end)
     {
-        constexpr size_t out_r = (r - kernel_r) / s + 1;
-        constexpr size_t out_c = (c - kernel_c) / s + 1;
-
-        size_t i_0 = 0;
-        size_t j_0 = 0;
-
-        //change focus of kernel
-        for (size_t i = 0; i < r - kernel_r; i += s)//change top left of overlayed kernel
+        for (size_t f = f_begin; f < f_end; ++f)
         {
-            for (size_t j = 0; j < c - kernel_c; j += s)
+            for (size_t n = 0; n < k; ++n)
             {
-                //iterate over kernel
-                float sum = 0;
-                float out = output.at(i_0, j_0);
-                for (int n = 0; n < kernel_r; n++)
-                    for (int m = 0; m < kernel_c; m++)
-                        kernel_gradient.at(n, m) += input.at(i + n, j + m) * out;
-                ++j_0;
+                size_t i_begin = valid_begin(n, out_r);
+                size_t i_end = valid_end(n, r, out_r);
+                for (size_t m = 0; m < k; ++m)
+                {
+                    size_t j_begin = valid_begin(m, out_c);
+                    size_t j_end = valid_end(m, c, out_c);
+                    const float* src = col + ((f * k + n) * k + m) * ld_col;
+
+                    for (size_t i_0 = i_begin; i_0 < i_end; ++i_0)
+                    {
+                        const float* src_row = src + i_0 * out_c;
+                        float* dst = output + (f * r + i_0 * s + n - pad) * c + j_begin * s + m - pad;
+                        for (size_t j_0 = j_begin; j_0 < j_end; ++j_0)
+                            dst[(j_0 - j_begin) * s] += src_row[j_0];
+                    }
+                }
             }
-            j_0 = 0;
-            ++i_0;
         }
     }
+};
+
+//direct convolution specialized at compile time for the small kernels we actually deploy (3x3 and 5x5, stride 1 and 2)
+//the input is copied once into a zero bordered buffer, so edges cost one copy per map instead of a check per tap. The kernel then
+//register blocks 4 output maps x 2 vectors of output columns and unrolls the taps from the template arguments
+template<size_t features, size_t r, size_t c, size_t k, size_t s, bool use_pad> struct conv_direct_funcs
+{
+    static constexpr size_t width = simd_float::width;
+    static constexpr size_t pad = use_pad ? (k - 1) / 2 : 0;
+    static constexpr size_t out_r = use_pad ? (r - 1) / s + 1 : (r - k) / s + 1;
+    static constexpr size_t out_c = use_pad ? (c - 1) / s + 1 : (c - k) / s + 1;
+
+    //specialized shape, and output rows at least a vector wide (narrower maps waste most lanes, GEMM does better there)
+    static constexpr bool specialized = (k == 3 || k == 5) && (s == 1 || s == 2) && out_c >= width;
+
+    //output rows are computed in whole vectors, ld_out is their padded length
+    static constexpr size_t out_blocks = (out_c + width - 1) / width;
+    static constexpr size_t ld_out = out_blocks * width;
+
+    //bordered input, big enough that the last (partial) vector block and the last row of taps read only zeros past the edge
+    static constexpr size_t padded_r = (out_r - 1) * s + k > r + 2 * pad ? (out_r - 1) * s + k : r + 2 * pad;
+    static constexpr size_t padded_c = out_blocks * width * s + k > c + 2 * pad ? out_blocks * width * s + k : c + 2 * pad;
+    static constexpr size_t padded_size = features * padded_r * padded_c;
 
-    //feed back
-    static Matrix2D<float, r, c> convolve_back(Matrix2D<float, (r - kernel_r) / s + 1, (c - kernel_c) / s + 1>& input, Matrix2D<float, kernel_r, kernel_c>& kernel)
+    //copy input (features x r x c) into the middle of padded (features x padded_r x padded_c), borders are zero
+    static void pad_input(const float* input, float* padded)
     {
-        Matrix2D<float, r, c> output = { 0 };
+        std::fill(padded, padded + padded_size, 0.0f);
+        for (size_t f = 0; f < features; ++f)
+            for (size_t i = 0; i < r; ++i)
+                std::copy(input + (f * r + i) * c, input + (f * r + i + 1) * c, padded + (f * padded_r + i + pad) * padded_c + pad);
+    }
 
-        size_t i_0 = 0;
-        size_t j_0 = 0;
+    //out_maps x vectors outputs of one row: every tap of every input map is accumulated in registers before a single store
+    template<size_t out_maps, size_t vectors> static inline void block(const float* in_row, const float* kernels, float* out_row)
+    {
+        simd_float acc[out_maps][vectors];
+        for (size_t o = 0; o < out_maps; ++o)
+            for (size_t u = 0; u < vectors; ++u)
+                acc[o][u] = simd_float::zero();
 
-        for (size_t i = 0; i < r - kernel_r; i += s)//change top left of overlayed kernel
+        for (size_t f = 0; f < features; ++f)
         {
-            for (size_t j = 0; j < c - kernel_c; j += s)
+            const float* map = in_row + f * padded_r * padded_c;
+            const float* kernel = kernels + f * k * k;
+            for (size_t n = 0; n < k; ++n)
             {
-                //find all possible ways convolved size_to
-                for (int n = 0; n < kernel_r; n++)
-                    for (int m = 0; m < kernel_c; m++)
-                        output.at(i + n, j + m) += kernel.at(n, m) * input.at(i_0, j_0);
-                ++j_0;
+                for (size_t m = 0; m < k; ++m)
+                {
+                    simd_float x[vectors];
+                    for (size_t u = 0; u < vectors; ++u)
+                    {
+                        const float* src = map + n * padded_c + u * width * s + m;
+                        x[u] = s == 2 ? simd_float::load_even(src) : simd_float::load(src);
+                    }
+
+                    for (size_t o = 0; o < out_maps; ++o)
+                    {
+                        simd_float tap = simd_float::set1(kernel[o * features * k * k + n * k + m]);
+                        for (size_t u = 0; u < vectors; ++u)
+                            acc[o][u] = fmadd(x[u], tap, acc[o][u]);
+                    }
+                }
             }
-            j_0 = 0;
-            ++i_0;
         }
-        return output;
+
+        for (size_t o = 0; o < out_maps; ++o)
+            for (size_t u = 0; u < vectors; ++u)
+                acc[o][u].store(out_row + o * out_r * ld_out + u * width);
+    }
+
+    //all output maps of one row for output maps [f_0, f_0 + out_maps)
+    template<size_t out_maps> static inline void row(const float* padded, const float* kernels, size_t i_0, float* output)
+    {
+        const float* in_row = padded + i_0 * s * padded_c;
+        float* out_row = output + i_0 * ld_out;
+
+        size_t b = 0;
+        for (; b + 2 <= out_blocks; b += 2)
+            block<out_maps, 2>(in_row + b * width * s, kernels, out_row + b * width);
+        for (; b < out_blocks; ++b)
+            block<out_maps, 1>(in_row + b * width * s, kernels, out_row + b * width);
+    }
+
+    //output (out_maps x out_r x ld_out) = kernels (out_maps x features x k x k) correlated with padded, only the first out_c of every row are meaningful
+    static void convolve(const float* padded, const float* kernels, size_t out_maps, float* output)
+    {
+        constexpr size_t kernel_size = features * k * k;
+        constexpr size_t map_size = out_r * ld_out;
+
+        size_t f_0 = 0;
+        for (; f_0 + 4 <= out_maps; f_0 += 4)
+            for (size_t i_0 = 0; i_0 < out_r; ++i_0)
+                row<4>(padded, kernels + f_0 * kernel_size, i_0, output + f_0 * map_size);
+        for (; f_0 < out_maps; ++f_0)
+            for (size_t i_0 = 0; i_0 < out_r; ++i_0)
+                row<1>(padded, kernels + f_0 * kernel_size, i_0, output + f_0 * map_size);
     }
 };
 
-//padding variants
-template<size_t r, size_t c, size_t kernel_r, size_t kernel_c, size_t s> struct conv_helper_funcs<r, c, kernel_r, kernel_c, s, true>
+//Winograd F(2x2, 3x3): each 2x2 output tile comes from a 4x4 input tile with 16 multiplies instead of 36. Kernels become U = G g G^T,
+//input tiles V = B^T d B, the sum over input maps is one GEMM per each of the 16 transformed positions (M = U * V) and Y = A^T M A.
+//Written for any channels and padding so the same code runs forward and, with flipped kernels, for the input derivatives
+template<size_t in_maps, size_t r, size_t c, size_t pad, size_t out_r, size_t out_c> struct conv_winograd_funcs
 {
-    //feed forward
-    static Matrix2D<float, r, c> convolve(Matrix2D<float, r, c>& input, Matrix2D<float, kernel_r, kernel_c>& kernel)
-    {
-        int N = (kernel_r - 1) / 2;
-        int M = (kernel_c - 1) / 2;
-        constexpr size_t out_r = r;
-        constexpr size_t out_c = c;
-        Matrix2D<float, out_r, out_c> output = { 0 };
-        
-        //change top left of kernel
-        for (int i = -N; i < (int)r - N; i += s)
+    static constexpr size_t tiles_r = (out_r + 1) / 2;
+    static constexpr size_t tiles_c = (out_c + 1) / 2;
+    static constexpr size_t tiles = tiles_r * tiles_c;
+
+    //transformed position of the 180 degree rotated kernel: G J = P G where P swaps rows 0 and 3
+    static inline size_t flipped(size_t xi)
+    {
+        size_t a = xi / 4;
+        size_t b = xi % 4;
+        a = a == 0 ? 3 : (a == 3 ? 0 : a);
+        b = b == 0 ? 3 : (b == 3 ? 0 : b);
+        return a * 4 + b;
+    }
+
+    //kernels (out_maps x in_maps x 3 x 3) to u (16 x out_maps x in_maps)
+    static void transform_kernels(const float* kernels, size_t out_maps, float* u)
+    {
+        size_t plane = out_maps * in_maps;
+        for (size_t idx = 0; idx < plane; ++idx)
         {
-            for (int j = -M; j < (int)c - M; j += s)
+            const float* g = kernels + idx * 9;
+
+            //G g
+            float t[4][3];
+            for (size_t j = 0; j < 3; ++j)
+            {
+                t[0][j] = g[j];
+                t[1][j] = 0.5f * (g[j] + g[3 + j] + g[6 + j]);
+                t[2][j] = 0.5f * (g[j] - g[3 + j] + g[6 + j]);
+                t[3][j] = g[6 + j];
+            }
+
+            //(G g) G^T
+            for (size_t i = 0; i < 4; ++i)
             {
-                //iterate over kernel
-                float sum = 0;
-                for (int n = 0; n < kernel_r; n++)
-                    for (int m = 0; m < kernel_c; m++)
-                        sum += kernel.at(n, m) * (i + n < 0 || i + n >= r || j + m < 0 || j + m >= c ? 0 : input.at(i + n, j + m));
-                output.at((i + M) / s, (j + M) / s) = sum;
+                u[(i * 4 + 0) * plane + idx] = t[i][0];
+                u[(i * 4 + 1) * plane + idx] = 0.5f * (t[i][0] + t[i][1] + t[i][2]);
+                u[(i * 4 + 2) * plane + idx] = 0.5f * (t[i][0] - t[i][1] + t[i][2]);
+                u[(i * 4 + 3) * plane + idx] = t[i][2];
             }
         }
-        return output;
     }
 
-    //accumulate gradients of kernel
-    static void back_prop_kernel(Matrix2D<float, r, c>& input, Matrix2D<float, r, c>& output, Matrix2D<float, kernel_r, kernel_c>& kernel_gradient)
+    //tiles of a tile row are transformed a vector at a time from a zero bordered copy of each map
+    static constexpr size_t width = simd_float::width;
+    static constexpr size_t tile_blocks = (tiles_c + width - 1) / width;
+    static constexpr size_t padded_r = 2 * tiles_r + 2;
+    static constexpr size_t padded_c = 2 * tile_blocks * width + 3;
+
+    //input (in_maps x r x c) to v (16 x in_maps x ld_v), this sample's tiles are columns [0, tiles)
+    static void transform_input(const float* input, float* v, size_t ld_v)
     {
-        int N = (kernel_r - 1) / 2;
-        int M = (kernel_c - 1) / 2;
-        constexpr size_t out_r = r;
-        constexpr size_t out_c = c;
+        constexpr size_t width = simd_float::width;
 
-        size_t i_0 = 0;
-        size_t j_0 = 0;
+        static thread_local std::vector<float, aligned_allocator<float>> padded(padded_r * padded_c);
+        size_t step = in_maps * ld_v;
 
-        //change top left of kernel
-        for (int i = -N; i < (int)r - N; i += s)
+        for (size_t f = 0; f < in_maps; ++f)
         {
-            for (int j = -M; j < (int)c - M; j += s)
+            //borders once per map, every tile is then read the same way
+            std::fill(padded.begin(), padded.end(), 0.0f);
+            const float* map = input + f * r * c;
+            for (size_t i = 0; i < r && i + pad < padded_r; ++i)
+                for (size_t j = 0; j < c && j + pad < padded_c; ++j)
+                    padded[(i + pad) * padded_c + j + pad] = map[i * c + j];
+
+            for (size_t t_i = 0; t_i < tiles_r; ++t_i)
             {
-                //iterate over kernel
-                float sum = 0;
-                float out = output.at(i_0, j_0);
-                for (int n = 0; n < kernel_r; n++)
-                    for (int m = 0; m < kernel_c; m++)
-                        kernel_gradient.at(n, m) += out * (i + n < 0 || i + n >= r || j + m < 0 || j + m >= c ? 0 : input.at(i + n, j + m));
-                ++j_0;
+                for (size_t blk = 0; blk < tile_blocks; ++blk)
+                {
+                    //tiles t_j, ..., t_j + width - 1 start 2 columns apart
+                    size_t t_j = blk * width;
+                    const float* src = padded.data() + 2 * t_i * padded_c + 2 * t_j;
+                    simd_float d[4][4];
+                    for (size_t a = 0; a < 4; ++a)
+                        for (size_t b = 0; b < 4; ++b)
+                            d[a][b] = simd_float::load_even(src + a * padded_c + b);
+
+                    //B^T d
+                    simd_float t[4][4];
+                    for (size_t b = 0; b < 4; ++b)
+                    {
+                        t[0][b] = d[0][b] - d[2][b];
+                        t[1][b] = d[1][b] + d[2][b];
+                        t[2][b] = d[2][b] - d[1][b];
+                        t[3][b] = d[1][b] - d[3][b];
+                    }
+
+                    //(B^T d) B
+                    simd_float out[16];
+                    for (size_t a = 0; a < 4; ++a)
+                    {
+                        out[a * 4 + 0] = t[a][0] - t[a][2];
+                        out[a * 4 + 1] = t[a][1] + t[a][2];
+                        out[a * 4 + 2] = t[a][2] - t[a][1];
+                        out[a * 4 + 3] = t[a][1] - t[a][3];
+                    }
+
+                    float* dst = v + f * ld_v + t_i * tiles_c + t_j;
+                    size_t count = tiles_c - t_j < width ? tiles_c - t_j : width;
+                    for (size_t xi = 0; xi < 16; ++xi)
+                    {
+                        if (count == width)
+                            out[xi].store(dst + xi * step);
+                        else
+                        {
+                            //last block of the row, don't spill into the next row's tiles
+                            float partial[width];
+                            out[xi].store(partial);
+                            std::copy(partial, partial + count, dst + xi * step);
+                        }
+                    }
+                }
             }
-            j_0 = 0;
-            ++i_0;
         }
     }
 
-    //feed back
-    static Matrix2D<float, r, c> convolve_back(Matrix2D<float, r, c>& input, Matrix2D<float, kernel_r, kernel_c>& kernel)
+    //m (16 x out_maps x ld_m, this sample's tiles are columns [0, tiles)) to output (out_maps x out_r x out_c) for maps [f_begin, f_end), added to or overwriting it
+    static void transform_output(const float* m, size_t ld_m, size_t out_maps, size_t f_begin, size_t f_end, float* output, bool accumulate)
     {
-        int N = (kernel_r - 1) / 2;
-        int M = (kernel_c - 1) / 2;
-        Matrix2D<float, r, c> output = { 0 };
-
-        size_t i_0 = 0;
-        size_t j_0 = 0;
-
-        //change top left of kernel
-        for (int i = -N; i < (int)r - N; i += s)
+        size_t step = out_maps * ld_m;
+        for (size_t f_0 = f_begin; f_0 < f_end; ++f_0)
         {
-            for (int j = -M; j < (int)c - M; j += s)
+            float* map = output + f_0 * out_r * out_c;
+            for (size_t t_i = 0; t_i < tiles_r; ++t_i)
             {
-                //find all possible ways convolved size_to
-                for (int n = 0; n < kernel_r; n++)
-                    for (int m = 0; m < kernel_c; m++)
-                        output.at(i + n, j + m) += kernel.at(n, m) * (i + n < 0 || i + n >= r || j + m < 0 || j + m >= c ? 0 : input.at(i_0, j_0));
-                ++j_0;
+                for (size_t t_j = 0; t_j < tiles_c; ++t_j)
+                {
+                    const float* src = m + f_0 * ld_m + t_i * tiles_c + t_j;
+
+                    //A^T m
+                    float t[2][4];
+                    for (size_t b = 0; b < 4; ++b)
+                    {
+                        t[0][b] = src[b * step] + src[(4 + b) * step] + src[(8 + b) * step];
+                        t[1][b] = src[(4 + b) * step] - src[(8 + b) * step] - src[(12 + b) * step];
+                    }
+
+                    //(A^T m) A, last tile row/col may hang over odd outputs
+                    for (size_t a = 0; a < 2 && 2 * t_i + a < out_r; ++a)
+                    {
+                        float y[2] = { t[a][0] + t[a][1] + t[a][2], t[a][1] - t[a][2] - t[a][3] };
+                        for (size_t b = 0; b < 2 && 2 * t_j + b < out_c; ++b)
+                        {
+                            float& out = map[(2 * t_i + a) * out_c + 2 * t_j + b];
+                            out = accumulate ? out + y[b] : y[b];
+                        }
+                    }
+                }
             }
-            j_0 = 0;
-            ++i_0;
         }
-        return output;
     }
 };
 
+//ACTIVATION KERNELS
+
+//tanh as a clamped rational function (odd degree 13 over even degree 6), within a few ulp of tanh over all floats.
+//Works on simd_float or scalar_float
+template<typename vec> inline vec approximate_tanh(vec x)
+{
+    //tanh rounds to +-1 from here on
+    x = min(max(x, vec::set1(-7.90531110763549805f)), vec::set1(7.90531110763549805f));
+    vec x2 = x * x;
+
+    vec p = vec::set1(-2.76076847742355e-16f);
+    p = p * x2 + vec::set1(2.00018790482477e-13f);
+    p = p * x2 + vec::set1(-8.60467152213735e-11f);
+    p = p * x2 + vec::set1(5.12229709037114e-08f);
+    p = p * x2 + vec::set1(1.48572235717979e-05f);
+    p = p * x2 + vec::set1(6.37261928875436e-04f);
+    p = p * x2 + vec::set1(4.89352455891786e-03f);
+    p = p * x;
+
+    vec q = vec::set1(1.19825839466702e-06f);
+    q = q * x2 + vec::set1(1.18534705686654e-04f);
+    q = q * x2 + vec::set1(2.26843463243900e-03f);
+    q = q * x2 + vec::set1(4.89352518554385e-03f);
+    return p / q;
+}
+
+//e^x for a simd_float or scalar_float, about 1 ulp. x is clamped to [-87.3, 88.3], so the smallest result is about 1e-38 instead of 0
+template<typename vec> inline vec approximate_exp(vec x)
+{
+    x = min(max(x, vec::set1(-87.3f)), vec::set1(88.3f));
+
+    //x = n ln2 + r, |r| <= ln2 / 2 (ln2 in two parts so r stays exact)
+    vec n = vec::round(x * vec::set1(1.44269504088896341f));
+    vec r = x - n * vec::set1(0.693359375f) + n * vec::set1(2.12194440e-4f);
+
+    vec p = vec::set1(1.9875691500e-4f);
+    p = p * r + vec::set1(1.3981999507e-3f);
+    p = p * r + vec::set1(8.3334519073e-3f);
+    p = p * r + vec::set1(4.1665795894e-2f);
+    p = p * r + vec::set1(1.6666665459e-1f);
+    p = p * r + vec::set1(5.0000001201e-1f);
+    return (p * r * r + r + vec::set1(1.0f)) * vec::exp2i(n);
+}
+
+
+//Activation functions picked at compile time by MTNN_FUNC_*. apply maps inputs to outputs, derivative takes the outputs
+//(what the layers keep). The logistic ones are written in terms of tanh, so they share its error bound and saturate smoothly
+template<size_t activation> struct activation_kernel;
+
+template<> struct activation_kernel<MTNN_FUNC_LINEAR>
+{
+    template<typename vec> static inline vec apply(vec x) { return x; }
+    template<typename vec> static inline vec derivative(vec) { return vec::set1(1.0f); }
+};
+
+//1 / (1 + e^-x) = (1 + tanh(x / 2)) / 2
+template<> struct activation_kernel<MTNN_FUNC_LOGISTIC>
+{
+    template<typename vec> static inline vec apply(vec x) { return vec::set1(0.5f) + vec::set1(0.5f) * approximate_tanh(vec::set1(0.5f) * x); }
+    template<typename vec> static inline vec derivative(vec y) { return y * (vec::set1(1.0f) - y); }
+};
+
+template<> struct activation_kernel<MTNN_FUNC_RBM> : activation_kernel<MTNN_FUNC_LOGISTIC> {};
+
+//2 / (1 + e^-x) - 1 = tanh(x / 2)
+template<> struct activation_kernel<MTNN_FUNC_BIPOLARLOGISTIC>
+{
+    template<typename vec> static inline vec apply(vec x) { return approximate_tanh(vec::set1(0.5f) * x); }
+    template<typename vec> static inline vec derivative(vec y) { return vec::set1(0.5f) * (vec::set1(1.0f) + y) * (vec::set1(1.0f) - y); }
+};
+
+template<> struct activation_kernel<MTNN_FUNC_TANH>
+{
+    template<typename vec> static inline vec apply(vec x) { return approximate_tanh(x); }
+    template<typename vec> static inline vec derivative(vec y) { return vec::set1(1.0f) - y * y; }
+};
+
+template<> struct activation_kernel<MTNN_FUNC_TANHLECUN>
+{
+    template<typename vec> static inline vec apply(vec x) { return vec::set1(1.7159f) * approximate_tanh(vec::set1(0.66666667f) * x); }
+    template<typename vec> static inline vec derivative(vec y) { return vec::set1(0.66666667f / 1.7159f) * (vec::set1(1.7159f) + y) * (vec::set1(1.7159f) - y); }
+};
+
+template<> struct activation_kernel<MTNN_FUNC_RELU>
+{
+    template<typename vec> static inline vec apply(vec x) { return max(x, vec::zero()); }
+    template<typename vec> static inline vec derivative(vec y) { return mask_positive(y, vec::set1(1.0f)); }
+};
+
+//one value through an activation
+template<size_t activation> inline float activate_value(float x)
+{
+    return activation_kernel<activation>::template apply<scalar_float>({ x }).v;
+}
+
+//out[i] = activation(in[i] + bias) for n floats, out may be in
+template<size_t activation> inline void activate_span(const float* in, float bias, float* out, size_t n)
+{
+    using kernel = activation_kernel<activation>;
+    simd_float b = simd_float::set1(bias);
+    size_t i = 0;
+    for (; i + simd_float::width <= n; i += simd_float::width)
+        kernel::template apply<simd_float>(simd_float::load(in + i) + b).store(out + i);
+    for (; i < n; ++i)
+        out[i] = kernel::template apply<scalar_float>({ in[i] + bias }).v;
+}
+
+//out[i] = activation(in[i] + biases[i]) for n floats (no biases if nullptr), out may be in
+template<size_t activation> inline void activate_span(const float* in, const float* biases, float* out, size_t n)
+{
+    if (biases == nullptr)
+    {
+        activate_span<activation>(in, 0.0f, out, n);
+        return;
+    }
+    using kernel = activation_kernel<activation>;
+    size_t i = 0;
+    for (; i + simd_float::width <= n; i += simd_float::width)
+        kernel::template apply<simd_float>(simd_float::load(in + i) + simd_float::load(biases + i)).store(out + i);
+    for (; i < n; ++i)
+        out[i] = kernel::template apply<scalar_float>({ in[i] + biases[i] }).v;
+}
+
+//out = softmax(in) over n floats, out may be in. The maximum is subtracted first, so nothing overflows
+inline void softmax_span(const float* in, float* out, size_t n)
+{
+    size_t i = 0;
+    simd_float m = simd_float::set1(-INFINITY);
+    for (; i + simd_float::width <= n; i += simd_float::width)
+        m = max(m, simd_float::load(in + i));
+    float max_in = m.hmax();
+    for (; i < n; ++i)
+        max_in = in[i] > max_in ? in[i] : max_in;
+
+    simd_float shift = simd_float::set1(max_in);
+    simd_float sums = simd_float::zero();
+    float sum = 0.0f;
+    for (i = 0; i + simd_float::width <= n; i += simd_float::width)
+    {
+        simd_float e = approximate_exp(simd_float::load(in + i) - shift);
+        e.store(out + i);
+        sums = sums + e;
+    }
+    for (; i < n; ++i)
+    {
+        out[i] = approximate_exp(scalar_float{ in[i] - max_in }).v;
+        sum += out[i];
+    }
+
+    float inv_sum = 1.0f / (sum + sums.hsum());
+    simd_float scale = simd_float::set1(inv_sum);
+    for (i = 0; i + simd_float::width <= n; i += simd_float::width)
+        (simd_float::load(out + i) * scale).store(out + i);
+    for (; i < n; ++i)
+        out[i] *= inv_sum;
+}
+
+//loglikelihood through a softmax over n floats in one pass, given its inputs (logits), outputs (p) and the labels (y). Writes the logits'
+//derivatives p * sum(y) - y and returns -sum(y * log p), with log p = logit - max logit + log(p at the max) so a p rounded to 0 can't make it infinite
+inline float softmax_log_likelihood_span(const float* logits, const float* p, const float* y, float* deriv, size_t n)
+{
+    size_t top = 0;
+    float sum_y = 0.0f;
+    for (size_t i = 0; i < n; ++i)
+    {
+        top = logits[i] > logits[top] ? i : top;
+        sum_y += y[i];
+    }
+
+    //log p = logit + shift
+    simd_float shift = simd_float::set1(log(p[top]) - logits[top]);
+    simd_float total = simd_float::set1(sum_y);
+    simd_float losses = simd_float::zero();
+    size_t i = 0;
+    for (; i + simd_float::width <= n; i += simd_float::width)
+    {
+        simd_float y_i = simd_float::load(y + i);
+        (simd_float::load(p + i) * total - y_i).store(deriv + i);
+        losses = losses + y_i * (simd_float::load(logits + i) + shift);
+    }
+    float loss = losses.hsum();
+    for (; i < n; ++i)
+    {
+        deriv[i] = p[i] * sum_y - y[i];
+        loss += y[i] * (logits[i] + log(p[top]) - logits[top]);
+    }
+    return -loss;
+}
+
+//deriv[i] *= activation'(outputs[i]) for n floats
+template<size_t activation> inline void chain_activation_span(float* deriv, const float* outputs, size_t n)
+{
+    using kernel = activation_kernel<activation>;
+    size_t i = 0;
+    for (; i + simd_float::width <= n; i += simd_float::width)
+        (simd_float::load(deriv + i) * kernel::template derivative<simd_float>(simd_float::load(outputs + i))).store(deriv + i);
+    for (; i < n; ++i)
+        deriv[i] *= kernel::template derivative<scalar_float>({ outputs[i] }).v;
+}
+
 //helper functions class - defines actions used in all classes (like activations, chain rule, etc.)
 template<size_t feature, size_t row, size_t col> class Layer_Functions
 {
@@ -215,57 +597,93 @@ public:
     using feature_maps_type = FeatureMap<feature, row, col>;
     using feature_maps_vector_type = FeatureMapVector<feature, row, col>;
 
-    //apply chain rule (store in fm, output of feed forward as o_fm)
+    //state kept between a layer's feed forwards and its backprop (see LSTMLayer, MaxpoolLayer), the others keep none
+    struct state_type
+    {
+        void reset() {}
+    };
+
+    //point the calling thread's calls at state (nullptr for the layer's own), nothing to do without state
+    static void bind_state(state_type*) {}
+
+    //start a new sequence on the state in use
+    static void reset_state() {}
+
+    //apply chain rule (store in fm, output of feed forward as o_fm), the whole map in one pass
     static void chain_activations(FeatureMap<feature, row, col>& fm, FeatureMap<feature, row, col>& o_fm, size_t activation)
     {
-        for (size_t f = 0; f < feature; ++f)
-            for (int i = 0; i < row; ++i)
-                for (int j = 0; j < col; ++j)
-                    fm[f].at(i, j) *= activation_derivative(o_fm[f].at(i, j), activation);
+        constexpr size_t n = feature * row * col;
+        switch (activation)
+        {
+        case MTNN_FUNC_LINEAR:
+            break;
+        case MTNN_FUNC_LOGISTIC:
+        case MTNN_FUNC_RBM:
+            chain_activation_span<MTNN_FUNC_LOGISTIC>(fm.data(), o_fm.data(), n);
+            break;
+        case MTNN_FUNC_BIPOLARLOGISTIC:
+            chain_activation_span<MTNN_FUNC_BIPOLARLOGISTIC>(fm.data(), o_fm.data(), n);
+            break;
+        case MTNN_FUNC_TANH:
+            chain_activation_span<MTNN_FUNC_TANH>(fm.data(), o_fm.data(), n);
+            break;
+        case MTNN_FUNC_TANHLECUN:
+            chain_activation_span<MTNN_FUNC_TANHLECUN>(fm.data(), o_fm.data(), n);
+            break;
+        case MTNN_FUNC_RELU:
+            chain_activation_span<MTNN_FUNC_RELU>(fm.data(), o_fm.data(), n);
+            break;
+        }
     }
 
-    //returns the activation of an input
+    //returns the activation of an input (layers with a compile time activation use activation_kernel directly)
     static inline float activate(float value, size_t activation)
     {
-        if (activation == MTNN_FUNC_LINEAR)
+        switch (activation)
+        {
+        case MTNN_FUNC_LOGISTIC:
+        case MTNN_FUNC_RBM:
+            return activate_value<MTNN_FUNC_LOGISTIC>(value);
+        case MTNN_FUNC_BIPOLARLOGISTIC:
+            return activate_value<MTNN_FUNC_BIPOLARLOGISTIC>(value);
+        case MTNN_FUNC_TANH:
+            return activate_value<MTNN_FUNC_TANH>(value);
+        case MTNN_FUNC_TANHLECUN:
+            return activate_value<MTNN_FUNC_TANHLECUN>(value);
+        case MTNN_FUNC_RELU:
+            return activate_value<MTNN_FUNC_RELU>(value);
+        default:
             return value;
-        else if (activation == MTNN_FUNC_LOGISTIC || activation == MTNN_FUNC_RBM)
-            return value < 5 && value > -5 ? (1 / (1 + exp(-value))) : (value >= 5 ? 1.0f : 0.0f);
-        else if (activation == MTNN_FUNC_BIPOLARLOGISTIC)
-            return value < 5 && value > -5 ? ((2 / (1 + exp(-value))) - 1) : (value >= 5 ? 1.0f :  - 1.0f);
-        else if (activation == MTNN_FUNC_TANH)
-            return value < 5 && value > -5 ? tanh(value) : (value >= 5 ? 1.0f :  - 1.0f);
-        else if (activation == MTNN_FUNC_TANHLECUN)
-            return value < 5 && value > -5 ? 1.7159f * tanh(0.66666667f * value) : ((value >= 5 ? 1.7159f :  - 1.7159f));
-        else if (activation == MTNN_FUNC_RELU)
-            return value > 0 ? value : 0;
+        }
     }
 
     //derivative of activation function (pass in the output of the activation function)
     static inline float activation_derivative(float value, size_t activation)
     {
-        if (activation == MTNN_FUNC_LINEAR)
-            return 1;
-        else if (activation == MTNN_FUNC_LOGISTIC || activation == MTNN_FUNC_RBM)
-            return value * (1 - value);
-        else if (activation == MTNN_FUNC_BIPOLARLOGISTIC)
-            return (1 + value) * (1 - value) / 2;
-        else if (activation == MTNN_FUNC_TANH)
-            return 1 - value * value;
-        else if (activation == MTNN_FUNC_TANHLECUN)
-            return (0.66666667f / 1.7159f * (1.7159f + value) * (1.7159f - value));
-        else if (activation == MTNN_FUNC_RELU)
-            return value > 0 ? 1.0f : 0.0f;
-    }
-
-    //use to sample an RBM (each cell is independent of others)
+        switch (activation)
+        {
+        case MTNN_FUNC_LOGISTIC:
+        case MTNN_FUNC_RBM:
+            return activation_kernel<MTNN_FUNC_LOGISTIC>::derivative<scalar_float>({ value }).v;
+        case MTNN_FUNC_BIPOLARLOGISTIC:
+            return activation_kernel<MTNN_FUNC_BIPOLARLOGISTIC>::derivative<scalar_float>({ value }).v;
+        case MTNN_FUNC_TANH:
+            return activation_kernel<MTNN_FUNC_TANH>::derivative<scalar_float>({ value }).v;
+        case MTNN_FUNC_TANHLECUN:
+            return activation_kernel<MTNN_FUNC_TANHLECUN>::derivative<scalar_float>({ value }).v;
+        case MTNN_FUNC_RELU:
+            return activation_kernel<MTNN_FUNC_RELU>::derivative<scalar_float>({ value }).v;
+        default:
+            return 1.0f;
+        }
+    }
+
+    //use to sample an RBM (each cell is independent of others), a whole map of draws at a time
     template<size_t f, size_t r, size_t c>
-    static inline void stochastic_sample(FeatureMap<f, r, c>& data)
+    static inline void stochastic_sample(FeatureMap<f, r, c>& data, philox_stream& rng = thread_rng())
     {
-        for (size_t f = 0; f < f; ++f)
-            for (size_t i = 0; i < r; ++i)
-                for (size_t j = 0; j < c; ++j)
-                    data[f].at(i, j) = ((rand() * 1.0f) / RAND_MAX < data[f].at(i, j)) ? 1 : 0;
+        rng.sample(data.data(), data.elements());
+        data.touch();
     }
 };
 
@@ -317,7 +735,7 @@ public:
     static constexpr size_t activation = activation_function;
 
     //define for creating tuples or using within templates
-    using out_feature_maps_type = FeatureMap<out_features, use_padding ? rows / stride + 1 : (rows - kernel_size) / stride + 1, use_padding ? cols / stride + 1 : (cols - kernel_size) / stride + 1>;
+    using out_feature_maps_type = FeatureMap<out_features, use_padding ? (rows - 1) / stride + 1 : (rows - kernel_size) / stride + 1, use_padding ? (cols - 1) / stride + 1 : (cols - kernel_size) / stride + 1>;
     using weights_type = decltype(weights);
     using biases_type = decltype(biases);
     using generative_biases_type = decltype(generative_biases);
@@ -326,6 +744,23 @@ public:
     using biases_vector_type = std::vector<biases_type>;
     using generative_biases_vector_type = std::vector<generative_biases_type>;
 
+    //im2col/GEMM engine for this layer's geometry
+    using conv_gemm = conv_gemm_funcs<features, rows, cols, kernel_size, stride, use_padding>;
+    //direct kernels, picked over GEMM for the forward pass when conv_direct::specialized
+    using conv_direct = conv_direct_funcs<features, rows, cols, kernel_size, stride, use_padding>;
+    //Winograd F(2x2, 3x3), picked over everything else for 3x3 stride 1 (forward and input derivatives). With only a few input maps the
+    //transforms cost more than the multiplies they save, so those layers stay on the direct kernels.
+    //The transformed kernels are cached per thread and only recomputed when weights.version() changes, so anything writing the weights
+    //through data(), at() or the maps has to call weights.touch() afterwards or the cached kernels go stale
+    static constexpr bool use_winograd = kernel_size == 3 && stride == 1 && features >= 8;
+    using conv_winograd = conv_winograd_funcs<features, rows, cols, (use_padding ? 1 : 0), conv_gemm::out_r, conv_gemm::out_c>;
+    //input derivatives are the transposed convolution: flipped kernels over the output maps, padded by 2 - pad
+    using conv_winograd_back = conv_winograd_funcs<out_features, conv_gemm::out_r, conv_gemm::out_c, (use_padding ? 1 : 2), rows, cols>;
+
+    //output maps per task (forwards, kernel gradients) and input maps per task (input derivatives), from the multiply-adds per map and sample
+    static constexpr size_t out_maps_grain = parallel_grain(features * kernel_size * kernel_size * conv_gemm::out_size, 4);
+    static constexpr size_t in_maps_grain = parallel_grain(out_features * kernel_size * kernel_size * conv_gemm::out_size);
+
     //never used, static class
     ConvolutionLayer() = default;
 
@@ -335,179 +770,368 @@ public:
     //feed forwards given input, weights, biases to output
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        constexpr size_t out_rows = use_padding ? rows / stride + 1 : (rows - kernel_size) / stride + 1;
-        constexpr size_t out_cols = use_padding ? cols / stride + 1 : (cols - kernel_size) / stride + 1;
+        if (use_winograd)
+            feed_forwards_winograd(1, &input, &output, params_w, params_b);
+        else if (conv_direct::specialized)
+            feed_forwards_direct(1, &input, &output, params_w, params_b);
+        else
+            feed_forwards_gemm(1, &input, &output, params_w, params_b);
+    }
+
+    //undo feed forwards, with generative biases instead
+    static void feed_backwards(feature_maps_type& output, out_feature_maps_type& input, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
+    {
+        feed_backwards_gemm(1, &input, &output, params_w, params_b);
+    }
 
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
+    //accumulate gradients in given, using given weights, biases, outputs, activations, derivs, etc. WILL APPLY IF ONLINE LEARNING and vanilla backprop
+    static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    {
+        back_prop_gemm(1, previous_layer_activation, &deriv, &activations_pre, &out_deriv, params_w, w_grad, b_grad);
+
+        if (!online)
+            return;
+
+        //L2 weight decay
+        if (use_l2_weight_decay)
         {
-            //sum the kernels
-            for (size_t f = 0; f < features; ++f)
+            for (size_t idx = 0; idx < weights_type::elements(); ++idx)
+                w_grad.data()[idx] += 2 * weight_decay_factor * params_w.data()[idx];
+            if (use_biases && include_biases_decay)
+                for (size_t idx = 0; idx < biases_type::elements(); ++idx)
+                    b_grad.data()[idx] += 2 * weight_decay_factor * params_b.data()[idx];
+        }
+
+        //update for online (momentum)
+        if (use_momentum)
+        {
+            for (size_t idx = 0; idx < weights_type::elements(); ++idx)
             {
-                //sum all convolutions from previous feature maps and put in output map
-                add<float, out_rows, out_cols>(output[f_0],
-                    conv_helper_funcs<rows, cols, kernel_size, kernel_size, stride, use_padding>::convolve(input[f], params_w[f_0 * features + f]));
-                //add bias (if applicable)
-                if (use_biases)
-                    for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                        for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                            output[f_0].at(i_0, j_0) += params_b[f_0 * features + f].at(0, 0);
+                params_w.data()[idx] += -learning_rate * (w_grad.data()[idx] + momentum_term * weights_momentum.data()[idx]);
+                weights_momentum.data()[idx] = momentum_term * weights_momentum.data()[idx] + w_grad.data()[idx];
+                w_grad.data()[idx] = 0;
             }
 
-            //apply activation (if not linear)
-            if (activation_function != MTNN_FUNC_LINEAR)
-                for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                    for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                        output[f_0].at(i_0, j_0) = activate(output[f_0].at(i_0, j_0), activation);
+            for (size_t idx = 0; idx < biases_type::elements(); ++idx)
+            {
+                params_b.data()[idx] += -learning_rate * (b_grad.data()[idx] + momentum_term * biases_momentum.data()[idx]);
+                biases_momentum.data()[idx] = momentum_term * biases_momentum.data()[idx] + b_grad.data()[idx];
+                b_grad.data()[idx] = 0;
+            }
         }
-    }
 
-    //undo feed forwards, with generative biases instead
-    static void feed_backwards(feature_maps_type& output, out_feature_maps_type& input, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
-    {
-        for (size_t f = 0; f < features; ++f)
+        //vanilla online
+        else
         {
-            //go backwards over all output maps to current map
-            for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-                add<float, rows, cols>(output[f],
-                    conv_helper_funcs<rows, cols, kernel_size, kernel_size, stride, use_padding>::convolve_back(input[f_0], params_w[f_0 * features + f]));
+            for (size_t idx = 0; idx < weights_type::elements(); ++idx)
+            {
+                params_w.data()[idx] += -learning_rate * w_grad.data()[idx];
+                w_grad.data()[idx] = 0;
+            }
 
-            //activate if necessary
-            if (activation_function != MTNN_FUNC_LINEAR)
+            for (size_t idx = 0; idx < biases_type::elements(); ++idx)
             {
-                for (size_t i = 0; i < rows; ++i)
-                {
-                    for (size_t j = 0; j < cols; ++j)
-                    {
-                        if (use_biases && activation_function == MTNN_FUNC_RBM)
-                            output[f].at(i, j) += params_b[f].at(i, j);
-                        output[f].at(i, j) = activate(input[f].at(i, j), activation_function);
-                    }
-                }
+                params_b.data()[idx] += -learning_rate * b_grad.data()[idx];
+                b_grad.data()[idx] = 0;
             }
         }
+
+        //invalidates the transformed kernels
+        params_w.touch();
     }
 
-    //accumulate gradients in given, using given weights, biases, outputs, activations, derivs, etc. WILL APPLY IF ONLINE LEARNING and vanilla backprop
-    static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    //batch feed forwards, whole batch is one GEMM
+    static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        constexpr size_t out_rows = use_padding ? rows / stride + 1 : (rows - kernel_size) / stride + 1;
-        constexpr size_t out_cols = use_padding ? cols / stride + 1 : (cols - kernel_size) / stride + 1;
+        if (use_winograd)
+            feed_forwards_winograd(outputs.size(), inputs.data(), outputs.data(), params_w, params_b);
+        else if (conv_direct::specialized)
+            feed_forwards_direct(outputs.size(), inputs.data(), outputs.data(), params_w, params_b);
+        else
+            feed_forwards_gemm(outputs.size(), inputs.data(), outputs.data(), params_w, params_b);
+    }
 
-        //adjust gradients and update features
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-        {
-            for (size_t f = 0; f < features; ++f)
-            {
-                //update deltas
-                add<float, rows, cols>(out_deriv[f],
-                    conv_helper_funcs<rows, cols, kernel_size, kernel_size, stride, use_padding>::convolve_back(deriv[f_0], params_w[f_0 * features + f]));
+    //batch feed backwards, whole batch is one GEMM
+    static void feed_backwards(feature_maps_vector_type& outputs, out_feature_maps_vector_type& inputs, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
+    {
+        feed_backwards_gemm(outputs.size(), inputs.data(), outputs.data(), params_w, params_b);
+    }
 
-                //adjust the gradient
-                conv_helper_funcs<rows, cols, kernel_size, kernel_size, stride, use_padding>::back_prop_kernel(activations_pre[f], deriv[f_0], w_grad[f_0 * features + f]);
+    //batch backprop, one GEMM each for the kernel and input gradients
+    static void back_prop(size_t previous_layer_activation, out_feature_maps_vector_type& derivs, feature_maps_vector_type& activations_pre_vec, feature_maps_vector_type& out_derivs, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    {
+        back_prop_gemm(derivs.size(), previous_layer_activation, derivs.data(), activations_pre_vec.data(), out_derivs.data(), params_w, w_grad, b_grad);
+    }
 
-                //L2 weight decay
-                if (use_l2_weight_decay && online)
-                    for (size_t i = 0; i < kernel_size; ++i)
-                        for (size_t j = 0; j < kernel_size; ++j)
-                            w_grad[f_0 * features + f].at(i, j) += params_w[f_0 * features + f].at(i, j);
+    //outputs = activate(kernels * im2col(inputs) + biases) for n_in samples at once
+    static void feed_forwards_gemm(size_t n_in, feature_maps_type* inputs, out_feature_maps_type* outputs, weights_type& params_w, biases_type& params_b)
+    {
+        constexpr size_t out_size = conv_gemm::out_size;
+        size_t ld = n_in * out_size;
+
+        static thread_local std::vector<float> columns;
+        static thread_local std::vector<float> sums;
+        columns.resize(conv_gemm::patch_size * ld);
+        sums.resize(out_features * ld);
+
+        //every sample's columns side by side
+        for (size_t in = 0; in < n_in; ++in)
+            conv_gemm::im2col(inputs[in].data(), columns.data() + in * out_size, ld);
 
+        //output maps are split across threads (the buffers are this thread's, so pass them by pointer)
+        const float* cols_data = columns.data();
+        float* sums_data = sums.data();
+        parallel_for(0, out_features, out_maps_grain, [&](size_t f_begin, size_t f_end)
+        {
+            sgemm(false, false, f_end - f_begin, ld, conv_gemm::patch_size, 1.0f, params_w.data() + f_begin * conv_gemm::patch_size, conv_gemm::patch_size, cols_data, ld, 0.0f, sums_data + f_begin * ld, ld);
+
+            for (size_t f_0 = f_begin; f_0 < f_end; ++f_0)
+            {
+                //a bias is kept per kernel, they all land on the same map
+                float bias = 0.0f;
                 if (use_biases)
-                {
-                    //normal derivative
-                    for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                        for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                            b_grad[f_0 * features + f].at(0, 0) += deriv[f_0].at(i_0, j_0);
+                    for (size_t f = 0; f < features; ++f)
+                        bias += params_b.data()[f_0 * features + f];
 
-                    //l2 weight decay
-                    if (use_l2_weight_decay && include_biases_decay && online)
-                        b_grad[f_0 * features + f].at(0, 0) += 2 * weight_decay_factor * params_b[f_0 * features + f].at(0, 0);
+                //unstack and apply activation
+                for (size_t in = 0; in < n_in; ++in)
+                {
+                    float* out = outputs[in].data() + f_0 * out_size;
+                    const float* src = sums_data + f_0 * ld + in * out_size;
+                    activate_span<activation_function>(src, bias, out, out_size);
                 }
+            }
+        });
+    }
 
-                //update for online (momentum)
-                if (use_momentum && online)
-                {
-                    for (size_t i = 0; i < kernel_size; ++i)
-                    {
-                        for (size_t j = 0; j < kernel_size; ++j)
-                        {
-                            params_w[f_0 * features + f].at(i, j) += -learning_rate * (w_grad[f_0 * features + f].at(i, j) + momentum_term * weights_momentum[f_0 * features + f].at(i, j));
-                            weights_momentum[f_0 * features + f].at(i, j) = momentum_term * weights_momentum[f_0 * features + f].at(i, j) + w_grad[f_0 * features + f].at(i, j);
-                            w_grad[f_0 * features + f].at(i, j) = 0;
-                        }
-                    }
+    //outputs = activate(direct convolution + biases), sample by sample
+    static void feed_forwards_direct(size_t n_in, feature_maps_type* inputs, out_feature_maps_type* outputs, weights_type& params_w, biases_type& params_b)
+    {
+        constexpr size_t out_rows = conv_direct::out_r;
+        constexpr size_t out_cols = conv_direct::out_c;
+        constexpr size_t ld_out = conv_direct::ld_out;
+
+        static thread_local std::vector<float, aligned_allocator<float>> padded(conv_direct::padded_size);
+        static thread_local std::vector<float, aligned_allocator<float>> sums(out_features * out_rows * ld_out);
+
+        const float* padded_data = padded.data();
+        float* sums_data = sums.data();
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            conv_direct::pad_input(inputs[in].data(), padded.data());
 
+            //output maps are split across threads
+            float* output = outputs[in].data();
+            parallel_for(0, out_features, out_maps_grain, [&](size_t f_begin, size_t f_end)
+            {
+                conv_direct::convolve(padded_data, params_w.data() + f_begin * features * kernel_size * kernel_size, f_end - f_begin, sums_data + f_begin * out_rows * ld_out);
+
+                //drop the row padding, add bias and activate
+                for (size_t f_0 = f_begin; f_0 < f_end; ++f_0)
+                {
+                    float bias = 0.0f;
                     if (use_biases)
+                        for (size_t f = 0; f < features; ++f)
+                            bias += params_b.data()[f_0 * features + f];
+
+                    for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
                     {
-                        params_b[f_0 * features + f].at(0, 0) += -learning_rate * (b_grad[f_0 * features + f].at(0, 0) + momentum_term * biases_momentum[f_0 * features + f].at(0, 0));
-                        biases_momentum[f_0 * features + f].at(0, 0) = momentum_term * biases_momentum[f_0 * features + f].at(0, 0) + b_grad[f_0 * features + f].at(0, 0);
-                        b_grad[f_0 * features + f].at(0, 0) = 0;
+                        float* out = output + (f_0 * out_rows + i_0) * out_cols;
+                        const float* src = sums_data + (f_0 * out_rows + i_0) * ld_out;
+                        activate_span<activation_function>(src, bias, out, out_cols);
                     }
                 }
+            });
+        }
+    }
 
-                //vanilla online
-                else if (online)
-                {
-                    for (size_t i = 0; i < kernel_size; ++i)
-                    {
-                        for (size_t j = 0; j < kernel_size; ++j)
-                        {
-                            params_w[f_0 * features + f].at(i, j) += -learning_rate * w_grad[f_0 * features + f].at(i, j);
-                            w_grad[f_0 * features + f].at(i, j) = 0;
-                        }
-                    }
+    //Winograd transformed kernels for params_w, only recomputed when its version changes (one cache per thread)
+    static const float* winograd_kernels(weights_type& params_w)
+    {
+        static thread_local size_t cached_version = 0;
+        static thread_local std::vector<float> cached(16 * out_features * features);
+        if (cached_version != params_w.version())
+        {
+            conv_winograd::transform_kernels(params_w.data(), out_features, cached.data());
+            cached_version = params_w.version();
+        }
+        return cached.data();
+    }
+
+    //outputs = activate(Winograd convolution + biases), 16 GEMMs for the whole batch
+    static void feed_forwards_winograd(size_t n_in, feature_maps_type* inputs, out_feature_maps_type* outputs, weights_type& params_w, biases_type& params_b)
+    {
+        constexpr size_t tiles = conv_winograd::tiles;
+        constexpr size_t out_size = conv_gemm::out_size;
+        size_t ld = n_in * tiles;
+
+        const float* u = winograd_kernels(params_w);
 
+        static thread_local std::vector<float> v;
+        static thread_local std::vector<float> m;
+        v.resize(16 * features * ld);
+        m.resize(16 * out_features * ld);
+
+        for (size_t in = 0; in < n_in; ++in)
+            conv_winograd::transform_input(inputs[in].data(), v.data() + in * tiles, ld);
+
+        //output maps are split across threads, each does its rows of all 16 GEMMs and their output transforms
+        const float* v_data = v.data();
+        float* m_data = m.data();
+        parallel_for(0, out_features, out_maps_grain, [&](size_t f_begin, size_t f_end)
+        {
+            for (size_t xi = 0; xi < 16; ++xi)
+                sgemm(false, false, f_end - f_begin, ld, features, 1.0f, u + (xi * out_features + f_begin) * features, features, v_data + xi * features * ld, ld, 0.0f, m_data + (xi * out_features + f_begin) * ld, ld);
+
+            for (size_t in = 0; in < n_in; ++in)
+            {
+                conv_winograd::transform_output(m_data + in * tiles, ld, out_features, f_begin, f_end, outputs[in].data(), false);
+
+                for (size_t f_0 = f_begin; f_0 < f_end; ++f_0)
+                {
+                    float bias = 0.0f;
                     if (use_biases)
-                    {
-                        params_b[f_0 * features + f].at(0, 0) += -learning_rate * b_grad[f_0 * features + f].at(0, 0);
-                        b_grad[f_0 * features + f].at(0, 0) = 0;
-                    }
+                        for (size_t f = 0; f < features; ++f)
+                            bias += params_b.data()[f_0 * features + f];
+
+                    float* out = outputs[in].data() + f_0 * out_size;
+                    activate_span<activation_function>(out, bias, out, out_size);
                 }
             }
-        }
-
-        //apply derivatives (from chain rule)
-        chain_activations(out_deriv, activations_pre, previous_layer_activation);
+        });
     }
 
-    //batch feed forwards
-    static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases)
+    //out_derivs += flipped Winograd convolution of derivs (the transposed convolution), before the chain rule
+    static void back_prop_winograd_input(size_t n_in, out_feature_maps_type* derivs, feature_maps_type* out_derivs, weights_type& params_w)
     {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_forwards(inputs[in], outputs[in], params_w, params_b);
+        constexpr size_t tiles = conv_winograd_back::tiles;
+        size_t ld = n_in * tiles;
+
+        const float* u = winograd_kernels(params_w);
+
+        static thread_local std::vector<float> v;
+        static thread_local std::vector<float> m;
+        v.resize(16 * out_features * ld);
+        m.resize(16 * features * ld);
+
+        for (size_t in = 0; in < n_in; ++in)
+            conv_winograd_back::transform_input(derivs[in].data(), v.data() + in * tiles, ld);
+
+        //kernels transposed (maps swap roles) and flipped (positions permuted), input maps are split across threads
+        const float* v_data = v.data();
+        float* m_data = m.data();
+        parallel_for(0, features, in_maps_grain, [&](size_t f_begin, size_t f_end)
+        {
+            for (size_t xi = 0; xi < 16; ++xi)
+                sgemm(true, false, f_end - f_begin, ld, out_features, 1.0f, u + conv_winograd::flipped(xi) * out_features * features + f_begin, features, v_data + xi * out_features * ld, ld, 0.0f, m_data + (xi * features + f_begin) * ld, ld);
+
+            for (size_t in = 0; in < n_in; ++in)
+                conv_winograd_back::transform_output(m_data + in * tiles, ld, features, f_begin, f_end, out_derivs[in].data(), true);
+        });
     }
 
-    //batch feed backwards
-    static void feed_backwards(feature_maps_vector_type& outputs, out_feature_maps_vector_type& inputs, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
+    //outputs = activate(col2im(kernels^T * inputs) + generative biases) for n_in samples at once
+    static void feed_backwards_gemm(size_t n_in, out_feature_maps_type* inputs, feature_maps_type* outputs, weights_type& params_w, generative_biases_type& params_b)
     {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_backwards(outputs[in], inputs[in], params_w, params_b);
+        constexpr size_t out_size = conv_gemm::out_size;
+        size_t ld = n_in * out_size;
+
+        static thread_local std::vector<float> stacked;
+        static thread_local std::vector<float> columns;
+        stacked.resize(out_features * ld);
+        columns.resize(conv_gemm::patch_size * ld);
+
+        for (size_t in = 0; in < n_in; ++in)
+            for (size_t f_0 = 0; f_0 < out_features; ++f_0)
+                std::copy(inputs[in].data() + f_0 * out_size, inputs[in].data() + (f_0 + 1) * out_size, stacked.data() + f_0 * ld + in * out_size);
+
+        sgemm(true, false, conv_gemm::patch_size, ld, out_features, 1.0f, params_w.data(), conv_gemm::patch_size, stacked.data(), ld, 0.0f, columns.data(), ld);
+
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            float* out = outputs[in].data();
+            std::fill(out, out + feature_maps_type::elements(), 0.0f);
+            conv_gemm::col2im(columns.data() + in * out_size, ld, out, 0, features);
+            activate_span<activation_function>(out, (use_biases && activation_function == MTNN_FUNC_RBM) ? params_b.data() : nullptr, out, feature_maps_type::elements());
+        }
     }
 
-    //batch backprop
-    static void back_prop(size_t previous_layer_activation, out_feature_maps_vector_type& derivs, feature_maps_vector_type& activations_pre_vec, feature_maps_vector_type& out_derivs, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    //accumulate kernel and bias gradients and add input derivatives for n_in samples at once
+    static void back_prop_gemm(size_t n_in, size_t previous_layer_activation, out_feature_maps_type* derivs, feature_maps_type* activations_pre_vec, feature_maps_type* out_derivs, weights_type& params_w, weights_type& w_grad, biases_type& b_grad)
     {
-        for (size_t in = 0; in < derivs.size(); ++in)
-            back_prop(previous_layer_activation, derivs[in], activations_pre_vec[in], out_derivs[in], false, learning_rate, use_momentum, momentum_term, use_l2_weight_decay, include_biases_decay, weight_decay_factor, params_w, params_b, w_grad, b_grad);
+        constexpr size_t out_size = conv_gemm::out_size;
+        size_t ld = n_in * out_size;
+
+        static thread_local std::vector<float> stacked;
+        static thread_local std::vector<float> columns;
+        stacked.resize(out_features * ld);
+        columns.resize(conv_gemm::patch_size * ld);
+
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            for (size_t f_0 = 0; f_0 < out_features; ++f_0)
+                std::copy(derivs[in].data() + f_0 * out_size, derivs[in].data() + (f_0 + 1) * out_size, stacked.data() + f_0 * ld + in * out_size);
+            conv_gemm::im2col(activations_pre_vec[in].data(), columns.data() + in * out_size, ld);
+        }
+
+        //output maps' kernels are split across threads
+        const float* stacked_data = stacked.data();
+        float* cols_data = columns.data();
+        parallel_for(0, out_features, out_maps_grain, [&](size_t f_begin, size_t f_end)
+        {
+            //adjust the gradient: w_grad += derivs * columns^T
+            sgemm(false, true, f_end - f_begin, conv_gemm::patch_size, ld, 1.0f, stacked_data + f_begin * ld, ld, cols_data, ld, 1.0f, w_grad.data() + f_begin * conv_gemm::patch_size, conv_gemm::patch_size);
+
+            //normal derivative of the biases, every kernel of an output map gets the same one
+            if (use_biases)
+            {
+                for (size_t f_0 = f_begin; f_0 < f_end; ++f_0)
+                {
+                    float sum = 0.0f;
+                    for (size_t idx = 0; idx < ld; ++idx)
+                        sum += stacked_data[f_0 * ld + idx];
+                    for (size_t f = 0; f < features; ++f)
+                        b_grad.data()[f_0 * features + f] += sum;
+                }
+            }
+        });
+
+        //update deltas: out_derivs += col2im(kernels^T * derivs), input maps are split across threads
+        if (use_winograd)
+            back_prop_winograd_input(n_in, derivs, out_derivs, params_w);
+        else
+        {
+            constexpr size_t taps = kernel_size * kernel_size;
+            parallel_for(0, features, in_maps_grain, [&](size_t f_begin, size_t f_end)
+            {
+                sgemm(true, false, (f_end - f_begin) * taps, ld, out_features, 1.0f, params_w.data() + f_begin * taps, conv_gemm::patch_size, stacked_data, ld, 0.0f, cols_data + f_begin * taps * ld, ld);
+                for (size_t in = 0; in < n_in; ++in)
+                    conv_gemm::col2im(cols_data + in * out_size, ld, out_derivs[in].data(), f_begin, f_end);
+            });
+        }
+
+        //apply derivatives (from chain rule)
+        for (size_t in = 0; in < n_in; ++in)
+            chain_activations(out_derivs[in], activations_pre_vec[in], previous_layer_activation);
     }
 
     //perform wake sleep DOESN'T ACCUMULATE IN GRADIENTS, applies directly
     static void wake_sleep(float& learning_rate, size_t markov_iterations, bool use_dropout)
     {
-        constexpr size_t out_rows = use_padding ? rows / stride + 1 : (rows - kernel_size) / stride + 1;
-        constexpr size_t out_cols = use_padding ? cols / stride + 1 : (cols - kernel_size) / stride + 1;
+        constexpr size_t out_rows = conv_gemm::out_r;
+        constexpr size_t out_cols = conv_gemm::out_c;
 
-        //find difference via gibbs sampling
-        feature_maps_type original = { 0 };
-        for (size_t f = 0; f < features; ++f)
-            original[f] = feature_maps[f].clone();
+        //find difference via gibbs sampling, buffers are kept between calls
+        static thread_local feature_maps_type original = { 0 };
+        original = feature_maps;
 
-        FeatureMap<out_features, out_rows, out_cols> discriminated = { 0 };
-        FeatureMap<out_features, out_rows, out_cols> reconstructed = { 0 };
+        static thread_local FeatureMap<out_features, out_rows, out_cols> discriminated = { 0 };
+        static thread_local FeatureMap<out_features, out_rows, out_cols> reconstructed = { 0 };
+        std::fill(discriminated.data(), discriminated.data() + discriminated.elements(), 0.0f);
 
         //Sample, but don't "normalize" second time
         feed_forwards(discriminated);
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-            reconstructed[f_0] = discriminated[f_0].clone();
+        reconstructed = discriminated;
         stochastic_sample<out_features, out_rows, out_cols>(reconstructed);
         feed_backwards(reconstructed);
         if (!mean_field)
@@ -559,6 +1183,7 @@ public:
                     i += stride;
                 }
             }
+            weights.touch();
 
             //adjust hidden biases
             if (use_biases)
@@ -641,6 +1266,10 @@ public:
     using biases_vector_type = std::vector<biases_type>;
     using generative_biases_vector_type = std::vector<generative_biases_type>;
 
+    //output neurons per task (forwards, weight gradients) and input neurons per task (input derivatives), from the multiply-adds per neuron and sample
+    static constexpr size_t out_neurons_grain = parallel_grain(features * rows * cols);
+    static constexpr size_t in_neurons_grain = parallel_grain(out_features * out_rows * out_cols);
+
     //not used except batch norm
     static size_t n;
     //used in wake-sleep only
@@ -655,124 +1284,104 @@ public:
     //feed forwards given input, weights, biases to output
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        //loop through every neuron in output
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
+        constexpr size_t in_size = features * rows * cols;
+        constexpr size_t out_size = out_features * out_rows * out_cols;
+
+        //output = W * input, output neurons are split across threads
+        parallel_for(0, out_size, out_neurons_grain, [&](size_t begin, size_t end)
         {
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-            {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    //loop through every neuron in input and add it to output
-                    float sum = 0.0f;
-                    for (size_t f = 0; f < features; ++f)
-                        for (size_t i = 0; i < rows; ++i)
-                            for (size_t j = 0; j < cols; ++j)
-                                sum += (input[f].at(i, j) *
-                                    params_w[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j));
+            sgemv(false, end - begin, in_size, 1.0f, params_w.data() + begin * in_size, in_size, input.data(), 0.0f, output.data() + begin);
 
-                    //add bias
-                    if (use_biases)
-                        output[f_0].at(i_0, j_0) = activate(sum + params_b[f_0].at(i_0, j_0), activation_function);
-                    else
-                        output[f_0].at(i_0, j_0) = activate(sum, activation_function);
-                }
-            }
-        }
+            //add bias and activate
+            float* out = output.data() + begin;
+            activate_span<activation_function>(out, use_biases ? params_b.data() + begin : nullptr, out, end - begin);
+        });
     }
 
     //undo feed forwards, with generative biases instead
     static void feed_backwards(feature_maps_type& output, out_feature_maps_type& input, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
     {
-        //go through every neuron in this layer
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-        {
-            for (size_t f = 0; f < features; ++f)
-            {
-                for (size_t i = 0; i < rows; ++i)
-                {
-                    for (size_t j = 0; j < cols; ++j)
-                    {
-                        //go through every neuron in output layer and add it to this neuron
-                        float sum = 0.0f;
-                        for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                            for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                                sum += params_w[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) * input[f_0].at(i_0, j_0);
-
-                        if (use_biases && activation_function == MTNN_FUNC_RBM)
-                            sum += params_b[f].at(i, j);
-                        output[f].at(i, j) = activate(sum, activation_function);
-                    }
-                }
-            }
-        }
+        constexpr size_t in_size = features * rows * cols;
+        constexpr size_t out_size = out_features * out_rows * out_cols;
+
+        //output = W^T * input
+        sgemv(true, out_size, in_size, 1.0f, params_w.data(), in_size, input.data(), 0.0f, output.data());
+
+        float* out = output.data();
+        activate_span<activation_function>(out, (use_biases && activation_function == MTNN_FUNC_RBM) ? params_b.data() : nullptr, out, in_size);
     }
 
     //accumulate gradients in given, using given weights, biases, outputs, activations, derivs, etc. WILL APPLY IF ONLINE LEARNING and vanilla backprop
     static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
     {
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
+        constexpr size_t in_size = features * rows * cols;
+        constexpr size_t out_size = out_features * out_rows * out_cols;
+
+        //update deltas: out_deriv += W^T * deriv, input neurons are split across threads
+        parallel_for(0, in_size, in_neurons_grain, [&](size_t begin, size_t end)
         {
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
+            sgemv(true, out_size, end - begin, 1.0f, params_w.data() + begin, in_size, deriv.data(), 1.0f, out_deriv.data() + begin);
+        });
+
+        //normal derivative: w_grad += deriv * activations^T, output neurons are split across threads
+        parallel_for(0, out_size, out_neurons_grain, [&](size_t begin, size_t end)
+        {
+            sger(end - begin, in_size, 1.0f, deriv.data() + begin, activations_pre.data(), w_grad.data() + begin * in_size, in_size);
+        });
+
+        if (use_biases)
+        {
+            float* b = params_b.data();
+            float* g = b_grad.data();
+            float* m = biases_momentum.data();
+            for (size_t idx = 0; idx < out_size; ++idx)
             {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
+                //normal derivative
+                g[idx] += deriv.data()[idx];
+
+                //L2 weight decay
+                if (use_l2_weight_decay && include_biases_decay && online)
+                    g[idx] += 2 * weight_decay_factor * b[idx];
+
+                //online update
+                if (use_momentum && online)
                 {
-                    if (use_biases)
-                    {
-                        //normal derivative
-                        b_grad[f_0].at(i_0, j_0) += deriv[f_0].at(i_0, j_0);
+                    b[idx] += -learning_rate * (g[idx] + momentum_term * m[idx]);
+                    m[idx] = momentum_term * m[idx] + g[idx];
+                    g[idx] = 0;
+                }
 
-                        //L2 weight decay
-                        if (use_l2_weight_decay && include_biases_decay && online)
-                            b_grad[f_0].at(i_0, j_0) += 2 * weight_decay_factor * params_b[f_0].at(i_0, j_0);
+                else if (online)
+                {
+                    b[idx] += -learning_rate * g[idx];
+                    g[idx] = 0;
+                }
+            }
+        }
 
-                        //online update
-                        if (use_momentum && online)
-                        {
-                            params_b[f_0].at(i_0, j_0) += -learning_rate * (b_grad[f_0].at(i_0, j_0) + momentum_term * biases_momentum[f_0].at(i_0, j_0));
-                            biases_momentum[f_0].at(i_0, j_0) = momentum_term * biases_momentum[f_0].at(i_0, j_0) + b_grad[f_0].at(i_0, j_0);
-                            b_grad[f_0].at(i_0, j_0) = 0;
-                        }
+        if (online)
+        {
+            float* w = params_w.data();
+            float* g = w_grad.data();
+            float* m = weights_momentum.data();
+            for (size_t idx = 0; idx < out_size * in_size; ++idx)
+            {
+                //L2 decay
+                if (use_l2_weight_decay && online)
+                    g[idx] += 2 * weight_decay_factor * w[idx];
 
-                        else if (online)
-                        {
-                            params_b[f_0].at(i_0, j_0) += -learning_rate * b_grad[f_0].at(i_0, j_0);
-                            b_grad[f_0].at(i_0, j_0) = 0;
-                        }
-                    }
+                //Online updates
+                if (use_momentum && online)
+                {
+                    w[idx] += -learning_rate * (g[idx] + momentum_term * m[idx]);
+                    m[idx] = momentum_term * m[idx] + g[idx];
+                    g[idx] = 0;
+                }
 
-                    for (size_t f = 0; f < features; ++f)
-                    {
-                        for (size_t i = 0; i < rows; ++i)
-                        {
-                            for (size_t j = 0; j < cols; ++j)
-                            {
-                                //update deltas
-                                out_deriv[f].at(i, j) += deriv[f_0].at(i_0, j_0) * params_w[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j);
-
-                                //normal derivative
-                                w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) += deriv[f_0].at(i_0, j_0) * activations_pre[f].at(i, j);
-
-                                //L2 decay
-                                if (use_l2_weight_decay && online)
-                                    w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) += 2 * weight_decay_factor * params_w[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j);
-
-                                //Online updates
-                                if (use_momentum && online)
-                                {
-                                    params_w[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) += -learning_rate * (w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) + momentum_term * weights_momentum[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j));
-                                    weights_momentum[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) = momentum_term * weights_momentum[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) + w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j);
-                                    w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) = 0;
-                                }
-
-                                else if (online)
-                                {
-                                    params_w[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) +=
-                                        -learning_rate * w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j);
-                                    w_grad[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, f * rows * cols + i * cols + j) = 0;
-                                }
-                            }
-                        }
-                    }
+                else if (online)
+                {
+                    w[idx] += -learning_rate * g[idx];
+                    g[idx] = 0;
                 }
             }
         }
@@ -781,36 +1390,124 @@ public:
         chain_activations(out_deriv, activations_pre, previous_layer_activation);
     }
 
-    //feed forwards batch
+    //feed forwards batch, whole batch is one GEMM
     static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_forwards(inputs[in], outputs[in], params_w, params_b);
+        constexpr size_t in_size = features * rows * cols;
+        constexpr size_t out_size = out_features * out_rows * out_cols;
+        size_t n_in = outputs.size();
+
+        static thread_local std::vector<float> stacked_in;
+        static thread_local std::vector<float> stacked_out;
+        stacked_in.resize(n_in * in_size);
+        stacked_out.resize(n_in * out_size);
+
+        //stack the batch into one n_in x in_size matrix
+        for (size_t in = 0; in < n_in; ++in)
+            std::copy(inputs[in].data(), inputs[in].data() + in_size, stacked_in.data() + in * in_size);
+
+        //outputs = inputs * W^T, output neurons are split across threads
+        const float* in_data = stacked_in.data();
+        float* out_data = stacked_out.data();
+        parallel_for(0, out_size, out_neurons_grain, [&](size_t begin, size_t end)
+        {
+            sgemm(false, true, n_in, end - begin, in_size, 1.0f, in_data, in_size, params_w.data() + begin * in_size, in_size, 0.0f, out_data + begin, out_size);
+
+            //unstack, add bias and activate
+            for (size_t in = 0; in < n_in; ++in)
+            {
+                activate_span<activation_function>(out_data + in * out_size + begin, use_biases ? params_b.data() + begin : nullptr, outputs[in].data() + begin, end - begin);
+            }
+        });
     }
 
-    //feed backwards batch
+    //feed backwards batch, whole batch is one GEMM
     static void feed_backwards(feature_maps_vector_type& outputs, out_feature_maps_vector_type& inputs, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
     {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_backwards(outputs[in], inputs[in], params_w, params_b);
+        constexpr size_t in_size = features * rows * cols;
+        constexpr size_t out_size = out_features * out_rows * out_cols;
+        size_t n_in = outputs.size();
+
+        static thread_local std::vector<float> stacked_in;
+        static thread_local std::vector<float> stacked_out;
+        stacked_in.resize(n_in * out_size);
+        stacked_out.resize(n_in * in_size);
+
+        for (size_t in = 0; in < n_in; ++in)
+            std::copy(inputs[in].data(), inputs[in].data() + out_size, stacked_in.data() + in * out_size);
+
+        //outputs = inputs * W
+        sgemm(false, false, n_in, in_size, out_size, 1.0f, stacked_in.data(), out_size, params_w.data(), in_size, 0.0f, stacked_out.data(), in_size);
+
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            activate_span<activation_function>(stacked_out.data() + in * in_size, (use_biases && activation_function == MTNN_FUNC_RBM) ? params_b.data() : nullptr, outputs[in].data(), in_size);
+        }
     }
 
-    //backprop batch
+    //backprop batch, one GEMM each for the input and weight gradients
     static void back_prop(size_t previous_layer_activation, out_feature_maps_vector_type& derivs, feature_maps_vector_type& activations_pre_vec, feature_maps_vector_type& out_derivs, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
     {
-        for (size_t in = 0; in < derivs.size(); ++in)
-            back_prop(previous_layer_activation, derivs[in], activations_pre_vec[in], out_derivs[in], false, learning_rate, use_momentum, momentum_term, use_l2_weight_decay, include_biases_decay, weight_decay_factor, params_w, params_b, w_grad, b_grad);
+        constexpr size_t in_size = features * rows * cols;
+        constexpr size_t out_size = out_features * out_rows * out_cols;
+        size_t n_in = derivs.size();
+
+        static thread_local std::vector<float> stacked_derivs;
+        static thread_local std::vector<float> stacked_acts;
+        static thread_local std::vector<float> stacked_out_derivs;
+        stacked_derivs.resize(n_in * out_size);
+        stacked_acts.resize(n_in * in_size);
+        stacked_out_derivs.resize(n_in * in_size);
+
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            std::copy(derivs[in].data(), derivs[in].data() + out_size, stacked_derivs.data() + in * out_size);
+            std::copy(activations_pre_vec[in].data(), activations_pre_vec[in].data() + in_size, stacked_acts.data() + in * in_size);
+        }
+
+        const float* derivs_data = stacked_derivs.data();
+        const float* acts_data = stacked_acts.data();
+        float* out_derivs_data = stacked_out_derivs.data();
+
+        //update deltas: out_derivs = derivs * W, input neurons are split across threads
+        parallel_for(0, in_size, in_neurons_grain, [&](size_t begin, size_t end)
+        {
+            sgemm(false, false, n_in, end - begin, out_size, 1.0f, derivs_data, out_size, params_w.data() + begin, in_size, 0.0f, out_derivs_data + begin, in_size);
+        });
+
+        //normal derivative: w_grad += derivs^T * activations, output neurons are split across threads
+        parallel_for(0, out_size, out_neurons_grain, [&](size_t begin, size_t end)
+        {
+            sgemm(true, false, end - begin, in_size, n_in, 1.0f, derivs_data + begin, out_size, acts_data, in_size, 1.0f, w_grad.data() + begin * in_size, in_size);
+        });
+
+        if (use_biases)
+            for (size_t in = 0; in < n_in; ++in)
+                for (size_t idx = 0; idx < out_size; ++idx)
+                    b_grad.data()[idx] += stacked_derivs[in * out_size + idx];
+
+        //unstack and apply derivatives
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            float* out_deriv = out_derivs[in].data();
+            const float* sums = stacked_out_derivs.data() + in * in_size;
+            for (size_t idx = 0; idx < in_size; ++idx)
+                out_deriv[idx] += sums[idx];
+            chain_activations(out_derivs[in], activations_pre_vec[in], previous_layer_activation);
+        }
     }
 
     //perform wake sleep DOESN'T ACCUMULATE IN GRADIENTS, applies directly
     static void wake_sleep(float& learning_rate, size_t markov_iterations, bool use_dropout)
     {
-        //find difference via gibbs sampling
-        feature_maps_type original = { 0 };
+        //find difference via gibbs sampling, buffers are kept between calls
+        static thread_local feature_maps_type original = { 0 };
+        original = feature_maps;
 
-        out_feature_maps_type discriminated = { 0 };
+        static thread_local out_feature_maps_type discriminated = { 0 };
+        std::fill(discriminated.data(), discriminated.data() + discriminated.elements(), 0.0f);
 
-        out_feature_maps_type reconstructed = { 0 };
+        static thread_local out_feature_maps_type reconstructed = { 0 };
 
         //Sample, but don't "normalize" second time
         feed_forwards(feature_maps, discriminated);
@@ -885,14 +1582,72 @@ template<size_t index, size_t features, size_t rows, size_t cols, size_t out_fea
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t activation_function, bool use_biases> FeatureMap<0, 0, 0> PerceptronFullConnectivityLayer<index, features, rows, cols, out_features, out_rows, out_cols, activation_function, use_biases>::activations_population_variance = { 0 };
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t activation_function, bool use_biases> size_t PerceptronFullConnectivityLayer<index, features, rows, cols, out_features, out_rows, out_cols, activation_function, use_biases>::n = 0;
 
+//Fixed capacity history of a recurrent layer's last steps, one preallocated block of capacity * step_size floats. Steps are indexed
+//oldest (0) to newest (size() - 1), pushing onto a full ring reuses the oldest step's memory so stepping never allocates or moves
+template<size_t capacity, size_t step_size> class state_ring
+{
+public:
+    //one zeroed step, the state before anything was fed
+    state_ring() : storage(capacity * step_size, 0.0f), head(0), count(1) {}
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    float* operator[](size_t t)
+    {
+        return storage.data() + (head + t) % capacity * step_size;
+    }
+
+    const float* operator[](size_t t) const
+    {
+        return storage.data() + (head + t) % capacity * step_size;
+    }
+
+    //newest step
+    float* back()
+    {
+        return (*this)[count - 1];
+    }
+
+    //new newest step (dropping the oldest if full), its contents are stale
+    float* push()
+    {
+        if (count == capacity)
+            head = (head + 1) % capacity;
+        else
+            ++count;
+        return back();
+    }
+
+    //drop the newest step
+    void pop()
+    {
+        --count;
+    }
+
+    //back to one zeroed step
+    void reset()
+    {
+        head = 0;
+        count = 1;
+        std::fill(storage.begin(), storage.begin() + step_size, 0.0f);
+    }
+
+private:
+    std::vector<float, aligned_allocator<float>> storage;
+    //ring position of step 0
+    size_t head;
+    size_t count;
+};
+
 //LSTM layer, max_t_store is the max number of steps to perform bptt on (may want to set to batch size)
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> class LSTMLayer : public Layer_Functions<features, rows, cols>
 {
 
 public:
 
-    ////TODO: not having net storing (cell/hidden chains) may screw stuff up (specifically with parallel/weight updates)
-
     //feature maps - DO NOT STORE activations if fed forwards - not used for much
     static FeatureMap<features, rows, cols> feature_maps;
     ////4 feature maps for each seperate layer within the LSTM unit (forget, activation, influence, output)
@@ -918,165 +1673,185 @@ public:
     //stores momentum (if applicable)
     static FeatureMap<4, out_features * out_rows * out_cols, out_features * out_rows * out_cols + features * rows * cols> weights_momentum;
 
-    //not used except batch norm
-    static FeatureMap<0, 0, 0> activations_population_mean;
-    //not used except batch norm
-    static FeatureMap<0, 0, 0> activations_population_variance;
-
-    ////internal lstm data; use for bptt since need to have all previous data. keep activation of all layers in vector, performs bptt on last one, push onto each feed forward (pop if full)
-    static FeatureMapVector<out_features, out_rows, out_cols> cell_states; //keep max num of steps ONLY
-    static FeatureMapVector<out_features, out_rows, out_cols> hidden_states;
-    static FeatureMapVector<out_features, out_rows, out_cols> forget_states;
-    static FeatureMapVector<out_features, out_rows, out_cols> influence_states;
-    static FeatureMapVector<out_features, out_rows, out_cols> activation_states;
-    static FeatureMapVector<out_features, out_rows, out_cols> output_states;
-
-    //assumes that stores the derivs from next time step wrt cell state, needs to be reset after each batch update
-    static FeatureMap<out_features, out_rows, out_cols> cell_state_deriv;
-
-    //type of layer (dynamic test, but not stored since constexpr)
-    static constexpr size_t type = MTNN_LAYER_LSTM;
-    //just handle all of the chain rule in here, actual activations are significantly different
-    static constexpr size_t activation = MTNN_FUNC_LINEAR; 
-
-    //define for creating tuples or using within templates
-    using out_feature_maps_type = FeatureMap<out_features, out_rows, out_cols>;
-    using weights_type = decltype(weights);
-    using biases_type = decltype(biases);
-    using generative_biases_type = decltype(generative_biases);
-    using out_feature_maps_vector_type = std::vector<out_feature_maps_type>;
-    using weights_vector_type = std::vector<weights_type>;
-    using biases_vector_type = std::vector<biases_type>;
-    using generative_biases_vector_type = std::vector<generative_biases_type>;
-
-    //used since hidden plus inputs are given to each layer
-    using concat_type = FeatureMap<1, out_features * out_rows * out_cols + features * rows * cols, 1>;
-
-    //not used except batch norm
-    static size_t n;
-
-private:
-    //combine hidden and inputs into one fm
-    static inline FeatureMap<1, out_features * out_rows * out_cols + features * rows * cols, 1> concatenate(FeatureMap<features, rows, cols>& a, FeatureMap<out_features, out_rows, out_cols>& b)
-    {
-        //do hidden first
-        FeatureMap<1, out_features * out_rows * out_cols + features * rows * cols, 1> out = {};
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                    out[0].at(f_0 * out_rows * out_cols + i_0 * out_cols + j_0, 0) = b[f_0].at(i_0, j_0);
-
-        //then inputs
-        for (size_t f = 0; f < features; ++f)
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    out[0].at(out_features * out_rows * out_cols + f * rows * cols + i * cols + j, 0) = a[f].at(i, j);
-        return out;
-    }
-
-    //These methods are basic feed forward methods, re-implemented here for parallel/convenience (only use 1 FM instead of a vector)
-    static void feed_forwards_gate(size_t activation, FeatureMap<1, out_features * out_rows * out_cols + features * rows * cols, 1>& input, FeatureMap<out_features, out_rows, out_cols>& output, Matrix2D<float, out_features * out_rows * out_cols, out_features * out_rows * out_cols + features * rows * cols>& params_w, Matrix2D<float, out_features * out_rows * out_cols, 1>& params_b)
-    {
-        //loop all outputs
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-        {
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-            {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    auto& targ = output[f_0].at(i_0, j_0);
-                    size_t idx = f_0 * out_rows * out_cols + i_0 * out_cols + j_0;
-                    //loop all inputs
-                    for (size_t i = 0; i < out_features * out_rows * out_cols + features * rows * cols; ++i)
-                        targ += input[0].at(i, 0) * params_w.at(idx, i);
-                    targ = activate(targ + params_b.at(idx, 0), activation); //add bias and activate
-                }
-            }
-        }
-    }
-
-    //backprop for only one fully connected gate
-    static void back_prop_gate(size_t activation, FeatureMap<out_features, out_rows, out_cols>& d_hidden, FeatureMap<out_features, out_rows, out_cols>& outputs_pre, FeatureMap<1, out_features * out_rows * out_cols + features * rows * cols, 1>& activations_pre, FeatureMap<features, rows, cols>& out_derivs, Matrix2D<float, out_features * out_rows * out_cols, out_features * out_rows * out_cols + features * rows * cols>& params_w, Matrix2D<float, out_features * out_rows * out_cols, 1>& params_b, Matrix2D<float, out_features * out_rows * out_cols, out_features * out_rows * out_cols + features * rows * cols>& params_w_grad, Matrix2D<float, out_features * out_rows * out_cols, 1>& params_b_grad)
-    {
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-        {
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-            {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    auto& deri = d_hidden[f_0].at(i_0, j_0);
-                    deri *= activation_derivative(outputs_pre[f_0].at(i_0, j_0), activation);
-                    size_t idx = f_0 * out_rows * out_cols + i_0 * out_cols + j_0;
-
-                    //UPDATE ALL PARAMS
-
-                    params_b_grad.at(idx, 0) += deri;
-                    //loop all weights
-                    for (size_t f2 = 0; f2 < out_features; ++f2)
-                    {
-                        for (size_t i2 = 0; i2 < out_rows; ++i2)
-                        {
-                            for (size_t j2 = 0; j2 < out_cols; ++j2)
-                            {
-                                size_t idx2 = f2 * out_rows * out_cols + i2 * out_cols + j2;
-                                //out_derivs[f].at(i, j) += deri * params_w.at(idx, idx2); todo doesn't backprop to next hidden?
-                                params_w_grad.at(idx, idx2) += deri * activations_pre[0].at(idx, idx2);
-                            }
-                        }
-                    }
-                    for (size_t f = 0; f < features; ++f)
-                    {
-                        for (size_t i = 0; i < rows; ++i)
-                        {
-                            for (size_t j = 0; j < cols; ++j)
-                            {
-                                //offset
-                                size_t idx2 = out_features * out_rows * out_cols + f * rows * cols + i * cols + j;
-                                out_derivs[f].at(i, j) += deri * params_w.at(idx, idx2);
-                                params_w_grad.at(idx, idx2) += deri * activations_pre[0].at(idx, idx2);
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
+    //not used except batch norm
+    static FeatureMap<0, 0, 0> activations_population_mean;
+    //not used except batch norm
+    static FeatureMap<0, 0, 0> activations_population_variance;
 
-    //perform bptt once for a given idx (will only call once from back_prop)
-    static void back_prop_through_time(size_t idx, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, weights_type& params_w, biases_type& params_b, weights_type& w_grad, biases_type& b_grad)
+    //recurrent state of one sequence. The layer's own is used unless the calling thread bound another (NeuralNet instances bind theirs)
+    struct state_type
     {
-        //calculate derivs wrt each layer
-        out_feature_maps_type d_out = {};
-        out_feature_maps_type d_activation = {};
-        out_feature_maps_type d_influence = {};
-        out_feature_maps_type d_forget = {};
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
+        ////internal lstm data; use for bptt since need to have all previous data. Every step keeps the cell state, hidden state and the four gates
+        //(see the *_slot offsets), the last max_t_store steps plus the one before them are kept. bptt goes back through them, pushed each feed forward
+        state_ring<(max_t_store > 0 ? max_t_store : 1) + 1, 6 * out_features * out_rows * out_cols> history;
+
+        //derivs from the step after the next one to back propagate, wrt its previous cell state and hidden state
+        FeatureMap<out_features, out_rows, out_cols> cell_state_deriv;
+        FeatureMap<out_features, out_rows, out_cols> hidden_state_deriv;
+
+        //newest steps already back propagated one at a time, feeding forwards starts over
+        size_t back_propagated = 0;
+
+        //start a new sequence
+        void reset()
         {
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-            {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    //update cell state deriv
-                    cell_state_deriv[f_0].at(i_0, j_0) += deriv[f_0].at(i_0, j_0) * output_states[idx][f_0].at(i_0, j_0) * activation_derivative(cell_states[idx][f_0].at(i_0, j_0), MTNN_FUNC_TANH);
-
-                    //update the rest
-                    auto& d_c_t = cell_state_deriv[f_0].at(i_0, j_0);
-                    d_out[f_0].at(i_0, j_0) = deriv[f_0].at(i_0, j_0) * tanh(cell_states[idx][f_0].at(i_0, j_0));
-                    d_activation[f_0].at(i_0, j_0) = d_c_t * influence_states[idx][f_0].at(i_0, j_0);
-                    d_influence[f_0].at(i_0, j_0) = d_c_t * activation_states[idx][f_0].at(i_0, j_0);
-                    d_forget[f_0].at(i_0, j_0) = d_c_t * cell_states[idx - 1][f_0].at(i_0, j_0);
-                    cell_state_deriv[f_0].at(i_0, j_0) *= forget_states[idx][f_0].at(i_0, j_0); //update last time
-                }
-            }
+            history.reset();
+            clear_derivs();
+        }
+
+        //start back propagating at the newest step
+        void clear_derivs()
+        {
+            back_propagated = 0;
+            std::fill(cell_state_deriv.data(), cell_state_deriv.data() + cell_state_deriv.elements(), 0.0f);
+            std::fill(hidden_state_deriv.data(), hidden_state_deriv.data() + hidden_state_deriv.elements(), 0.0f);
         }
+    };
+
+    static state_type recurrent_state;
+
+    //type of layer (dynamic test, but not stored since constexpr)
+    static constexpr size_t type = MTNN_LAYER_LSTM;
+    //just handle all of the chain rule in here, actual activations are significantly different
+    static constexpr size_t activation = MTNN_FUNC_LINEAR; 
+
+    //define for creating tuples or using within templates
+    using out_feature_maps_type = FeatureMap<out_features, out_rows, out_cols>;
+    using weights_type = decltype(weights);
+    using biases_type = decltype(biases);
+    using generative_biases_type = decltype(generative_biases);
+    using out_feature_maps_vector_type = std::vector<out_feature_maps_type>;
+    using weights_vector_type = std::vector<weights_type>;
+    using biases_vector_type = std::vector<biases_type>;
+    using generative_biases_vector_type = std::vector<generative_biases_type>;
+
+    //gate rows are split across threads, from the multiply-adds per row
+    static constexpr size_t gate_rows_grain = parallel_grain(out_features * out_rows * out_cols + features * rows * cols);
 
-        auto input = concatenate(activations_pre, hidden_states[idx]);
+    //not used except batch norm
+    static size_t n;
 
-        //pass to all layers and compute
-        back_prop_gate(MTNN_FUNC_LOGISTIC, d_forget, forget_states[idx], input, out_deriv, params_w[0], params_b[0], w_grad[0], b_grad[0]);
-        back_prop_gate(MTNN_FUNC_LOGISTIC, d_influence, influence_states[idx], input, out_deriv, params_w[1], params_b[1], w_grad[1], b_grad[1]);
-        back_prop_gate(MTNN_FUNC_TANH, d_activation, activation_states[idx], input, out_deriv, params_w[2], params_b[2], w_grad[2], b_grad[2]);
-        back_prop_gate(MTNN_FUNC_LOGISTIC, d_out, output_states[idx], input, out_deriv, params_w[3], params_b[3], w_grad[3], b_grad[3]);
+private:
+    //weights are one stacked 4H x (H + I) matrix: rows are the forget, influence, activation and output gates (weight order),
+    //columns are the previous hidden state then the input. Biases stack the same way
+    static constexpr size_t hidden_size = out_features * out_rows * out_cols;
+    static constexpr size_t input_size = features * rows * cols;
+    static constexpr size_t stride = hidden_size + input_size;
+    static constexpr size_t gates_size = 4 * hidden_size;
+
+    //offsets of a step's states in the history, the gates are in weight order
+    static constexpr size_t cell_slot = 0;
+    static constexpr size_t hidden_slot = hidden_size;
+    static constexpr size_t forget_slot = 2 * hidden_size;
+    static constexpr size_t influence_slot = 3 * hidden_size;
+    static constexpr size_t activation_slot = 4 * hidden_size;
+    static constexpr size_t output_slot = 5 * hidden_size;
+
+    //one vector (or float) of cells: gate nonlinearities, c = c_prev * f + a * i, h = o * tanh(c). g holds the stacked pre-activations without biases
+    template<typename vec> static inline void cell_forwards_kernel(const float* g, const float* b, const float* c_prev, float* f_out, float* i_out, float* a_out, float* o_out, float* c_out, float* h_out)
+    {
+        using logistic = activation_kernel<MTNN_FUNC_LOGISTIC>;
+        using hyperbolic = activation_kernel<MTNN_FUNC_TANH>;
+        vec f = logistic::apply(vec::load(g) + vec::load(b));
+        vec i = logistic::apply(vec::load(g + hidden_size) + vec::load(b + hidden_size));
+        vec a = hyperbolic::apply(vec::load(g + 2 * hidden_size) + vec::load(b + 2 * hidden_size));
+        vec o = logistic::apply(vec::load(g + 3 * hidden_size) + vec::load(b + 3 * hidden_size));
+        vec c = vec::load(c_prev) * f + a * i;
+        f.store(f_out);
+        i.store(i_out);
+        a.store(a_out);
+        o.store(o_out);
+        c.store(c_out);
+        (o * hyperbolic::apply(c)).store(h_out);
+    }
+
+    //one vector (or float) of cells backwards: d_h is the derivative wrt the hidden output, d_c the running one wrt the cell state
+    //(updated to the previous step's). Writes the derivatives wrt the stacked gate pre-activations
+    template<typename vec> static inline void cell_backwards_kernel(const float* d_h, float* d_c, const float* f_in, const float* i_in, const float* a_in, const float* o_in, const float* c_in, const float* c_prev, float* d_g)
+    {
+        using logistic = activation_kernel<MTNN_FUNC_LOGISTIC>;
+        using hyperbolic = activation_kernel<MTNN_FUNC_TANH>;
+        vec dh = vec::load(d_h);
+        vec f = vec::load(f_in);
+        vec i = vec::load(i_in);
+        vec a = vec::load(a_in);
+        vec o = vec::load(o_in);
+        vec tanh_c = hyperbolic::apply(vec::load(c_in));
+        vec dc = vec::load(d_c) + dh * o * hyperbolic::derivative(tanh_c);
+        (dc * vec::load(c_prev) * logistic::derivative(f)).store(d_g);
+        (dc * a * logistic::derivative(i)).store(d_g + hidden_size);
+        (dc * i * hyperbolic::derivative(a)).store(d_g + 2 * hidden_size);
+        (dh * tanh_c * logistic::derivative(o)).store(d_g + 3 * hidden_size);
+        (dc * f).store(d_c);
+    }
+
+    //the thread's bound state, if any
+    static state_type*& bound_state()
+    {
+        static thread_local state_type* bound = nullptr;
+        return bound;
+    }
+
+    //state the calling thread works on
+    static state_type& current_state()
+    {
+        state_type* bound = bound_state();
+        return bound != nullptr ? *bound : recurrent_state;
+    }
+
+    //gates (W * [h_{t-1}, x_t], without biases) through the fused cell update into a new step of the history, written to output too
+    static void cell_step(state_type& state, const float* gates, const float* b, float* output)
+    {
+        //the capacity leaves room for the previous step, pushing doesn't touch it
+        const float* prev = state.history.back();
+        float* step = state.history.push();
+        state.back_propagated = 0;
+
+        const float* c_prev = prev + cell_slot;
+        float* f = step + forget_slot;
+        float* i = step + influence_slot;
+        float* a = step + activation_slot;
+        float* o = step + output_slot;
+        float* c = step + cell_slot;
+        float* h = step + hidden_slot;
+        size_t j = 0;
+        for (; j + simd_float::width <= hidden_size; j += simd_float::width)
+            cell_forwards_kernel<simd_float>(gates + j, b + j, c_prev + j, f + j, i + j, a + j, o + j, c + j, h + j);
+        for (; j < hidden_size; ++j)
+            cell_forwards_kernel<scalar_float>(gates + j, b + j, c_prev + j, f + j, i + j, a + j, o + j, c + j, h + j);
+        std::copy(h, h + hidden_size, output);
+    }
+
+    //gates (W_x * x_t) += W_h * h_{t-1}, then the cell step
+    static void feed_forwards_step(state_type& state, float* gates, weights_type& params_w, biases_type& params_b, float* output)
+    {
+        //the recurrent half of the stacked matrix, gate rows are split across threads
+        const float* h_prev = state.history.back() + hidden_slot;
+        parallel_for(0, gates_size, gate_rows_grain, [&](size_t begin, size_t end)
+        {
+            sgemv(false, end - begin, hidden_size, 1.0f, params_w.data() + begin * stride, stride, h_prev, 1.0f, gates + begin);
+        });
+        cell_step(state, gates, params_b.data(), output);
+    }
+
+    //derivatives wrt the stacked gate pre-activations of history step idx, given the derivative wrt its hidden output. Leaves the one wrt
+    //the previous step's hidden output (W_h^T * d_gates) in d_h
+    static void back_prop_cell(state_type& state, size_t idx, float* d_h, float* d_gates, weights_type& params_w)
+    {
+        float* d_c = state.cell_state_deriv.data();
+        const float* step = state.history[idx];
+        const float* f = step + forget_slot;
+        const float* i = step + influence_slot;
+        const float* a = step + activation_slot;
+        const float* o = step + output_slot;
+        const float* c = step + cell_slot;
+        const float* c_prev = state.history[idx - 1] + cell_slot;
+        size_t j = 0;
+        for (; j + simd_float::width <= hidden_size; j += simd_float::width)
+            cell_backwards_kernel<simd_float>(d_h + j, d_c + j, f + j, i + j, a + j, o + j, c + j, c_prev + j, d_gates + j);
+        for (; j < hidden_size; ++j)
+            cell_backwards_kernel<scalar_float>(d_h + j, d_c + j, f + j, i + j, a + j, o + j, c + j, c_prev + j, d_gates + j);
+        sgemv(true, gates_size, hidden_size, 1.0f, params_w.data(), stride, d_gates, 0.0f, d_h);
     }
 
 public:
@@ -1091,58 +1866,15 @@ public:
     //feed forwards given input, weights, biases to output
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        //create real input to each gate
-        auto input_cat = concatenate(input, hidden_states.back());
-
-        //create a new target for output
-        cell_states.push_back(out_feature_maps_type{});
-        hidden_states.push_back(out_feature_maps_type{});
-        forget_states.push_back(out_feature_maps_type{});
-        influence_states.push_back(out_feature_maps_type{});
-        activation_states.push_back(out_feature_maps_type{});
-        output_states.push_back(out_feature_maps_type{});
-
-        size_t idx = cell_states.size() - 1;
-
-        //forget gate feed forward
-        feed_forwards_gate(MTNN_FUNC_LOGISTIC, input_cat, forget_states[idx], params_w[0], params_b[0]);
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                    cell_states[idx][f_0].at(i_0, j_0) = cell_states[idx - 1][f_0].at(i_0, j_0) * forget_states[idx][f_0].at(i_0, j_0);
-        
-        //get current activations and combine with forgotten
-        feed_forwards_gate(MTNN_FUNC_LOGISTIC, input_cat, influence_states[idx], params_w[1], params_b[1]);
-        feed_forwards_gate(MTNN_FUNC_TANH, input_cat, activation_states[idx], params_w[2], params_b[2]);
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                    cell_states[idx][f_0].at(i_0, j_0) += activation_states[idx][f_0].at(i_0, j_0) * influence_states[idx][f_0].at(i_0, j_0);
-
-        //get hidden/output
-        feed_forwards_gate(MTNN_FUNC_LOGISTIC, input_cat, output_states[idx], params_w[3], params_b[3]);
-        for (size_t f_0 = 0; f_0 < out_features; ++f_0)
-        {
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-            {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    hidden_states[idx][f_0].at(i_0, j_0) = output_states[idx][f_0].at(i_0, j_0) * tanh(cell_states[idx][f_0].at(i_0, j_0));
-                    output[f_0].at(i_0, j_0) = hidden_states[idx][f_0].at(i_0, j_0);
-                }
-            }
-        }
+        static thread_local std::vector<float> gates(gates_size);
 
-        //adjust stored sizes if necessary
-        if (idx >= max_t_store + 1)
+        //the input half of the stacked matrix, the recurrent half is added by the step
+        float* gates_data = gates.data();
+        parallel_for(0, gates_size, gate_rows_grain, [&](size_t begin, size_t end)
         {
-            hidden_states.erase(hidden_states.begin());
-            cell_states.erase(cell_states.begin());
-            forget_states.erase(forget_states.begin());
-            influence_states.erase(influence_states.begin());
-            activation_states.erase(activation_states.begin());
-            output_states.erase(output_states.begin());
-        }
+            sgemv(false, end - begin, input_size, 1.0f, params_w.data() + begin * stride + hidden_size, stride, input.data(), 0.0f, gates_data + begin);
+        });
+        feed_forwards_step(current_state(), gates_data, params_w, params_b, output.data());
     }
 
     //undo feed forwards, with generative biases instead TODO implement
@@ -1156,21 +1888,115 @@ public:
     }
 
     //accumulate gradients in given, using given weights, biases, outputs, activations, derivs, etc. WON'T APPLY IF ONLINE (TODO)
+    //Back propagates the newest step that wasn't yet (activations_pre has to be its input), carrying the derivs to the step before it.
+    //So calling it for every fed step, newest first, is bptt over them, and calling it after each step only goes through that step
     static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
     {
-        size_t idx = cell_states.size() - 1;//todo training doesn't make sense with only one? (unless ordered/popped correctly)
+        state_type& state = current_state();
+        if (state.back_propagated == 0)
+            state.clear_derivs();
+
+        //the oldest step kept is only the state before the others
+        if (state.back_propagated + 1 >= state.history.size())
+            return;
+        size_t idx = state.history.size() - 1 - state.back_propagated;
+        ++state.back_propagated;
+
+        static thread_local std::vector<float> d_gates(gates_size);
+        float* dg_data = d_gates.data();
+        float* d_h = state.hidden_state_deriv.data();
+        for (size_t j = 0; j < hidden_size; ++j)
+            d_h[j] += deriv.data()[j];
+        back_prop_cell(state, idx, d_h, dg_data, params_w);
+
+        //biases and both halves of the stacked weights
+        float* g = b_grad.data();
+        for (size_t r = 0; r < gates_size; ++r)
+            g[r] += dg_data[r];
+        const float* h_prev = state.history[idx - 1] + hidden_slot;
+        parallel_for(0, gates_size, gate_rows_grain, [&](size_t begin, size_t end)
+        {
+            sger(end - begin, hidden_size, 1.0f, dg_data + begin, h_prev, w_grad.data() + begin * stride, stride);
+            sger(end - begin, input_size, 1.0f, dg_data + begin, activations_pre.data(), w_grad.data() + begin * stride + hidden_size, stride);
+        });
+
+        //out_deriv += W_x^T * d_gates
+        sgemv(true, gates_size, input_size, 1.0f, params_w.data() + hidden_size, stride, dg_data, 1.0f, out_deriv.data());
 
-        back_prop_through_time(idx, deriv, activations_pre, out_deriv, params_w, params_b, w_grad, b_grad);
-        
         //apply derivatives
         chain_activations(out_deriv, activations_pre, previous_layer_activation);
     }
 
-    //feed forwards batch - very useful for bptt
+    //feed forwards batch - very useful for bptt. The batch is a sequence, its input projection is one GEMM up front
     static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases, bool discriminating = false)
     {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_forwards(inputs[in], outputs[in], params_w, params_b);
+        size_t n_in = outputs.size();
+
+        static thread_local std::vector<float> stacked_in;
+        static thread_local std::vector<float> projected;
+        stacked_in.resize(n_in * input_size);
+        projected.resize(n_in * gates_size);
+
+        for (size_t in = 0; in < n_in; ++in)
+            std::copy(inputs[in].data(), inputs[in].data() + input_size, stacked_in.data() + in * input_size);
+
+        //projected = inputs * W_x^T for every step at once, gate rows are split across threads
+        const float* in_data = stacked_in.data();
+        float* proj_data = projected.data();
+        parallel_for(0, gates_size, gate_rows_grain, [&](size_t begin, size_t end)
+        {
+            sgemm(false, true, n_in, end - begin, input_size, 1.0f, in_data, input_size, params_w.data() + begin * stride + hidden_size, stride, 0.0f, proj_data + begin, gates_size);
+        });
+
+        state_type& state = current_state();
+        for (size_t in = 0; in < n_in; ++in)
+            feed_forwards_step(state, proj_data + in * gates_size, params_w, params_b, outputs[in].data());
+    }
+
+    //one step of n independent sequences in lockstep, inputs[s] is the next input of the sequence kept in states[s]. The input and
+    //recurrent projections of all the sequences are one GEMM each
+    static void feed_forwards_lockstep(state_type* states, feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases)
+    {
+        size_t n_in = outputs.size();
+
+        static thread_local std::vector<float> stacked_in;
+        static thread_local std::vector<float> stacked_hidden;
+        static thread_local std::vector<float> gates;
+        stacked_in.resize(n_in * input_size);
+        stacked_hidden.resize(n_in * hidden_size);
+        gates.resize(n_in * gates_size);
+
+        for (size_t s = 0; s < n_in; ++s)
+        {
+            const float* h_prev = states[s].history.back() + hidden_slot;
+            std::copy(inputs[s].data(), inputs[s].data() + input_size, stacked_in.data() + s * input_size);
+            std::copy(h_prev, h_prev + hidden_size, stacked_hidden.data() + s * hidden_size);
+        }
+
+        //gates = inputs * W_x^T + hidden * W_h^T, gate rows are split across threads
+        const float* in_data = stacked_in.data();
+        const float* hidden_data = stacked_hidden.data();
+        float* gates_data = gates.data();
+        parallel_for(0, gates_size, gate_rows_grain, [&](size_t begin, size_t end)
+        {
+            sgemm(false, true, n_in, end - begin, input_size, 1.0f, in_data, input_size, params_w.data() + begin * stride + hidden_size, stride, 0.0f, gates_data + begin, gates_size);
+            sgemm(false, true, n_in, end - begin, hidden_size, 1.0f, hidden_data, hidden_size, params_w.data() + begin * stride, stride, 1.0f, gates_data + begin, gates_size);
+        });
+
+        for (size_t s = 0; s < n_in; ++s)
+            cell_step(states[s], gates_data + s * gates_size, params_b.data(), outputs[s].data());
+    }
+
+    //point the calling thread's calls at state (nullptr for the layer's own recurrent_state)
+    static void bind_state(state_type* state)
+    {
+        bound_state() = state;
+    }
+
+    //start a new sequence on the state in use
+    static void reset_state()
+    {
+        current_state().reset();
     }
 
     //feed back batch
@@ -1180,23 +2006,67 @@ public:
             feed_backwards(outputs[in], inputs[in], params_w, params_b);
     }
 
-    //backprop batch. Is interpreted as a time forward, so will perform bptt on whole batch (assumes that max_t_store >= batch size)
+    //backprop batch. Is interpreted as a time forward, so will perform bptt on whole batch (assumes that max_t_store >= batch size).
+    //The cell recurrence runs backwards step by step, the weight gradients and input derivatives are then one GEMM each
     static void back_prop(size_t previous_layer_activation, out_feature_maps_vector_type& derivs, feature_maps_vector_type& activations_pre_vec, feature_maps_vector_type& out_derivs, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
     {
-        //zero
-        cell_state_deriv = { 0 };
-        for (size_t in = derivs.size() - 1; in > 0; --in)
+        //steps that are still in the history (the newest ones)
+        size_t n_in = derivs.size();
+        state_type& state = current_state();
+        size_t first = n_in - std::min(n_in, state.history.size() - 1);
+        size_t steps = n_in - first;
+
+        static thread_local std::vector<float> d_gates;
+        static thread_local std::vector<float> stacked_hidden;
+        static thread_local std::vector<float> stacked_in;
+        static thread_local std::vector<float> stacked_out;
+        d_gates.resize(steps * gates_size);
+        stacked_hidden.resize(steps * hidden_size);
+        stacked_in.resize(steps * input_size);
+        stacked_out.resize(steps * input_size);
+
+        state.clear_derivs();
+        float* d_h = state.hidden_state_deriv.data();
+        for (size_t s = steps; s-- > 0;)
         {
-            //backprop
-            back_prop(previous_layer_activation, derivs[in], activations_pre_vec[in], out_derivs[in], false, learning_rate, use_momentum, momentum_term, use_l2_weight_decay, include_biases_decay, weight_decay_factor, params_w, params_b, w_grad, b_grad);
+            size_t idx = state.history.size() - 1;
+            const float* deriv = derivs[first + s].data();
+            for (size_t j = 0; j < hidden_size; ++j)
+                d_h[j] += deriv[j];
+            back_prop_cell(state, idx, d_h, d_gates.data() + s * gates_size, params_w);
+            const float* h_prev = state.history[idx - 1] + hidden_slot;
+            std::copy(h_prev, h_prev + hidden_size, stacked_hidden.data() + s * hidden_size);
+            std::copy(activations_pre_vec[first + s].data(), activations_pre_vec[first + s].data() + input_size, stacked_in.data() + s * input_size);
 
             //update last for correct
-            hidden_states.pop_back();
-            cell_states.pop_back();
-            forget_states.pop_back();
-            influence_states.pop_back();
-            activation_states.pop_back();
-            output_states.pop_back();
+            state.history.pop();
+        }
+        if (steps == 0)
+            return;
+
+        //biases and both halves of the stacked weights, gate rows are split across threads
+        const float* dg_data = d_gates.data();
+        const float* hidden_data = stacked_hidden.data();
+        const float* in_data = stacked_in.data();
+        parallel_for(0, gates_size, gate_rows_grain, [&](size_t begin, size_t end)
+        {
+            float* g = b_grad.data();
+            for (size_t s = 0; s < steps; ++s)
+                for (size_t r = begin; r < end; ++r)
+                    g[r] += dg_data[s * gates_size + r];
+            sgemm(true, false, end - begin, hidden_size, steps, 1.0f, dg_data + begin, gates_size, hidden_data, hidden_size, 1.0f, w_grad.data() + begin * stride, stride);
+            sgemm(true, false, end - begin, input_size, steps, 1.0f, dg_data + begin, gates_size, in_data, input_size, 1.0f, w_grad.data() + begin * stride + hidden_size, stride);
+        });
+
+        //out_derivs += d_gates * W_x, then the chain rule
+        sgemm(false, false, steps, input_size, gates_size, 1.0f, dg_data, gates_size, params_w.data() + hidden_size, stride, 0.0f, stacked_out.data(), input_size);
+        for (size_t s = 0; s < steps; ++s)
+        {
+            float* out = out_derivs[first + s].data();
+            const float* src = stacked_out.data() + s * input_size;
+            for (size_t j = 0; j < input_size; ++j)
+                out[j] += src[j];
+            chain_activations(out_derivs[first + s], activations_pre_vec[first + s], previous_layer_activation);
         }
     }
 };
@@ -1217,13 +2087,7 @@ template<size_t index, size_t features, size_t rows, size_t cols, size_t out_fea
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> size_t LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::n = 0;
 
 //class specific stuff
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMap<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::cell_state_deriv = { 0 }; //keep max num of steps ONLY
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMapVector<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::cell_states = { 0 }; //keep max num of steps ONLY
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMapVector<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::hidden_states = { 0 };
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMapVector<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::forget_states = { 0 };
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMapVector<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::influence_states = { 0 };
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMapVector<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::activation_states = { 0 };
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> FeatureMapVector<out_features, out_rows, out_cols> LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::output_states = { 0 };
+template<size_t index, size_t features, size_t rows, size_t cols, size_t out_features, size_t out_rows, size_t out_cols, size_t max_t_store> typename LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::state_type LSTMLayer<index, features, rows, cols, out_features, out_rows, out_cols, max_t_store>::recurrent_state = {};
 
 //Batch normalization uses population stats for feed forward, calculates batch statistics, CANNOT TRAIN WITHOUT BATCH TRAINING, activation is applied after statistical transformation
 template<size_t index, size_t features, size_t rows, size_t cols, size_t activation_function> class BatchNormalizationLayer : public Layer_Functions<features, rows, cols>
@@ -1265,6 +2129,9 @@ public:
     static const float min_divisor;
     //keeps track of batch size (for population)
     static size_t n;
+    //folded into the layer before for inference (see NeuralNet::fold_batch_normalization), only the activation is left. Shared by every
+    //instance, instances copy the folded parameters from the master (NeuralNet::refresh_folded_thread)
+    static bool folded;
 
     //type of layer (dynamic test, but not stored since constexpr)
     static constexpr size_t type = MTNN_LAYER_BATCHNORMALIZATION;
@@ -1290,10 +2157,16 @@ public:
     //feed forwards given input, weights, biases to output; uses population
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
+        if (folded)
+        {
+            activate_span<activation_function>(input.data(), 0.0f, output.data(), feature_maps_type::elements());
+            return;
+        }
+
         for (size_t f = 0; f < features; ++f)
             for (size_t i = 0; i < rows; ++i)
                 for (size_t j = 0; j < cols; ++j)
-                    output[f].at(i, j) = activate(params_w[f].at(i, j) * (input[f].at(i, j) - activations_population_mean[f].at(i, j)) / sqrt(activations_population_variance[f].at(i, j) + min_divisor) + params_b[f].at(i, j), activation_function);
+                    output[f].at(i, j) = activate_value<activation_function>(params_w[f].at(i, j) * (input[f].at(i, j) - activations_population_mean[f].at(i, j)) / sqrt(activations_population_variance[f].at(i, j) + min_divisor) + params_b[f].at(i, j));
     }
 
     //undo feed forwards, currently just does feed forwards though
@@ -1314,60 +2187,65 @@ public:
     //feed forwards for batch and uses the batch's statistics (not population) and then updates population statistics
     static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases, bool discriminating = false)
     {
-        //different output for training
-        for (size_t f = 0; f < features; ++f)
-        {
-            for (size_t i = 0; i < rows; ++i)
-            {
-                for (size_t j = 0; j < cols; ++j)
-                {
-                    float sumx = 0.0f;
-                    float sumxsqr = 0.0f;
-                    size_t n_in = outputs.size();
-                    //compute statistics
-                    for (size_t in = 0; in < n_in; ++in)
-                    {
-                        float x = inputs[in][f].at(i, j);
-                        sumx += x;
-                        sumxsqr += x * x;
-                    }
-
-                    //apply to outputs
-                    float mean = sumx / n_in;
-                    float var = sumxsqr / n_in - mean * mean;
-                    float std = sqrt(var + min_divisor);
-                    float gamma = params_w[f].at(i, j);
-                    float beta = params_b[f].at(i, j);
-                    for (size_t in = 0; in < n_in; ++in)
-                        outputs[in][f].at(i, j) = activate(gamma * (inputs[in][f].at(i, j) - mean) / std + beta, activation_function);
+        constexpr size_t elements = feature_maps_type::elements();
+        size_t n_in = outputs.size();
 
-                    /*activations_population_mean[f].at(i, j) = mean;
-                    activations_population_variance[f].at(i, j) = var;*/ //keeps relatively stable batch vs discriminatory values
+        //inference only
+        if (folded)
+        {
+            for (size_t in = 0; in < n_in; ++in)
+                activate_span<activation_function>(inputs[in].data(), 0.0f, outputs[in].data(), elements);
+            return;
+        }
 
-                    //set minibatch stats
-                    biases_aux_data[f].at(i, j) = mean;
-                    weights_aux_data[f].at(i, j) = var;
+        //minibatch stats go in aux_data
+        static thread_local moment_accumulator stats;
+        stats.reset(elements);
+        stats.add(inputs, 0, n_in);
+        float* mean = biases_aux_data.data();
+        float* var = weights_aux_data.data();
+        stats.finish(mean, var);
+
+        //outputs are (x - mean) * gamma / std + beta
+        static thread_local std::vector<float> scale;
+        scale.resize(elements);
+        const float* beta = params_b.data();
+        for (size_t e = 0; e < elements; ++e)
+            scale[e] = params_w.data()[e] / sqrt(var[e] + min_divisor);
 
-                    //update population statistics
-                    if (n == 0)
-                    {
-                        activations_population_mean[f].at(i, j) = mean;
-                        activations_population_variance[f].at(i, j) = var;
-                    }
+        //different output for training
+        for (size_t in = 0; in < n_in; ++in)
+        {
+            const float* x = inputs[in].data();
+            float* out = outputs[in].data();
+            size_t e = 0;
+            for (; e + simd_float::width <= elements; e += simd_float::width)
+                ((simd_float::load(x + e) - simd_float::load(mean + e)) * simd_float::load(scale.data() + e) + simd_float::load(beta + e)).store(out + e);
+            for (; e < elements; ++e)
+                out[e] = (x[e] - mean[e]) * scale[e] + beta[e];
+            activate_span<activation_function>(out, 0.0f, out, elements);
+        }
 
-                    else
-                    {
-                        float old_mean = activations_population_mean[f].at(i, j);
-                        float old_var = activations_population_variance[f].at(i, j);
-                        float momentum = .8f;
-                        activations_population_mean[f].at(i, j) = (1 - momentum) * mean + momentum * old_mean;//(old_mean * n + mean) / (n + 1);
-                        activations_population_variance[f].at(i, j) = (1 - momentum) * var + momentum * old_var;//(old_var * (n - 1) / n + var) * n / (n + 1);
-                    }
+        //update population statistics, keeps relatively stable batch vs discriminatory values
+        float* pop_mean = activations_population_mean.data();
+        float* pop_var = activations_population_variance.data();
+        for (size_t e = 0; e < elements; ++e)
+        {
+            if (n == 0)
+            {
+                pop_mean[e] = mean[e];
+                pop_var[e] = var[e];
+            }
 
-                    ++n; //fails completely due to / n w/ n == 0
-                }
+            else
+            {
+                float momentum = .8f;
+                pop_mean[e] = (1 - momentum) * mean[e] + momentum * pop_mean[e];//(old_mean * n + mean) / (n + 1);
+                pop_var[e] = (1 - momentum) * var[e] + momentum * pop_var[e];//(old_var * (n - 1) / n + var) * n / (n + 1);
             }
         }
+        //batches seen, the first one seeds the population statistics
+        ++n;
     }
 
     //batch feed backwards
@@ -1436,13 +2314,12 @@ template<size_t index, size_t features, size_t rows, size_t cols, size_t activat
 template<size_t index, size_t features, size_t rows, size_t cols, size_t activation_function> FeatureMap<0, 0, 0> BatchNormalizationLayer<index, features, rows, cols, activation_function>::generative_biases = { 0 };
 template<size_t index, size_t features, size_t rows, size_t cols, size_t activation_function> const float BatchNormalizationLayer<index, features, rows, cols, activation_function>::min_divisor = .0001f;
 template<size_t index, size_t features, size_t rows, size_t cols, size_t activation_function> size_t BatchNormalizationLayer<index, features, rows, cols, activation_function>::n = 0;
+template<size_t index, size_t features, size_t rows, size_t cols, size_t activation_function> bool BatchNormalizationLayer<index, features, rows, cols, activation_function>::folded = false;
 
 //This pooling layer takes the maximum values in a region and puts in the output
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> class MaxpoolLayer : public Layer_Functions<features, rows, cols>
 {
 public:
-    //todo storing doesn't work in parallel
-
     //feature maps - DO NOT STORE activations if fed forwards - not used for much
     static FeatureMap<features, rows, cols> feature_maps;
     //no parameters
@@ -1496,84 +2373,141 @@ public:
     //won't use, static class
     ~MaxpoolLayer() = default;
 
+    //winners of one feed forwards, one byte per output cell and sample. The layer's own is used unless the calling thread bound another
+    //(NeuralNet instances bind theirs)
+    struct state_type
+    {
+        //offset of the maximum within its region (row * across + col), sample major
+        std::vector<unsigned char> switches;
+
+        void reset() {}
+    };
+
+    static state_type switch_state;
+
     //feed forwards given input, weights, biases to output
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        //set minimum as negative
-        for (size_t f_0 = 0; f_0 < features; ++f_0)
-            for (size_t i = 0; i < output[f_0].rows(); ++i)
-                for (size_t j = 0; j < output[f_0].cols(); ++j)
-                    output[f_0].at(i, j) = -INFINITY;
+        state_type& state = current_state();
+        state.switches.resize(out_size);
+        max_sample(input.data(), output.data(), state.switches.data());
+    }
+
+    //backprops values to previous layer
+    static void feed_backwards(feature_maps_type& output, out_feature_maps_type& input, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
+    {
+        scatter_sample(input.data(), output.data(), current_state().switches.data());
+    }
 
-        for (size_t f = 0; f < features; ++f)
+    //backprops derivatives to next layer (no parameters so no update)
+    static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    {
+        //just move the values back to which ones were passed on
+        scatter_sample(deriv.data(), out_deriv.data(), current_state().switches.data());
+
+        //apply derivatives
+        chain_activations(out_deriv, activations_pre, previous_layer_activation);
+    }
+
+    //batch feed forwards, every sample keeps its own winners
+    static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases)
+    {
+        state_type& state = current_state();
+        state.switches.resize(outputs.size() * out_size);
+
+        //samples are split across threads (the state is this thread's, so pass it by pointer)
+        unsigned char* switches = state.switches.data();
+        parallel_for(0, outputs.size(), sample_grain, [&, switches](size_t begin, size_t end)
         {
-            //get size of region
-            constexpr size_t down = rows / out_rows;
-            constexpr size_t across = cols / out_cols;
-            Matrix2D<Matrix2D<float, down, across>, out_rows, out_cols> samples;
+            for (size_t in = begin; in < end; ++in)
+                max_sample(inputs[in].data(), outputs[in].data(), switches + in * out_size);
+        });
+    }
 
-            //get samples
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
-            {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    //get the current sample
-                    size_t maxI = (i_0 + 1) * down;
-                    size_t maxJ = (j_0 + 1) * across;
-                    for (size_t i2 = i_0 * down; i2 < maxI; ++i2)
-                    {
-                        for (size_t j2 = j_0 * across; j2 < maxJ; ++j2)
-                        {
-                            samples.at(i_0, j_0).at(maxI - i2 - 1, maxJ - j2 - 1) = input[f].at(i2, j2);
-                        }
-                    }
-                }
-            }
+    //batch feed backwards
+    static void feed_backwards(feature_maps_vector_type& outputs, out_feature_maps_vector_type& inputs, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
+    {
+        unsigned char* switches = current_state().switches.data();
+        for (size_t in = 0; in < outputs.size(); ++in)
+            scatter_sample(inputs[in].data(), outputs[in].data(), switches + in * out_size);
+    }
 
-            //find maxes
-            for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
+    //batch train, each sample's derivatives go back through its own winners
+    static void back_prop(size_t previous_layer_activation, out_feature_maps_vector_type& derivs, feature_maps_vector_type& activations_pre_vec, feature_maps_vector_type& out_derivs, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    {
+        unsigned char* switches = current_state().switches.data();
+        parallel_for(0, derivs.size(), sample_grain, [&, switches](size_t begin, size_t end)
+        {
+            for (size_t in = begin; in < end; ++in)
             {
-                for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    for (size_t n = 0; n < samples.at(i_0, j_0).rows(); ++n)
-                    {
-                        for (size_t m = 0; m < samples.at(i_0, j_0).cols(); ++m)
-                        {
-                            if (samples.at(i_0, j_0).at(n, m) > output[f].at(i_0, j_0))
-                            {
-                                output[f].at(i_0, j_0) = samples.at(i_0, j_0).at(n, m);
-                                switches[f].at(i_0, j_0) = std::make_pair(n, m);
-                            }
-                        }
-                    }
-                }
+                scatter_sample(derivs[in].data(), out_derivs[in].data(), switches + in * out_size);
+                chain_activations(out_derivs[in], activations_pre_vec[in], previous_layer_activation);
             }
-        }
+        });
     }
 
-    //backprops values to previous layer
-    static void feed_backwards(feature_maps_type& output, out_feature_maps_type& input, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
+    //point the calling thread's calls at state (nullptr for the layer's own switch_state)
+    static void bind_state(state_type* state)
+    {
+        bound_state() = state;
+    }
+
+private:
+    //size of a region
+    static constexpr size_t down = rows / out_rows;
+    static constexpr size_t across = cols / out_cols;
+    static constexpr size_t out_size = features * out_rows * out_cols;
+    //a sample is about one compare per input
+    static constexpr size_t sample_grain = parallel_grain(features * rows * cols);
+
+    static_assert(down * across <= 256, "maxpool regions have to fit their offsets in a byte");
+
+    //the thread's bound state, if any
+    static state_type*& bound_state()
+    {
+        static thread_local state_type* bound = nullptr;
+        return bound;
+    }
+
+    //state the calling thread works on
+    static state_type& current_state()
+    {
+        state_type* bound = bound_state();
+        return bound != nullptr ? *bound : switch_state;
+    }
+
+    //max of every region of one sample, scanning the regions of a row of outputs in place one offset at a time
+    static void max_sample(const float* input, float* output, unsigned char* switches)
     {
         for (size_t f = 0; f < features; ++f)
         {
-            size_t down = rows / out_rows;
-            size_t across = cols / out_cols;
-
-            //search each sample
             for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
             {
+                const float* in = input + (f * rows + i_0 * down) * cols;
+                float* out = output + (f * out_rows + i_0) * out_cols;
+                unsigned char* sw = switches + (f * out_rows + i_0) * out_cols;
+
+                //the first cell of each region starts as the maximum
                 for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
                 {
-                    std::pair<size_t, size_t> coords = switches[f].at(i_0, j_0);
-                    for (size_t i = 0; i < down; ++i)
+                    out[j_0] = in[j_0 * across];
+                    sw[j_0] = 0;
+                }
+
+                for (size_t n = 0; n < down; ++n)
+                {
+                    for (size_t m = (n == 0 ? 1 : 0); m < across; ++m)
                     {
-                        for (size_t j = 0; j < across; ++j)
+                        const float* src = in + n * cols + m;
+                        unsigned char offset = static_cast<unsigned char>(n * across + m);
+                        for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
                         {
-                            //prop deriv to strongest cell
-                            if (i == coords.first && j == coords.second)
-                                output[f].at(i_0 * down + i, j_0 * across + j) = input[f].at(i_0, j_0);
-                            else
-                                output[f].at(i * down, j * across) = 0;
+                            float val = src[j_0 * across];
+                            if (val > out[j_0])
+                            {
+                                out[j_0] = val;
+                                sw[j_0] = offset;
+                            }
                         }
                     }
                 }
@@ -1581,66 +2515,22 @@ public:
         }
     }
 
-    //backprops derivatives to next layer (no parameters so no update)
-    static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
+    //zero the input side of one sample and put every output value back on its region's maximum
+    static void scatter_sample(const float* output, float* input, const unsigned char* switches)
     {
-        //TODO fails on batch
-
-        //just move the values back to which ones were passed on
+        std::fill(input, input + features * rows * cols, 0.0f);
         for (size_t f = 0; f < features; ++f)
         {
-            size_t down = rows / out_rows;
-            size_t across = cols / out_cols;
-
-            //search each sample
             for (size_t i_0 = 0; i_0 < out_rows; ++i_0)
             {
+                float* in = input + (f * rows + i_0 * down) * cols;
+                const float* out = output + (f * out_rows + i_0) * out_cols;
+                const unsigned char* sw = switches + (f * out_rows + i_0) * out_cols;
                 for (size_t j_0 = 0; j_0 < out_cols; ++j_0)
-                {
-                    //backprop deriv if it was maximum
-                    std::pair<size_t, size_t> coords = switches[f].at(i_0, j_0);
-                    for (size_t i = 0; i < down; ++i)
-                    {
-                        for (size_t j = 0; j < across; ++j)
-                        {
-                            if (i == coords.first && j == coords.second)
-                                out_deriv[f].at(i_0 * down + i, j_0 * across + j) = deriv[f].at(i_0, j_0);
-                            else
-                                out_deriv[f].at(i * down, j * across) = 0;
-                        }
-                    }
-                }
+                    in[(sw[j_0] / across) * cols + j_0 * across + sw[j_0] % across] = out[j_0];
             }
         }
-
-        //apply derivatives
-        chain_activations(out_deriv, activations_pre, previous_layer_activation);
-    }
-
-    //batch feed forwards
-    static void feed_forwards(feature_maps_vector_type& inputs, out_feature_maps_vector_type& outputs, weights_type& params_w = weights, biases_type& params_b = biases)
-    {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_forwards(inputs[in], outputs[in], params_w, params_b);
-    }
-
-    //batch feed backwards
-    static void feed_backwards(feature_maps_vector_type& outputs, out_feature_maps_vector_type& inputs, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
-    {
-        for (size_t in = 0; in < outputs.size(); ++in)
-            feed_backwards(outputs[in], inputs[in], params_w, params_b);
-    }
-
-    //batch train
-    static void back_prop(size_t previous_layer_activation, out_feature_maps_vector_type& derivs, feature_maps_vector_type& activations_pre_vec, feature_maps_vector_type& out_derivs, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
-    {
-        for (size_t in = 0; in < derivs.size(); ++in)
-            back_prop(previous_layer_activation, derivs[in], activations_pre_vec[in], out_derivs[in], false, learning_rate, use_momentum, momentum_term, use_l2_weight_decay, include_biases_decay, weight_decay_factor, params_w, params_b, w_grad, b_grad);
     }
-
-private:
-    //used to keep track of which cell was maximum in each region
-    static FeatureMap<features, out_rows, out_cols, std::pair<size_t, size_t>> switches;
 };
 
 //init static
@@ -1656,7 +2546,7 @@ template<size_t index, size_t features, size_t rows, size_t cols, size_t out_row
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> FeatureMap<0, 0, 0> MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::weights_momentum = { 0 };
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> FeatureMap<0, 0, 0> MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::activations_population_mean = { 0 };
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> FeatureMap<0, 0, 0> MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::activations_population_variance = { 0 };
-template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> FeatureMap<features, out_rows, out_cols, std::pair<size_t, size_t>> MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::switches = {};
+template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> typename MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::state_type MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::switch_state = {};
 template<size_t index, size_t features, size_t rows, size_t cols, size_t out_rows, size_t out_cols> size_t MaxpoolLayer<index, features, rows, cols, out_rows, out_cols>::n = 0;
 
 //Transforms output according to softmax function
@@ -1712,28 +2602,20 @@ public:
     //only used for batch norm
     static size_t n;
 
+    //elements of one map, softmax runs over each
+    static constexpr size_t map_size = rows * cols;
+
     //won't use, static class
     SoftMaxLayer() = default;
 
     //won't use, static class
     ~SoftMaxLayer() = default;
 
-    //compute the softmax
+    //compute the softmax of every map
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
         for (size_t f = 0; f < features; ++f)
-        {
-            //find total
-            float sum = 0.0f;
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    sum += input[f].at(i, j) < 6 ? exp(input[f].at(i, j)) : exp(6);
-
-            //get prob
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    output[f].at(i, j) = (input[f].at(i, j) < 6 ? exp(input[f].at(i, j)) : exp(6)) / sum;
-        }
+            softmax_span(input.data() + f * map_size, output.data() + f * map_size, map_size);
     }
 
     //undo, makes assumptions about total value
@@ -1749,28 +2631,36 @@ public:
                     output[f].at(i, j) = log(total * input[f].at(i, j));
     }
 
-    //backprops derivs, no update
+    //backprops derivs, no update. Softmax's jacobian times deriv: p * (deriv - sum(deriv * p)) per map, p is recomputed in out_deriv
     static void back_prop(size_t previous_layer_activation, out_feature_maps_type& deriv, feature_maps_type& activations_pre, feature_maps_type& out_deriv, bool online, float learning_rate, bool use_momentum, float momentum_term, bool use_l2_weight_decay, bool include_biases_decay, float weight_decay_factor, weights_type& params_w = weights, biases_type& params_b = biases, weights_type& w_grad = weights_gradient, biases_type& b_grad = biases_gradient)
     {
-        //calculate sum of all derivs
-        std::vector<float> sums(features);
         for (size_t f = 0; f < features; ++f)
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    sums[f] += deriv[f].at(i, j);
+        {
+            const float* d = deriv.data() + f * map_size;
+            float* out = out_deriv.data() + f * map_size;
+            softmax_span(activations_pre.data() + f * map_size, out, map_size);
+
+            float dot = 0.0f;
+            for (size_t i = 0; i < map_size; ++i)
+                dot += d[i] * out[i];
+            for (size_t i = 0; i < map_size; ++i)
+                out[i] *= d[i] - dot;
+        }
 
-        //recalculate activations for next layer (little inefficient, but oh well)
-        out_feature_maps_type out_vals{};
-        feed_forwards(activations_pre, out_vals, params_w, params_b);
+        //apply derivatives
+        chain_activations(out_deriv, activations_pre, previous_layer_activation);
+    }
 
-        //compute derivative as = out_act * sum_derivs - deriv
+    //loglikelihood straight through the softmax: derivatives wrt its inputs from its outputs and the labels (no error signals, no jacobian pass),
+    //returns the loss
+    static float back_prop_log_likelihood(size_t previous_layer_activation, out_feature_maps_type& probabilities, out_feature_maps_type& lbls, feature_maps_type& activations_pre, feature_maps_type& out_deriv)
+    {
+        float loss = 0.0f;
         for (size_t f = 0; f < features; ++f)
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    out_deriv[f].at(i, j) = out_vals[f].at(i, j) * sums[f] - deriv[f].at(i, j);
+            loss += softmax_log_likelihood_span(activations_pre.data() + f * map_size, probabilities.data() + f * map_size, lbls.data() + f * map_size, out_deriv.data() + f * map_size, map_size);
 
-        //apply derivatives
         chain_activations(out_deriv, activations_pre, previous_layer_activation);
+        return loss;
     }
 
     //feed forwards batch
@@ -1872,20 +2762,14 @@ public:
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
         //just output
-        for (size_t f = 0; f < features; ++f)
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    output[f].at(i, j) = input[f].at(i, j);
+        std::copy(input.data(), input.data() + input.elements(), output.data());
     }
 
     //basic copy
     static void feed_backwards(feature_maps_type& output, out_feature_maps_type& input, weights_type& params_w = weights, generative_biases_type& params_b = generative_biases)
     {
         //just output
-        for (size_t f = 0; f < features; ++f)
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    output[f].at(i, j) = input[f].at(i, j);
+        std::copy(input.data(), input.data() + input.elements(), output.data());
     }
 
     //basic copy
@@ -1996,10 +2880,7 @@ public:
     //basic copy
     static void feed_forwards(feature_maps_type& input, out_feature_maps_type& output, weights_type& params_w = weights, biases_type& params_b = biases)
     {
-        for (size_t f = 0; f < features; ++f)
-            for (size_t i = 0; i < rows; ++i)
-                for (size_t j = 0; j < cols; ++j)
-                    output[f].at(i, j) = input[f].at(i, j);
+        std::copy(input.data(), input.data() + input.elements(), output.data());
     }
 
     //basic copy
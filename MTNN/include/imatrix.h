@@ -1,12 +1,76 @@
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include <initializer_list>
 #include <memory>
+#include <new>
 
 #include <math.h>
 #include <stdlib.h>
 
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+#include "random.h"
+
+//alignment of all feature map buffers (cache line, also enough for AVX loads)
+#define MTNN_ALIGNMENT 64
+
+//called with the size of every aligned allocation when defined (before including), eg to count them in tests
+#ifndef MTNN_ALLOCATION_HOOK
+#define MTNN_ALLOCATION_HOOK(bytes)
+#endif
+
+//allocator handing out MTNN_ALIGNMENT aligned blocks, used for the contiguous feature map storage
+template<typename T, size_t alignment = MTNN_ALIGNMENT> class aligned_allocator
+{
+public:
+    using value_type = T;
+
+    template<typename U> struct rebind
+    {
+        using other = aligned_allocator<U, alignment>;
+    };
+
+    aligned_allocator() = default;
+
+    template<typename U> aligned_allocator(const aligned_allocator<U, alignment>&) {}
+
+    T* allocate(size_t n)
+    {
+        if (n == 0)
+            return nullptr;
+        MTNN_ALLOCATION_HOOK(n * sizeof(T));
+        void* ptr = nullptr;
+#ifdef _MSC_VER
+        ptr = _aligned_malloc(n * sizeof(T), alignment);
+#else
+        if (posix_memalign(&ptr, alignment, n * sizeof(T)) != 0)
+            ptr = nullptr;
+#endif
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t /*n*/)
+    {
+#ifdef _MSC_VER
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+};
+
+template<typename T, typename U, size_t alignment> bool operator==(const aligned_allocator<T, alignment>&, const aligned_allocator<U, alignment>&) { return true; }
+template<typename T, typename U, size_t alignment> bool operator!=(const aligned_allocator<T, alignment>&, const aligned_allocator<U, alignment>&) { return false; }
+
+//tag used to construct a Matrix2D that doesn't own its data (points into a FeatureMap's buffer)
+struct matrix_view_t {};
+
 //basic abstract class - use for pointers to unknown sizes of Matrix2D (ie IMatrix<float>* m; ... m->at(i, j) ... )
 template<typename T> class IMatrix
 {
@@ -26,38 +90,59 @@ template<typename T, size_t r, size_t c> class Matrix2D : public IMatrix<T>
 public:
 
     //default constructor
-    Matrix2D()
+    Matrix2D() : storage(r * c), data(storage.data())
     {
-        data = std::vector<T>(r * c);;
         for (size_t i = 0; i < r * c; ++i)
             data[i] = T();
     }
 
     //construct with all elements equal to same value (usually 0 or 1)
-    Matrix2D(T val)
+    Matrix2D(T val) : storage(r * c), data(storage.data())
     {
-        data = std::vector<T>(r * c);;
         for (size_t i = 0; i < r * c; ++i)
             data[i] = val;
     }
 
     //construct with all elements drawn randomly from uniform distribution (defined by params) 
-    Matrix2D(const T& min, const T& max)
+    Matrix2D(const T& min, const T& max) : storage(r * c), data(storage.data())
     {
-        data = std::vector<T>(r * c);;
-        T diff = max - min;
-        for (size_t i = 0; i < data.size(); ++i)
-            data[i] = (diff * rand()) / RAND_MAX + min;
+        random_uniform(data, r * c, min, max);
     }
 
-    //deep copy
-    Matrix2D(const Matrix2D<T, r, c>& ref)
+    //non owning view of r * c elements starting at view_data (used by FeatureMap)
+    Matrix2D(matrix_view_t, T* view_data) : data(view_data)
     {
-        data = std::vector<T>(r * c);
-        for (size_t i = 0; i < data.size(); ++i)
+    }
+
+    //deep copy (a copy of a view owns its data)
+    Matrix2D(const Matrix2D<T, r, c>& ref) : storage(r * c), data(storage.data())
+    {
+        for (size_t i = 0; i < r * c; ++i)
             data[i] = ref.data[i];
     }
 
+    //steals the data if owned, views are deep copied so they never alias after a move
+    Matrix2D(Matrix2D<T, r, c>&& ref)
+    {
+        if (ref.is_view())
+            storage = std::vector<T>(ref.data, ref.data + r * c);
+        else
+        {
+            storage = std::move(ref.storage);
+            ref.data = nullptr;
+        }
+        data = storage.data();
+    }
+
+    //copies values, never rebinds (so assigning into a FeatureMap's plane writes through to its buffer)
+    Matrix2D& operator=(const Matrix2D<T, r, c>& ref)
+    {
+        if (this != &ref)
+            for (size_t i = 0; i < r * c; ++i)
+                data[i] = ref.data[i];
+        return *this;
+    }
+
     //construct from particular example (doesn't work well with brace-initialization, hence commented out)
     /*Matrix2D(std::initializer_list<std::initializer_list<T>> arr)
     {
@@ -87,9 +172,15 @@ public:
         }
     }*/
 
-    //vector cleans itself up
+    //vector cleans itself up (views don't own anything)
     ~Matrix2D() = default;
 
+    //whether this matrix points into someone else's buffer
+    bool is_view() const
+    {
+        return storage.empty() && r * c != 0;
+    }
+
     //get element
     T& at(const size_t& i, const size_t& j) override
     {
@@ -141,41 +232,67 @@ public:
         return c;
     }
 
-    //data, stored in vector so data is in heap, not stack
-    std::vector<T> data;
+private:
+    //owned data, stored in vector so data is in heap, not stack (empty if a view)
+    std::vector<T> storage;
+
+public:
+    //row major elements, either storage's or a FeatureMap's
+    T* data;
 };
 
-//Basically just a vector of Matrix2D<>s
+//versions handed to feature maps, unique over the whole program so a cache can key on a version alone
+inline size_t next_feature_map_version()
+{
+    static std::atomic<size_t> counter{ 0 };
+    return ++counter;
+}
+
+//One contiguous aligned f * r * c buffer, with each feature exposed as a Matrix2D<> view into it
 template<size_t f, size_t r, size_t c, typename T = float> class FeatureMap
 {
 public:
 
     //default constructor
-    FeatureMap()
+    FeatureMap() : storage(f * r * c), buffer(storage.data()), revision(next_feature_map_version())
     {
-        for (size_t k = 0; k < f; ++k)
-            maps.push_back(Matrix2D<T, r, c>());
+        bind_maps();
     }
 
     //set all to same value
-    FeatureMap(T val)
+    FeatureMap(T val) : storage(f * r * c, val), buffer(storage.data()), revision(next_feature_map_version())
     {
-        for (size_t k = 0; k < f; ++k)
-            maps.push_back(Matrix2D<T, r, c>(val));
+        bind_maps();
     }
 
     //draw from uniform distribution (defined by params)
-    FeatureMap(T max, T min)
+    FeatureMap(T max, T min) : storage(f * r * c), buffer(storage.data()), revision(next_feature_map_version())
     {
-        for (size_t k = 0; k < f; ++k)
-            maps.push_back(Matrix2D<T, r, c>(max, min));
+        random_uniform(buffer, f * r * c, max, min);
+        bind_maps();
     }
 
     //deep copy
-    FeatureMap(const FeatureMap<f, r, c, T>& ref)
+    FeatureMap(const FeatureMap<f, r, c, T>& ref) : storage(ref.buffer, ref.buffer + f * r * c), buffer(storage.data()), revision(next_feature_map_version())
     {
-        for (size_t k = 0; k < f; ++k)
-            maps.push_back(ref[k]);
+        bind_maps();
+    }
+
+    //steals the buffer, the views keep pointing at it
+    FeatureMap(FeatureMap<f, r, c, T>&& ref) noexcept : storage(std::move(ref.storage)), maps(std::move(ref.maps)), buffer(ref.buffer), revision(ref.revision)
+    {
+        ref.buffer = nullptr;
+        ref.revision = next_feature_map_version();
+    }
+
+    //copies values into the current buffer
+    FeatureMap& operator=(const FeatureMap<f, r, c, T>& ref)
+    {
+        if (this != &ref)
+            for (size_t i = 0; i < f * r * c; ++i)
+                buffer[i] = ref.buffer[i];
+        touch();
+        return *this;
     }
 
     /*
@@ -211,6 +328,59 @@ public:
         return maps[feat];
     }
 
+    //the whole contiguous buffer (feature after feature, each row major)
+    T* data()
+    {
+        return buffer;
+    }
+
+    //the whole contiguous buffer (feature after feature, each row major)
+    const T* data() const
+    {
+        return buffer;
+    }
+
+    //changes whenever the values are known to change, lets caches of derived data (like transformed kernels) tell they're stale
+    size_t version() const
+    {
+        return revision;
+    }
+
+    //call after writing through data() or the maps, gives a fresh version
+    void touch()
+    {
+        revision = next_feature_map_version();
+    }
+
+    //use f * r * c elements of external memory (eg a mapped model file) instead of an owned buffer, without copying.
+    //The memory has to outlive the feature map, or at least the next alias() or own()
+    void alias(T* external)
+    {
+        storage = std::vector<T, aligned_allocator<T>>();
+        buffer = external;
+        maps.clear();
+        bind_maps();
+        touch();
+    }
+
+    //copy the values of an aliased feature map into an owned buffer again
+    void own()
+    {
+        if (!is_alias())
+            return;
+        storage.assign(buffer, buffer + f * r * c);
+        buffer = storage.data();
+        maps.clear();
+        bind_maps();
+        touch();
+    }
+
+    //whether the elements live in external memory (see alias())
+    bool is_alias() const
+    {
+        return storage.empty() && f * r * c != 0;
+    }
+
     //returns current number of maps (constexpr so no memory access!)
     static constexpr size_t size()
     {
@@ -229,13 +399,36 @@ public:
         return c;
     }
 
+    //returns total number of elements (constexpr so no memory access!)
+    static constexpr size_t elements()
+    {
+        return f * r * c;
+    }
+
     //Can be useful in templates
     using type = Matrix2D<T, r, c>;
 
 private:
 
-    //vector so it's on heap
+    //point each map at its plane of the buffer
+    void bind_maps()
+    {
+        maps.reserve(f);
+        for (size_t k = 0; k < f; ++k)
+            maps.emplace_back(matrix_view_t{}, buffer + k * r * c);
+    }
+
+    //single allocation for every feature
+    std::vector<T, aligned_allocator<T>> storage;
+
+    //non owning views, one per feature
     std::vector<Matrix2D<T, r, c>> maps;
+
+    //start of the elements (storage's, or external memory if aliased)
+    T* buffer;
+
+    //see version()
+    size_t revision;
 };
 
 //basic matrix multiplication
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "imatrix.h"
+
+//first bytes of every model file
+#define MTNN_MODEL_MAGIC "MTNNMODL"
+//bump whenever the layout below changes
+#define MTNN_MODEL_VERSION 1
+//tensor slots stored for every layer (empty ones take no space)
+#define MTNN_MODEL_TENSORS 5
+
+//tensor slots of a layer, in file order
+#define MTNN_TENSOR_WEIGHTS 0
+#define MTNN_TENSOR_BIASES 1
+#define MTNN_TENSOR_GENERATIVE_BIASES 2
+#define MTNN_TENSOR_POPULATION_MEAN 3
+#define MTNN_TENSOR_POPULATION_VARIANCE 4
+
+//stdio buffer for streamed saves, so the padding and index writes don't each reach the OS
+#ifndef MTNN_MODEL_IO_BUFFER
+#define MTNN_MODEL_IO_BUFFER (1 << 20)
+#endif
+
+//Model file: this header, then the index (layers * MTNN_MODEL_TENSORS entries, layer major), then the float blobs, each
+//starting on a multiple of MTNN_ALIGNMENT bytes so a mapped file can be used in place
+struct model_file_header
+{
+    char magic[8];
+    uint32_t version;
+    //0x01020304 as stored by the saving machine, files from the other byte order are rejected
+    uint32_t byte_order;
+    //hash of the layer pack, see NeuralNet::signature()
+    uint64_t signature;
+    uint64_t layer_count;
+    uint64_t alignment;
+    //total bytes, catches truncated files
+    uint64_t file_size;
+    //hash of the index
+    uint64_t index_checksum;
+    //hash of every blob in index order (not the padding)
+    uint64_t data_checksum;
+};
+
+//where one tensor lives in the file
+struct model_tensor_entry
+{
+    uint64_t offset;
+    uint64_t elements;
+};
+
+//64 bit FNV-1a, continue a running hash by passing it back in as seed
+inline uint64_t model_hash(const void* data, size_t bytes, uint64_t seed = 14695981039346656037ull)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; ++i)
+        seed = (seed ^ p[i]) * 1099511628211ull;
+    return seed;
+}
+
+//offset rounded up to the blob alignment
+inline uint64_t model_align(uint64_t offset)
+{
+    return (offset + MTNN_ALIGNMENT - 1) / MTNN_ALIGNMENT * MTNN_ALIGNMENT;
+}
+
+//hash of every blob of a file image in index order, what model_file_header::data_checksum holds
+inline uint64_t model_data_checksum(const unsigned char* image, const model_tensor_entry* index, size_t entries)
+{
+    uint64_t hash = model_hash(nullptr, 0);
+    for (size_t e = 0; e < entries; ++e)
+        hash = model_hash(image + index[e].offset, static_cast<size_t>(index[e].elements) * sizeof(float), hash);
+    return hash;
+}
+
+//saves go to path + ".tmp" first and replace path only once complete
+inline std::string model_temp_path(const char* path)
+{
+    return std::string(path) + ".tmp";
+}
+
+//moves a finished temp file over path in one step: readers never see a partial file, and a mapping of the old file keeps its
+//pages (POSIX keeps the replaced file alive while it's mapped). The temp file is removed if it can't be moved
+inline bool model_replace(const std::string& temp, const char* path, bool ok)
+{
+#ifdef _MSC_VER
+    ok = ok && MoveFileExA(temp.c_str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = ok && rename(temp.c_str(), path) == 0;
+#endif
+    if (!ok)
+        remove(temp.c_str());
+    return ok;
+}
+
+//Writes complete file images on a background thread, one at a time. The image is staged by the caller (a plain memcpy
+//of the parameters), the data checksum and the write happen on the writer's thread
+class model_writer
+{
+public:
+    model_writer() = default;
+
+    ~model_writer()
+    {
+        wait();
+    }
+
+    model_writer(const model_writer&) = delete;
+    model_writer& operator=(const model_writer&) = delete;
+
+    //buffer the next image goes in, kept between saves. Only fill it after wait()
+    std::vector<unsigned char>& staging()
+    {
+        return image;
+    }
+
+    //checksum the staged image and write it to path, returns right away. Waits for the previous write first
+    void start(const char* path)
+    {
+        wait();
+        target = path;
+        worker = std::thread(&model_writer::run, this);
+    }
+
+    //blocks until the last write is done, false if it failed
+    bool wait()
+    {
+        if (worker.joinable())
+            worker.join();
+        return result;
+    }
+
+private:
+    std::vector<unsigned char> image;
+    std::string target;
+    std::thread worker;
+    bool result = true;
+
+    void run()
+    {
+        model_file_header header;
+        memcpy(&header, image.data(), sizeof(header));
+        const model_tensor_entry* index = reinterpret_cast<const model_tensor_entry*>(image.data() + sizeof(header));
+        header.data_checksum = model_data_checksum(image.data(), index, static_cast<size_t>(header.layer_count) * MTNN_MODEL_TENSORS);
+        memcpy(image.data(), &header, sizeof(header));
+
+        std::string temp = model_temp_path(target.c_str());
+        FILE* fp = nullptr;
+#ifdef _MSC_VER
+        fopen_s(&fp, temp.c_str(), "wb");
+#else
+        fp = fopen(temp.c_str(), "wb");
+#endif
+        if (fp == nullptr)
+        {
+            result = false;
+            return;
+        }
+        //the whole image in one call, nothing worth buffering
+        setvbuf(fp, nullptr, _IONBF, 0);
+        bool ok = fwrite(image.data(), 1, image.size(), fp) == image.size();
+        ok = fclose(fp) == 0 && ok;
+        result = model_replace(temp, target.c_str(), ok);
+    }
+};
+
+//Whole file mapped copy on write: pages nobody writes to are shared with every other process mapping the same file,
+//written pages become private to this process and never reach the file
+class model_mapping
+{
+public:
+    model_mapping() = default;
+
+    ~model_mapping()
+    {
+        unmap();
+    }
+
+    model_mapping(const model_mapping&) = delete;
+    model_mapping& operator=(const model_mapping&) = delete;
+
+    //maps path, false if it can't be opened or is empty
+    bool map(const char* path)
+    {
+        unmap();
+        source = path;
+#ifdef _MSC_VER
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+        {
+            unmap();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            unmap();
+            return false;
+        }
+        bytes = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+        if (bytes == nullptr)
+        {
+            unmap();
+            return false;
+        }
+        length = static_cast<size_t>(file_size.QuadPart);
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* ptr = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        //the mapping keeps the file referenced
+        close(fd);
+        if (ptr == MAP_FAILED)
+            return false;
+        bytes = static_cast<unsigned char*>(ptr);
+        length = static_cast<size_t>(info.st_size);
+#endif
+        return true;
+    }
+
+    //releases the mapping, anything still pointing into it dangles
+    void unmap()
+    {
+#ifdef _MSC_VER
+        if (bytes != nullptr)
+            UnmapViewOfFile(bytes);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes != nullptr)
+            munmap(bytes, length);
+#endif
+        bytes = nullptr;
+        length = 0;
+        source.clear();
+    }
+
+    void swap(model_mapping& other)
+    {
+#ifdef _MSC_VER
+        std::swap(file, other.file);
+        std::swap(mapping, other.mapping);
+#endif
+        std::swap(bytes, other.bytes);
+        std::swap(length, other.length);
+        source.swap(other.source);
+    }
+
+    bool is_mapped() const
+    {
+        return bytes != nullptr;
+    }
+
+    //start of the file, page aligned
+    unsigned char* data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    //whether path (as passed to map) is the mapped file
+    bool maps(const char* path) const
+    {
+        return is_mapped() && source == path;
+    }
+
+private:
+#ifdef _MSC_VER
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+    unsigned char* bytes = nullptr;
+    size_t length = 0;
+    std::string source;
+};
@@ -1,20 +1,32 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstring>
 #include <functional>
 #include <stdio.h>
 #include <tuple>
+#include <type_traits>
 
 #include "imatrix.h"
 #include "ilayer.h"
+#include "modelfile.h"
+#include "optimizer.h"
+#include "random.h"
 
 //default, MSE
 #define MTNN_LOSS_L2 0
-//assumes prior layer is softmax
+//fused with a softmax right before the output layer, otherwise error signals are -y/p
 #define MTNN_LOSS_LOGLIKELIHOOD 1
 //undefined for error, instead sets output to labels during training
 #define MTNN_LOSS_CUSTOMTARGETS 2
 
+//smallest output the loglikelihood error signals divide by, so a zero probability doesn't give inf
+#ifndef MTNN_LOGLIKELIHOOD_EPSILON
+#define MTNN_LOGLIKELIHOOD_EPSILON 1e-7f
+#endif
+
 //vanilla, add in momentum or hessian if desired
 #define MTNN_OPT_BACKPROP 0
 //can't use with momentum or hessian
@@ -23,7 +35,6 @@
 #define MTNN_OPT_ADAGRAD 2
 
 ////HELPER FUNCTIONS
-////Network class definitions begin at line 171
 
 //TEMPLATE FOR LOOP, if using for<...> then have to add a 0 if using MSVC. Sorry
 
@@ -166,163 +177,338 @@ template<typename str_type> struct builder//str_type is static class with string
     struct const_str { const char* chars = string_literal; }; \
     return do_foreach_range<sizeof(string_literal) - 1, builder<const_str>::do_foreach>::type{}; }()
 
-//The class for a neural network. Put in types of *Layer as layers...
+//POLICIES
+
+//policy value that leaves the choice to the runtime flag
+#define MTNN_POLICY_RUNTIME ((size_t)-1)
+
+//Compile time policies, put any of them in front of the layers: NeuralNet<Opt<MTNN_OPT_ADAM>, Loss<MTNN_LOSS_LOGLIKELIHOOD>, layers...>.
+//A fixed policy replaces the runtime flag of the same name, so the other branches are compiled out of the training loops
+template<size_t method> struct Opt {};
+template<size_t function> struct Loss {};
+template<bool enabled> struct Momentum {};
+template<bool enabled> struct Dropout {};
+
+//the policies of a net, MTNN_POLICY_RUNTIME for whatever isn't fixed
+template<size_t opt = MTNN_POLICY_RUNTIME, size_t loss = MTNN_POLICY_RUNTIME, size_t momentum = MTNN_POLICY_RUNTIME, size_t dropout = MTNN_POLICY_RUNTIME> struct net_policy
+{
+    static constexpr size_t optimization_method = opt;
+    static constexpr size_t loss_function = loss;
+    static constexpr size_t use_momentum = momentum;
+    static constexpr size_t use_dropout = dropout;
+};
+
+//policy with marker applied, is_marker is false for anything that isn't one (ie the first layer)
+template<typename policy, typename marker> struct add_net_policy
+{
+    static constexpr bool is_marker = false;
+    using type = policy;
+};
+
+template<size_t o, size_t l, size_t m, size_t d, size_t method> struct add_net_policy<net_policy<o, l, m, d>, Opt<method>>
+{
+    static constexpr bool is_marker = true;
+    using type = net_policy<method, l, m, d>;
+};
+
+template<size_t o, size_t l, size_t m, size_t d, size_t function> struct add_net_policy<net_policy<o, l, m, d>, Loss<function>>
+{
+    static constexpr bool is_marker = true;
+    using type = net_policy<o, function, m, d>;
+};
+
+template<size_t o, size_t l, size_t m, size_t d, bool enabled> struct add_net_policy<net_policy<o, l, m, d>, Momentum<enabled>>
+{
+    static constexpr bool is_marker = true;
+    using type = net_policy<o, l, enabled ? 1 : 0, d>;
+};
+
+template<size_t o, size_t l, size_t m, size_t d, bool enabled> struct add_net_policy<net_policy<o, l, m, d>, Dropout<enabled>>
+{
+    static constexpr bool is_marker = true;
+    using type = net_policy<o, l, m, enabled ? 1 : 0>;
+};
+
+//DROPOUT
+
+//Inverted dropout of one layer's input for a whole batch: a keep bit per value and sample, each sample starting on a new word, drawn
+//in one pass. Kept values are scaled by 1 / (1 - p) so nothing changes at inference. The bits stay until the next feed forwards so
+//backprop can zero the derivatives of the dropped values
+class dropout_mask
+{
+public:
+    bool active() const
+    {
+        return !bits.empty();
+    }
+
+    //no mask, backprop is left alone
+    void clear()
+    {
+        bits.clear();
+    }
+
+    //keep bits for samples samples of n values each, dropped with probability p
+    void draw(philox_stream& rng, size_t samples, size_t n, float p)
+    {
+        words = (n + 31) / 32;
+        bits.resize(samples * words);
+        rng.bernoulli_bits(bits.data(), bits.size() * 32, 1.0f - p);
+        scale = p < 1.0f ? 1.0f / (1.0f - p) : 0.0f;
+    }
+
+    size_t samples() const
+    {
+        return words != 0 ? bits.size() / words : 0;
+    }
+
+    //sample s's values: the dropped zeroed, the kept scaled
+    void apply(size_t s, float* values, size_t n) const
+    {
+        const uint32_t* b = bits.data() + s * words;
+        size_t i = 0;
+        for (; i + simd_float::width <= n; i += simd_float::width)
+            mask_span<simd_float>(b, i, values, scale);
+        for (; i < n; ++i)
+            mask_span<scalar_float>(b, i, values, scale);
+    }
+
+    //sample s's derivatives wrt its dropped out values to derivatives wrt the values before dropout, and the values back to those
+    //(so the activation derivative can be taken from them, dropped ones are left at 0)
+    void back_prop(size_t s, float* derivs, float* values, size_t n) const
+    {
+        const uint32_t* b = bits.data() + s * words;
+        float unscale = scale != 0.0f ? 1.0f / scale : 0.0f;
+        size_t i = 0;
+        for (; i + simd_float::width <= n; i += simd_float::width)
+        {
+            mask_span<simd_float>(b, i, derivs, scale);
+            (simd_float::load(values + i) * simd_float::set1(unscale)).store(values + i);
+        }
+        for (; i < n; ++i)
+        {
+            mask_span<scalar_float>(b, i, derivs, scale);
+            values[i] *= unscale;
+        }
+    }
+
+private:
+    std::vector<uint32_t> bits;
+    //words per sample
+    size_t words = 0;
+    float scale = 1.0f;
+
+    //vectors never straddle a word, the width divides 32
+    template<typename vec> static inline void mask_span(const uint32_t* b, size_t i, float* values, float scale)
+    {
+        mask_bits(b[i / 32] >> (i % 32), vec::load(values + i) * vec::set1(scale)).store(values + i);
+    }
+};
+
+template<typename policy, typename... layers> class BasicNeuralNet;
+
+//peels the leading markers off NeuralNet's arguments into the policy
+template<typename policy, typename first, typename... rest> struct make_neural_net;
+
+template<bool is_marker, typename policy, typename first, typename... rest> struct make_neural_net_step
+{
+    using type = BasicNeuralNet<policy, first, rest...>;
+};
+
+template<typename policy, typename first, typename... rest> struct make_neural_net_step<true, policy, first, rest...>
+{
+    using type = typename make_neural_net<typename add_net_policy<policy, first>::type, rest...>::type;
+};
+
+template<typename policy, typename first, typename... rest> struct make_neural_net
+{
+    using type = typename make_neural_net_step<add_net_policy<policy, first>::is_marker, policy, first, rest...>::type;
+};
+
+//The class for a neural network. Put in types of *Layer as layers..., optionally preceded by policies
+template<typename... args> using NeuralNet = typename make_neural_net<net_policy<>, args...>::type;
+
+//The network itself, NeuralNet picks the policy.
 //The static class is considered the "global" network. Creating an instance of this class creates a thread net (with separate weights & gradients)
-template<typename... layers>
-class NeuralNet
+template<typename policy, typename... layers>
+class BasicNeuralNet
 {
 private:
 
     ////LAYER LOOP BODIES
 
-    //save a weight file
-    template<typename file_name> struct save_data_t
+    //a layer's tensors by MTNN_TENSOR_* slot, as stored in model files
+    template<size_t l> struct model_tensors
     {
-        save_data_t()
+        using layer = get_type<l, layers...>;
+
+        static float* data(size_t slot)
         {
-#ifdef _MSC_VER
-            fopen_s(&fp, file_name::string, "w+b");
-            loop_up_layers<save_data_impl>(0);
-#else
-            fp = fopen(file_name::string, "w+b");
-            loop_up_layers<save_data_impl>();
-#endif
-            fclose(fp);
+            switch (slot)
+            {
+            case MTNN_TENSOR_WEIGHTS:
+                return layer::weights.data();
+            case MTNN_TENSOR_BIASES:
+                return layer::biases.data();
+            case MTNN_TENSOR_GENERATIVE_BIASES:
+                return layer::generative_biases.data();
+            case MTNN_TENSOR_POPULATION_MEAN:
+                return layer::activations_population_mean.data();
+            default:
+                return layer::activations_population_variance.data();
+            }
         }
-    private:
-        static FILE* fp;
 
-        //save a layer
-        template<size_t l> struct save_data_impl
+        static size_t elements(size_t slot)
         {
-        public:
-            void write_float(const float& f, FILE* file)
+            switch (slot)
             {
-                fwrite(&f, sizeof(float), 1, file);
+            case MTNN_TENSOR_WEIGHTS:
+                return layer::weights.elements();
+            case MTNN_TENSOR_BIASES:
+                return layer::biases.elements();
+            case MTNN_TENSOR_GENERATIVE_BIASES:
+                return layer::generative_biases.elements();
+            case MTNN_TENSOR_POPULATION_MEAN:
+                return layer::activations_population_mean.elements();
+            default:
+                return layer::activations_population_variance.elements();
             }
-            save_data_impl()
-            {
-                using layer = get_layer<l>;
-
-                if (layer::type == MTNN_LAYER_BATCHNORMALIZATION)
-                {
-                    using t = decltype(layer::activations_population_mean);
-                    for (size_t d = 0; d < t::size(); ++d)
-                    {
-                        for (size_t i = 0; i < t::rows(); ++i)
-                        {
-                            for (size_t j = 0; j < t::cols(); ++j)
-                            {
-                                write_float(layer::activations_population_mean[d].at(i, j), fp);
-                                write_float(layer::activations_population_variance[d].at(i, j), fp);
-                            }
-                        }
-                    }
-                }
+        }
 
-                //begin weights values
-                {
-                    using t = decltype(layer::weights);
-                    for (size_t d = 0; d < t::size(); ++d)
-                        for (size_t i = 0; i < t::rows(); ++i)
-                            for (size_t j = 0; j < t::cols(); ++j)
-                                write_float(layer::weights[d].at(i, j), fp);
-                }
+        //point the slot at external memory, or back at an owned copy if external is null
+        static void alias(size_t slot, float* external)
+        {
+            switch (slot)
+            {
+            case MTNN_TENSOR_WEIGHTS:
+                external != nullptr ? layer::weights.alias(external) : layer::weights.own();
+                break;
+            case MTNN_TENSOR_BIASES:
+                external != nullptr ? layer::biases.alias(external) : layer::biases.own();
+                break;
+            case MTNN_TENSOR_GENERATIVE_BIASES:
+                external != nullptr ? layer::generative_biases.alias(external) : layer::generative_biases.own();
+                break;
+            case MTNN_TENSOR_POPULATION_MEAN:
+                external != nullptr ? layer::activations_population_mean.alias(external) : layer::activations_population_mean.own();
+                break;
+            default:
+                external != nullptr ? layer::activations_population_variance.alias(external) : layer::activations_population_variance.own();
+                break;
+            }
+        }
+    };
 
-                //begin biases values
-                {
-                    using t = decltype(layer::biases);
-                    for (size_t f_0 = 0; f_0 < t::size(); ++f_0)
-                        for (size_t i_0 = 0; i_0 < t::rows(); ++i_0)
-                            for (size_t j_0 = 0; j_0 < t::cols(); ++j_0)
-                                write_float(layer::biases[f_0].at(i_0, j_0), fp);//bias values
-                }
+    //hash a layer's kind and every shape it has into the signature
+    template<size_t l> struct signature_impl
+    {
+        signature_impl(uint64_t& hash)
+        {
+            using layer = get_layer<l>;
+            using in_t = typename layer::feature_maps_type;
+            using out_t = typename layer::out_feature_maps_type;
+            using w_t = typename layer::weights_type;
+            using b_t = typename layer::biases_type;
+            using g_t = typename layer::generative_biases_type;
+            using m_t = decltype(layer::activations_population_mean);
+            const uint64_t shape[] = { layer::type, layer::activation,
+                in_t::size(), in_t::rows(), in_t::cols(), out_t::size(), out_t::rows(), out_t::cols(),
+                w_t::size(), w_t::rows(), w_t::cols(), b_t::size(), b_t::rows(), b_t::cols(),
+                g_t::size(), g_t::rows(), g_t::cols(), m_t::size(), m_t::rows(), m_t::cols() };
+            hash = model_hash(shape, sizeof(shape), hash);
+        }
+    };
 
-                //begin gen biases values
-                {
-                    using t = decltype(layer::generative_biases);
-                    for (size_t f = 0; f < t::size(); ++f)
-                        for (size_t i = 0; i < t::rows(); ++i)
-                            for (size_t j = 0; j < t::cols(); ++j)
-                                write_float(layer::generative_biases[f].at(i, j), fp);//gen bias values
-                }
+    //lay out a layer's blobs after offset
+    template<size_t l> struct model_index_impl
+    {
+        model_index_impl(model_tensor_entry* index, uint64_t& offset)
+        {
+            for (size_t slot = 0; slot < MTNN_MODEL_TENSORS; ++slot)
+            {
+                model_tensor_entry& entry = index[l * MTNN_MODEL_TENSORS + slot];
+                entry.elements = model_tensors<l>::elements(slot);
+                entry.offset = entry.elements != 0 ? model_align(offset) : 0;
+                if (entry.elements != 0)
+                    offset = entry.offset + entry.elements * sizeof(float);
             }
-        };
+        }
     };
 
-    //load a weight file
-    template<typename file_name> struct load_data_t
+    //hash a layer's blobs into the data checksum
+    template<size_t l> struct model_checksum_impl
     {
-        load_data_t()
+        model_checksum_impl(uint64_t& hash)
         {
-#ifdef _MSC_VER
-            fopen_s(&fp, file_name::string, "r+b");
-            loop_up_layers<load_data_impl>(0);
-#else
-            fp = fopen(file_name::string, "r+b");
-            loop_up_layers<load_data_impl>();
-#endif
-            fclose(fp);
+            for (size_t slot = 0; slot < MTNN_MODEL_TENSORS; ++slot)
+                hash = model_hash(model_tensors<l>::data(slot), model_tensors<l>::elements(slot) * sizeof(float), hash);
         }
-    private:
-        static FILE* fp;
+    };
 
-        //load a layer
-        template<size_t l> struct load_data_impl
+    //write a layer's blobs at their offsets (position is where the file currently is)
+    template<size_t l> struct model_write_impl
+    {
+        model_write_impl(FILE* fp, const model_tensor_entry* index, uint64_t& position)
         {
-        public:
-            void read_float(float& out_float, FILE* file)
+            static const char padding[MTNN_ALIGNMENT] = {};
+            for (size_t slot = 0; slot < MTNN_MODEL_TENSORS; ++slot)
             {
-                fread(&out_float, sizeof(float), 1, file);
+                const model_tensor_entry& entry = index[l * MTNN_MODEL_TENSORS + slot];
+                if (entry.elements == 0)
+                    continue;
+                fwrite(padding, 1, static_cast<size_t>(entry.offset - position), fp);
+                fwrite(model_tensors<l>::data(slot), sizeof(float), static_cast<size_t>(entry.elements), fp);
+                position = entry.offset + entry.elements * sizeof(float);
             }
-            load_data_impl()
-            {
-                using layer = get_layer<l>;
-
-                if (layer::type == MTNN_LAYER_BATCHNORMALIZATION)
-                {
-                    using t = decltype(layer::activations_population_mean);
-                    for (size_t d = 0; d < t::size(); ++d)
-                    {
-                        for (size_t i = 0; i < t::rows(); ++i)
-                        {
-                            for (size_t j = 0; j < t::cols(); ++j)
-                            {
-                                read_float(layer::activations_population_mean[d].at(i, j), fp);
-                                read_float(layer::activations_population_variance[d].at(i, j), fp);
-                            }
-                        }
-                    }
-                }
+        }
+    };
 
-                //begin weights values
-                {
-                    using t = decltype(layer::weights);
-                    for (size_t d = 0; d < t::size(); ++d)
-                        for (size_t i = 0; i < t::rows(); ++i)
-                            for (size_t j = 0; j < t::cols(); ++j)
-                                read_float(layer::weights[d].at(i, j), fp);
-                }
+    //copy a layer's blobs into a file image being staged, zeroing the padding before each (position is where the image is filled up to)
+    template<size_t l> struct model_stage_impl
+    {
+        model_stage_impl(unsigned char* image, const model_tensor_entry* index, uint64_t& position)
+        {
+            for (size_t slot = 0; slot < MTNN_MODEL_TENSORS; ++slot)
+            {
+                const model_tensor_entry& entry = index[l * MTNN_MODEL_TENSORS + slot];
+                if (entry.elements == 0)
+                    continue;
+                memset(image + position, 0, static_cast<size_t>(entry.offset - position));
+                memcpy(image + entry.offset, model_tensors<l>::data(slot), static_cast<size_t>(entry.elements) * sizeof(float));
+                position = entry.offset + entry.elements * sizeof(float);
+            }
+        }
+    };
 
-                //begin biases values
-                {
-                    using t = decltype(layer::biases);
-                    for (size_t f_0 = 0; f_0 < t::size(); ++f_0)
-                        for (size_t i_0 = 0; i_0 < t::rows(); ++i_0)
-                            for (size_t j_0 = 0; j_0 < t::cols(); ++j_0)
-                                read_float(layer::biases[f_0].at(i_0, j_0), fp);
-                }
+    //copy a layer's blobs out of a checked file image
+    template<size_t l> struct model_read_impl
+    {
+        model_read_impl(const unsigned char* image, const model_tensor_entry* index)
+        {
+            for (size_t slot = 0; slot < MTNN_MODEL_TENSORS; ++slot)
+            {
+                const model_tensor_entry& entry = index[l * MTNN_MODEL_TENSORS + slot];
+                if (entry.elements != 0)
+                    memcpy(model_tensors<l>::data(slot), image + entry.offset, static_cast<size_t>(entry.elements) * sizeof(float));
+            }
+            get_layer<l>::weights.touch();
+        }
+    };
 
-                //begin gen biases values
-                {
-                    using t = decltype(layer::generative_biases);
-                    for (size_t f = 0; f < t::size(); ++f)
-                        for (size_t i = 0; i < t::rows(); ++i)
-                            for (size_t j = 0; j < t::cols(); ++j)
-                                read_float(layer::generative_biases[f].at(i, j), fp);
-                }
+    //alias a layer's tensors onto a checked, mapped file image (image == nullptr takes them back into owned memory)
+    template<size_t l> struct model_alias_impl
+    {
+        model_alias_impl(unsigned char* image, const model_tensor_entry* index)
+        {
+            for (size_t slot = 0; slot < MTNN_MODEL_TENSORS; ++slot)
+            {
+                if (image == nullptr)
+                    model_tensors<l>::alias(slot, nullptr);
+                else if (index[l * MTNN_MODEL_TENSORS + slot].elements != 0)
+                    model_tensors<l>::alias(slot, reinterpret_cast<float*>(image + index[l * MTNN_MODEL_TENSORS + slot].offset));
             }
-        };
+        }
     };
 
     //reset a particular data type (usually only gradients)
@@ -442,8 +628,8 @@ private:
         {
             using layer = get_layer<l>;
 
-            if (use_dropout && l != 0 && layer::type != MTNN_LAYER_SOFTMAX)
-                dropout<l>();
+            if (drops_input<l>())
+                dropout<l>(training, random_stream, dropout_masks[l], get_batch_activations<l>().data(), 1);
             layer::feed_forwards(get_batch_activations<l>()[0], get_batch_activations<l + 1>()[0]);
         }
     };
@@ -453,8 +639,8 @@ private:
     {
         feed_forwards_batch_impl()
         {
-            if (use_dropout && training && l != 0 && get_layer<l>::type != MTNN_LAYER_SOFTMAX)
-                dropout<l>();//todo vec also training bool
+            if (drops_input<l>())
+                dropout<l>(training, random_stream, dropout_masks[l], get_batch_activations<l>().data(), get_batch_activations<l>().size());
             get_layer<l>::feed_forwards(get_batch_activations<l>(), get_batch_activations<l + 1>());
         }
     };
@@ -467,7 +653,7 @@ private:
             using layer = get_layer<l>;
             layer::feed_backwards(get_batch_activations<l>()[0], get_batch_activations<l + 1>()[0]);
             if (sample)
-                layer::stochastic_sample(layer::feature_maps);
+                layer::stochastic_sample(layer::feature_maps, random_stream);
         }
     };
 
@@ -479,7 +665,7 @@ private:
             using layer = get_layer<l>;
             layer::feed_backwards(get_batch_activations<l + 1>(), get_batch_activations<l>());
             if (sample)
-                layer::stochastic_sample(layer::feature_maps);//todo vec
+                layer::stochastic_sample(layer::feature_maps, random_stream);//todo vec
         }
     };
 
@@ -488,7 +674,13 @@ private:
     {
         back_prop_impl()
         {
-            get_layer<l>::back_prop(get_layer<l - 1>::activation, get_layer<l + 1>::feature_maps, get_batch_activations<l>()[0], get_layer<l>::feature_maps, !use_batch_learning && optimization_method == MTNN_OPT_BACKPROP, learning_rate, use_momentum && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+            //done with the error signals
+            if (l == last_layer_index - 1 && fused_log_likelihood())
+                return;
+            bool masked = dropped_out<l>(dropout_masks[l]);
+            get_layer<l>::back_prop(masked ? MTNN_FUNC_LINEAR : get_layer<l - 1>::activation, get_layer<l + 1>::feature_maps, get_batch_activations<l>()[0], get_layer<l>::feature_maps, !use_batch_learning && policy_optimization_method() == MTNN_OPT_BACKPROP, learning_rate, policy_use_momentum() && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+            if (masked)
+                dropout_back_prop<l>(dropout_masks[l], get_batch_activations<l>().data(), &get_layer<l>::feature_maps, 1);
         }
     };
 
@@ -497,7 +689,53 @@ private:
     {
         back_prop_batch_impl()
         {
-            get_layer<l>::back_prop(get_layer<l - 1>::activation, get_batch_out_derivs<l + 1>(), get_batch_activations<l>(), get_batch_out_derivs<l>(), !use_batch_learning && optimization_method == MTNN_OPT_BACKPROP, learning_rate, use_momentum && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+            //done with the error signals
+            if (l == last_layer_index - 1 && fused_log_likelihood())
+                return;
+            bool masked = dropped_out<l>(dropout_masks[l]);
+            get_layer<l>::back_prop(masked ? MTNN_FUNC_LINEAR : get_layer<l - 1>::activation, get_batch_out_derivs<l + 1>(), get_batch_activations<l>(), get_batch_out_derivs<l>(), !use_batch_learning && policy_optimization_method() == MTNN_OPT_BACKPROP, learning_rate, policy_use_momentum() && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+            if (masked)
+                dropout_back_prop<l>(dropout_masks[l], get_batch_activations<l>().data(), get_batch_out_derivs<l>().data(), get_batch_out_derivs<l>().size());
+        }
+    };
+
+    //feed forwards a batch layer with population statistics (batch norm layers use theirs, not the batch's)
+    template<size_t l> struct feed_forwards_population_impl
+    {
+        feed_forwards_population_impl()
+        {
+            using layer = get_layer<l>;
+
+            auto& inputs = get_batch_activations<l>();
+            auto& outputs = get_batch_activations<l + 1>();
+            if (layer::type == MTNN_LAYER_BATCHNORMALIZATION)
+            {
+                for (size_t in = 0; in < inputs.size(); ++in)
+                    layer::feed_forwards(inputs[in], outputs[in]);
+            }
+
+            else
+                layer::feed_forwards(inputs, outputs);
+        }
+    };
+
+    //the softmax before the output layer under loglikelihood: the loss and its input derivatives (p * sum(y) - y) in one pass, instead of error
+    //signals and the output layer's and softmax's backprop
+    template<size_t l> struct log_likelihood_impl
+    {
+        template<typename maps_type, typename in_maps_type> static float back_prop(maps_type& probabilities, maps_type& lbls, in_maps_type& activations_pre, in_maps_type& out_deriv)
+        {
+            return back_prop(probabilities, lbls, activations_pre, out_deriv, std::integral_constant<bool, get_layer<l>::type == MTNN_LAYER_SOFTMAX>{});
+        }
+
+        template<typename maps_type, typename in_maps_type> static float back_prop(maps_type& probabilities, maps_type& lbls, in_maps_type& activations_pre, in_maps_type& out_deriv, std::true_type)
+        {
+            return get_layer<l>::back_prop_log_likelihood(get_layer<l - 1>::activation, probabilities, lbls, activations_pre, out_deriv);
+        }
+
+        template<typename maps_type, typename in_maps_type> static float back_prop(maps_type&, maps_type&, in_maps_type&, in_maps_type&, std::false_type)
+        {
+            return 0.0f;
         }
     };
 
@@ -509,40 +747,157 @@ private:
             using layer = get_layer<l>;
 
             //calculate statistics for batch normalization layer
-            auto& inputs = get_batch_activations<l>();
-            auto& outputs = get_batch_activations<l + 1>();
             if (layer::type == MTNN_LAYER_BATCHNORMALIZATION)
             {
-                using t = decltype(layer::feature_maps);
-                for (size_t f = 0; f < t::size(); ++f)
+                moment_accumulator stats;
+                stats.reset(layer::feature_maps_type::elements());
+                stats.add(get_batch_activations<l>());
+                stats.finish(layer::activations_population_mean.data(), layer::activations_population_variance.data());
+            }
+
+            //can't feed forward batch because batch norm will use sample statistics
+            feed_forwards_population_impl<l>();
+        }
+    };
+
+    //one pass over a chunked training set for the population statistics of one batch norm layer, the layers below already have theirs
+    template<typename chunk_func> struct population_pass
+    {
+        template<size_t l> struct impl
+        {
+            impl(size_t chunks, const chunk_func& get_chunk)
+            {
+                using layer = get_layer<l>;
+                if (layer::type != MTNN_LAYER_BATCHNORMALIZATION)
+                    return;
+
+                moment_accumulator stats;
+                stats.reset(layer::feature_maps_type::elements());
+                for (size_t c = 0; c < chunks; ++c)
                 {
-                    for (size_t i = 0; i < t::rows(); ++i)
-                    {
-                        for (size_t j = 0; j < t::cols(); ++j)
-                        {
-                            float sumx = 0.0f;
-                            float sumxsqr = 0.0f;
-                            size_t n_in = outputs.size();
-                            //compute statistics
-                            for (size_t in = 0; in < n_in; ++in)
-                            {
-                                float x = inputs[in][f].at(i, j);
-                                sumx += x;
-                                sumxsqr += x * x;
-                            }
+                    auto& chunk = get_chunk(c);
+#ifndef _MSC_VER
+                    loop_all_layers<resize_batch_vectors, size_t>(chunk.size());
+#else
+                    loop_all_layers<resize_batch_vectors, size_t>(chunk.size(), 0);
+#endif
+                    for (size_t in = 0; in < chunk.size(); ++in)
+                        std::copy(chunk[in].data(), chunk[in].data() + chunk[in].elements(), get_batch_activations<0>()[in].data());
+#ifndef _MSC_VER
+                    for_loop<0, l - 1, 1, feed_forwards_population_impl>();
+#else
+                    for_loop<0, l - 1, 1, feed_forwards_population_impl>(0);
+#endif
+                    stats.add(get_batch_activations<l>());
+                }
+                stats.finish(layer::activations_population_mean.data(), layer::activations_population_variance.data());
+            }
+        };
+    };
 
-                            //store stats
-                            float mean = sumx / n_in;
-                            layer::activations_population_mean[f].at(i, j) = mean;
-                            layer::activations_population_variance[f].at(i, j) = sumxsqr / n_in - mean * mean;
-                        }
-                    }
+    //fold a batch norm layer's population statistics, gamma and beta into the linear convolution or fully connected layer feeding it
+    template<size_t l> struct fold_batch_norm_impl
+    {
+        fold_batch_norm_impl()
+        {
+            fold(std::integral_constant<bool, get_layer<l>::type == MTNN_LAYER_BATCHNORMALIZATION>{});
+        }
+
+        static void fold(std::false_type)
+        {
+        }
+
+        static void fold(std::true_type)
+        {
+            using layer = get_layer<l>;
+            using prev = get_layer<l - 1>;
+            if (layer::folded || (prev::type != MTNN_LAYER_CONVOLUTION && prev::type != MTNN_LAYER_PERCEPTRONFULLCONNECTIVITY)
+                || prev::activation != MTNN_FUNC_LINEAR || prev::biases_type::elements() == 0)
+                return;
+
+            //batch norm is x * scale + shift per element
+            constexpr size_t elements = layer::feature_maps_type::elements();
+            std::vector<float> scale(elements);
+            std::vector<float> shift(elements);
+            for (size_t e = 0; e < elements; ++e)
+            {
+                scale[e] = layer::weights.data()[e] / sqrt(layer::activations_population_variance.data()[e] + layer::min_divisor);
+                shift[e] = layer::biases.data()[e] - layer::activations_population_mean.data()[e] * scale[e];
+            }
+
+            //fully connected layers have a row of weights and a bias per output, convolutions share a kernel (and biases) over a whole map,
+            //so they only take a scale and shift that are the same all over the map
+            size_t units = prev::type == MTNN_LAYER_PERCEPTRONFULLCONNECTIVITY ? elements : layer::feature_maps_type::size();
+            size_t positions = elements / units;
+            for (size_t u = 0; u < units; ++u)
+            {
+                for (size_t p = 1; p < positions; ++p)
+                {
+                    size_t e = u * positions;
+                    if (std::abs(scale[e + p] - scale[e]) > 1e-5f * std::abs(scale[e]) || std::abs(shift[e + p] - shift[e]) > 1e-5f * (std::abs(shift[e]) + 1e-3f))
+                        return;
                 }
             }
 
-            //can't feed forward batch because batch norm will use sample statistics
-            for (size_t in = 0; in < inputs.size(); ++in)
-                layer::feed_forwards(inputs[in], outputs[in]);
+            size_t w_block = prev::weights_type::elements() / units;
+            size_t b_block = prev::biases_type::elements() / units;
+            float* w = prev::weights.data();
+            float* b = prev::biases.data();
+            for (size_t u = 0; u < units; ++u)
+            {
+                float s = scale[u * positions];
+                for (size_t k = 0; k < w_block; ++k)
+                    w[u * w_block + k] *= s;
+
+                //a convolution's biases all land on the same map
+                float bias = 0.0f;
+                for (size_t k = 0; k < b_block; ++k)
+                {
+                    bias += b[u * b_block + k];
+                    b[u * b_block + k] = 0.0f;
+                }
+                b[u * b_block] = bias * s + shift[u * positions];
+            }
+            prev::weights.touch();
+            prev::biases.touch();
+
+            //identity parameters as well, so a saved folded net is still right without the flag
+            std::fill(layer::activations_population_mean.data(), layer::activations_population_mean.data() + elements, 0.0f);
+            std::fill(layer::activations_population_variance.data(), layer::activations_population_variance.data() + elements, 1.0f - layer::min_divisor);
+            std::fill(layer::weights.data(), layer::weights.data() + elements, 1.0f);
+            std::fill(layer::biases.data(), layer::biases.data() + elements, 0.0f);
+            layer::weights.touch();
+            layer::biases.touch();
+            layer::folded = true;
+        }
+    };
+
+    //give an instance the master's parameters of a folded batch norm layer and of the layer it was folded into
+    template<size_t l> struct refresh_folded_thread_impl
+    {
+        refresh_folded_thread_impl(BasicNeuralNet<policy, layers...>& net)
+        {
+            refresh(net, std::integral_constant<bool, get_layer<l>::type == MTNN_LAYER_BATCHNORMALIZATION>{});
+        }
+
+        static void refresh(BasicNeuralNet<policy, layers...>&, std::false_type)
+        {
+        }
+
+        static void refresh(BasicNeuralNet<policy, layers...>& net, std::true_type)
+        {
+            if (!get_layer<l>::folded)
+                return;
+            copy(get_layer<l>::weights, net.get_aux_weights<l>());
+            copy(get_layer<l>::biases, net.get_aux_biases<l>());
+            copy(get_layer<l - 1>::weights, net.get_aux_weights<l - 1>());
+            copy(get_layer<l - 1>::biases, net.get_aux_biases<l - 1>());
+        }
+
+        template<typename maps_type> static void copy(maps_type& src, maps_type& dst)
+        {
+            std::copy(src.data(), src.data() + maps_type::elements(), dst.data());
+            dst.touch();
         }
     };
 
@@ -571,150 +926,32 @@ private:
         }
     };
 
-    //apply the gradient, and reset the gradient if specified
-    template<size_t l, bool erase> struct apply_grad_impl
+    //apply the gradient with optimizer, and reset the gradient if specified
+    template<size_t l, bool erase, typename optimizer> struct apply_grad_impl
     {
-        apply_grad_impl()
-        {
-            using layer = get_layer<l>;
-            using weights_t = decltype(layer::weights);
-            using biases_t = decltype(layer::biases);
+        using layer = get_type<l, layers...>;
 
-            if (optimization_method == MTNN_OPT_ADAM && layer::type != MTNN_LAYER_BATCHNORMALIZATION)
-            {
-                //update weights
-                for (size_t d = 0; d < weights_t::size(); ++d)
-                {
-                    for (size_t i = 0; i < weights_t::rows(); ++i)
-                    {
-                        for (size_t j = 0; j < weights_t::cols(); ++j)
-                        {
-                            float g = layer::weights_gradient[d].at(i, j);
-                            layer::weights_momentum[d].at(i, j) = beta1 * layer::weights_momentum[d].at(i, j) + (1.0f - beta1) * g;
-                            layer::weights_aux_data[d].at(i, j) = beta2 * layer::weights_aux_data[d].at(i, j) + (1.0f - beta2) * g * g;
-                            layer::weights[d].at(i, j) += -learning_rate * (float)sqrt(1.0f - pow(beta2, t_adam)) / (1.0f - (float)pow(beta1, t_adam)) * layer::weights_momentum[d].at(i, j) / ((float)sqrt(layer::weights_aux_data[d].at(i, j)) + 1e-7f);
-                            if (erase)
-                                layer::weights_gradient[d].at(i, j) = 0;
-                        }
-                    }
-                }
-
-                //update biases
-                for (size_t f_0 = 0; f_0 < biases_t::size(); ++f_0)
-                {
-                    for (size_t i_0 = 0; i_0 < biases_t::rows(); ++i_0)
-                    {
-                        for (size_t j_0 = 0; j_0 < biases_t::cols(); ++j_0)
-                        {
-                            float g = layer::biases_gradient[f_0].at(i_0, j_0);
-                            layer::biases_momentum[f_0].at(i_0, j_0) = beta1 * layer::biases_momentum[f_0].at(i_0, j_0) + (1 - beta1) * g;
-                            layer::biases_aux_data[f_0].at(i_0, j_0) = beta2 * layer::biases_aux_data[f_0].at(i_0, j_0) + (1 - beta2) * g * g;
-                            layer::biases[f_0].at(i_0, j_0) += -learning_rate * (float)sqrt(1 - pow(beta2, t_adam)) / (float)(1 - pow(beta1, t_adam)) * layer::biases_momentum[f_0].at(i_0, j_0) / (float)(sqrt(layer::biases_aux_data[f_0].at(i_0, j_0)) + 1e-7f);
-                            if (erase)
-                                layer::biases_gradient[f_0].at(i_0, j_0) = 0;
-                        }
-                    }
-                }
-            }
-
-            else if (optimization_method == MTNN_OPT_ADAGRAD && layer::type != MTNN_LAYER_BATCHNORMALIZATION)
-            {
-                //update weights
-                for (size_t d = 0; d < weights_t::size(); ++d)
-                {
-                    for (size_t i = 0; i < weights_t::rows(); ++i)
-                    {
-                        for (size_t j = 0; j < weights_t::cols(); ++j)
-                        {
-                            float g = layer::weights_gradient[d].at(i, j);
-                            layer::weights[d].at(i, j) += -learning_rate / sqrt(layer::weights_aux_data[d].at(i, j) + minimum_divisor) * g;
-                            layer::weights_aux_data[d].at(i, j) += g * g;
-                            if (erase)
-                                layer::weights_gradient[d].at(i, j) = 0;
-                        }
-                    }
-                }
-
-                //update biases
-                for (size_t f_0 = 0; f_0 < biases_t::size(); ++f_0)
-                {
-                    for (size_t i_0 = 0; i_0 < biases_t::rows(); ++i_0)
-                    {
-                        for (size_t j_0 = 0; j_0 < biases_t::cols(); ++j_0)
-                        {
-                            float g = layer::biases_gradient[f_0].at(i_0, j_0);
-                            layer::biases[f_0].at(i_0, j_0) += -learning_rate / sqrt(layer::biases_aux_data[f_0].at(i_0, j_0) + minimum_divisor) * g;
-                            layer::biases_aux_data[f_0].at(i_0, j_0) += g * g;
-                            if (erase)
-                                layer::biases_gradient[f_0].at(i_0, j_0) = 0;
-                        }
-                    }
-                }
-            }
-
-            else if (use_momentum)
+        apply_grad_impl(const optimizer_step& step)
+        {
+            //batch norm's gamma and beta don't take the adaptive methods
+            if (layer::type == MTNN_LAYER_BATCHNORMALIZATION && optimizer::adaptive)
             {
-                //update weights
-                for (size_t d = 0; d < weights_t::size(); ++d)
-                {
-                    for (size_t i = 0; i < weights_t::rows(); ++i)
-                    {
-                        for (size_t j = 0; j < weights_t::cols(); ++j)
-                        {
-                            layer::weights[d].at(i, j) += -learning_rate * layer::weights_gradient[d].at(i, j) + momentum_term * layer::weights_momentum[d].at(i, j);
-                            layer::weights_momentum[d].at(i, j) = momentum_term * layer::weights_momentum[d].at(i, j) + -learning_rate * layer::weights_gradient[d].at(i, j);
-                            if (erase)
-                                layer::weights_gradient[d].at(i, j) = 0;
-                        }
-                    }
-                }
-
-                //update biases
-                for (size_t f_0 = 0; f_0 < biases_t::size(); ++f_0)
-                {
-                    for (size_t i_0 = 0; i_0 < biases_t::rows(); ++i_0)
-                    {
-                        for (size_t j_0 = 0; j_0 < biases_t::cols(); ++j_0)
-                        {
-                            layer::biases[f_0].at(i_0, j_0) += -learning_rate * layer::biases_gradient[f_0].at(i_0, j_0) + momentum_term * layer::biases_momentum[f_0].at(i_0, j_0);
-                            layer::biases_momentum[f_0].at(i_0, j_0) = momentum_term * layer::biases_momentum[f_0].at(i_0, j_0) + -learning_rate * layer::biases_gradient[f_0].at(i_0, j_0);
-                            if (erase)
-                                layer::biases_gradient[f_0].at(i_0, j_0) = 0;
-                        }
-                    }
-                }
+                if (policy_use_momentum())
+                    update<optimizer_momentum>(step);
+                else
+                    update<optimizer_sgd>(step);
             }
-
             else
-            {
-                //update weights
-                for (size_t d = 0; d < weights_t::size(); ++d)
-                {
-                    for (size_t i = 0; i < weights_t::rows(); ++i)
-                    {
-                        for (size_t j = 0; j < weights_t::cols(); ++j)
-                        {
-                            layer::weights[d].at(i, j) += -learning_rate * layer::weights_gradient[d].at(i, j);
-                            if (erase)
-                                layer::weights_gradient[d].at(i, j) = 0;
-                        }
-                    }
-                }
+                update<optimizer>(step);
 
-                //update biases
-                for (size_t f_0 = 0; f_0 < biases_t::size(); ++f_0)
-                {
-                    for (size_t i_0 = 0; i_0 < biases_t::rows(); ++i_0)
-                    {
-                        for (size_t j_0 = 0; j_0 < biases_t::cols(); ++j_0)
-                        {
-                            layer::biases[f_0].at(i_0, j_0) += -learning_rate * layer::biases_gradient[f_0].at(i_0, j_0);
-                            if (erase)
-                                layer::biases_gradient[f_0].at(i_0, j_0) = 0;
-                        }
-                    }
-                }
-            }
+            //anything caching derived weights has to refresh
+            layer::weights.touch();
+        }
+
+        template<typename method> static void update(const optimizer_step& step)
+        {
+            optimizer_apply<method, erase>(layer::weights.data(), layer::weights_gradient.data(), layer::weights_momentum.data(), layer::weights_aux_data.data(), layer::weights.elements(), step);
+            optimizer_apply<method, erase>(layer::biases.data(), layer::biases_gradient.data(), layer::biases_momentum.data(), layer::biases_aux_data.data(), layer::biases.elements(), step);
         }
     };
 
@@ -742,12 +979,24 @@ private:
         }
     };
 
+    //size batch_activations and batch_out_derivs to n in one go, only allocates if n changed
+    template<size_t l> struct resize_batch_vectors_impl
+    {
+        resize_batch_vectors_impl(size_t n)
+        {
+            if (get_batch_activations<l>().size() != n)
+                get_batch_activations<l>().resize(n);
+            if (get_batch_out_derivs<l>().size() != n)
+                get_batch_out_derivs<l>().resize(n);
+        }
+    };
+
     ////Nonstatic thread versions
 
-    //reset target data within an instance of a NeuralNet
+    //reset target data within an instance of a net
     template<size_t l, size_t target> struct reset_thread_impl
     {
-        reset_thread_impl(NeuralNet<layers...>& net)
+        reset_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
             using layer = get_layer<l>;
             if (target == MTNN_DATA_FEATURE_MAP)
@@ -791,12 +1040,12 @@ private:
     //feed forwards using an instance's parameters/activations NOT BATCH
     template<size_t l, bool training> struct feed_forwards_thread_impl
     {
-        feed_forwards_thread_impl(NeuralNet<layers...>& net)
+        feed_forwards_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
             using layer = get_layer<l>;
 
-            if (use_dropout && l != 0 && layer::type != MTNN_LAYER_SOFTMAX)
-                dropout<l>();
+            if (drops_input<l>())
+                dropout<l>(training, net.thread_random_stream, net.thread_dropout_masks[l], net.get_thread_batch_activations<l>().data(), 1);
             layer::feed_forwards(net.get_thread_batch_activations<l>()[0], net.get_thread_batch_activations<l + 1>()[0], net.get_aux_weights<l>(), net.get_aux_biases<l>());
         }
     };
@@ -804,10 +1053,10 @@ private:
     //feed forwards using an instance's parameters/activations BATCH
     template<size_t l, bool training> struct feed_forwards_batch_thread_impl
     {
-        feed_forwards_batch_thread_impl(NeuralNet<layers...>& net)
+        feed_forwards_batch_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
-            if (use_dropout && training &&l != 0 && get_layer<l>::type != MTNN_LAYER_SOFTMAX)
-                dropout<l>();//todo vec also training bool
+            if (drops_input<l>())
+                dropout<l>(training, net.thread_random_stream, net.thread_dropout_masks[l], net.get_thread_batch_activations<l>().data(), net.get_thread_batch_activations<l>().size());
             get_layer<l>::feed_forwards(net.get_thread_batch_activations<l>(), net.get_thread_batch_activations<l + 1>(), net.get_aux_weights<l>(), net.get_aux_biases<l>());
         }
     };
@@ -815,49 +1064,61 @@ private:
     //feed backwards using an instance's parameters/activations NOT BATCH
     template<size_t l, bool sample> struct feed_backwards_thread_impl
     {
-        feed_backwards_thread_impl(NeuralNet<layers...>& net)
+        feed_backwards_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
             using layer = get_layer<l>;
             layer::feed_backwards(net.get_thread_batch_activations<l>()[0], net.get_thread_batch_activations<l + 1>()[0], net.get_aux_weights<l>(), net.get_aux_biases<l>()); //TODO: not generative biases
             if (sample)
-                layer::stochastic_sample(net.get_thread_batch_activations<l>()[0]);
+                layer::stochastic_sample(net.get_thread_batch_activations<l>()[0], net.thread_random_stream);
         }
     };
 
     //feed backwards using an instance's parameters/activations BATCH
     template<size_t l, bool sample> struct feed_backwards_batch_thread_impl
     {
-        feed_backwards_batch_thread_impl(NeuralNet<layers...>& net)
+        feed_backwards_batch_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
             using layer = get_layer<l>;
             layer::feed_backwards(net.get_thread_batch_activations<l + 1>(), net.get_thread_batch_activations<l>(), net.get_aux_weights<l>(), net.get_aux_biases<l>()); //TODO: not generative biases
             if (sample)
-                layer::stochastic_sample(layer::feature_maps);//todo vec
+                layer::stochastic_sample(layer::feature_maps, net.thread_random_stream);//todo vec
         }
     };
 
     //backprop using an instance's parameters/activations NOT BATCH
     template<size_t l> struct back_prop_thread_impl
     {
-        back_prop_thread_impl(NeuralNet<layers...>& net)
+        back_prop_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
-            get_layer<l>::back_prop(get_layer<l - 1>::activation, net.get_thread_batch_out_derivs<l + 1>()[0], net.get_thread_batch_activations<l>()[0], net.get_thread_batch_out_derivs<l>()[0], !use_batch_learning && optimization_method == MTNN_OPT_BACKPROP, learning_rate, use_momentum && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor, net.get_aux_weights<l>(), net.get_aux_biases<l>(), net.get_aux_weights_gradient<l>(), net.get_aux_biases_gradient<l>());
+            //done with the error signals
+            if (l == last_layer_index - 1 && fused_log_likelihood())
+                return;
+            bool masked = dropped_out<l>(net.thread_dropout_masks[l]);
+            get_layer<l>::back_prop(masked ? MTNN_FUNC_LINEAR : get_layer<l - 1>::activation, net.get_thread_batch_out_derivs<l + 1>()[0], net.get_thread_batch_activations<l>()[0], net.get_thread_batch_out_derivs<l>()[0], !use_batch_learning && policy_optimization_method() == MTNN_OPT_BACKPROP, learning_rate, policy_use_momentum() && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor, net.get_aux_weights<l>(), net.get_aux_biases<l>(), net.get_aux_weights_gradient<l>(), net.get_aux_biases_gradient<l>());
+            if (masked)
+                dropout_back_prop<l>(net.thread_dropout_masks[l], net.get_thread_batch_activations<l>().data(), net.get_thread_batch_out_derivs<l>().data(), 1);
         }
     };
 
     //backprop using an instance's parameters/activations BATCH
     template<size_t l> struct back_prop_batch_thread_impl
     {
-        back_prop_batch_thread_impl(NeuralNet<layers...>& net)
+        back_prop_batch_thread_impl(BasicNeuralNet<policy, layers...>& net)
         {
-            get_layer<l>::back_prop(get_layer<l - 1>::activation, net.get_thread_batch_out_derivs<l + 1>(), net.get_thread_batch_activations<l>(), net.get_thread_batch_out_derivs<l>(), !use_batch_learning && optimization_method == MTNN_OPT_BACKPROP, learning_rate, use_momentum && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor, net.get_aux_weights<l>(), net.get_aux_biases<l>(), net.get_aux_weights_gradient<l>(), net.get_aux_biases_gradient<l>());
+            //done with the error signals
+            if (l == last_layer_index - 1 && fused_log_likelihood())
+                return;
+            bool masked = dropped_out<l>(net.thread_dropout_masks[l]);
+            get_layer<l>::back_prop(masked ? MTNN_FUNC_LINEAR : get_layer<l - 1>::activation, net.get_thread_batch_out_derivs<l + 1>(), net.get_thread_batch_activations<l>(), net.get_thread_batch_out_derivs<l>(), !use_batch_learning && policy_optimization_method() == MTNN_OPT_BACKPROP, learning_rate, policy_use_momentum() && !use_batch_learning, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor, net.get_aux_weights<l>(), net.get_aux_biases<l>(), net.get_aux_weights_gradient<l>(), net.get_aux_biases_gradient<l>());
+            if (masked)
+                dropout_back_prop<l>(net.thread_dropout_masks[l], net.get_thread_batch_activations<l>().data(), net.get_thread_batch_out_derivs<l>().data(), net.get_thread_batch_out_derivs<l>().size());
         }
     };
 
     //change size of thread_batch_activations vector
     template<size_t l, bool add> struct modify_thread_batch_activations_vector_impl
     {
-        modify_thread_batch_activations_vector_impl(NeuralNet<layers...>& net)
+        modify_thread_batch_activations_vector_impl(BasicNeuralNet<policy, layers...>& net)
         {
             if (add)
                 net.get_thread_batch_activations<l>().push_back(typename std::remove_reference_t<decltype(net.get_thread_batch_activations<l>())>::value_type{ 0 });
@@ -869,7 +1130,7 @@ private:
     //change size of thread_batch_out_derivs vector
     template<size_t l, bool add> struct modify_thread_batch_out_derivs_vector_impl
     {
-        modify_thread_batch_out_derivs_vector_impl(NeuralNet<layers...>& net)
+        modify_thread_batch_out_derivs_vector_impl(BasicNeuralNet<policy, layers...>& net)
         {
             if (add)
                 net.get_thread_batch_out_derivs<l>().push_back(typename std::remove_reference_t<decltype(net.get_thread_batch_out_derivs<l>())>::value_type{ 0 });
@@ -878,6 +1139,75 @@ private:
         }
     };
 
+    //size thread_batch_activations and thread_batch_out_derivs to n in one go, only allocates if n changed
+    template<size_t l> struct resize_thread_batch_vectors_impl
+    {
+        resize_thread_batch_vectors_impl(BasicNeuralNet<policy, layers...>& net, size_t n)
+        {
+            if (net.get_thread_batch_activations<l>().size() != n)
+                net.get_thread_batch_activations<l>().resize(n);
+            if (net.get_thread_batch_out_derivs<l>().size() != n)
+                net.get_thread_batch_out_derivs<l>().resize(n);
+        }
+    };
+
+    //start a new sequence on a layer's state in use
+    template<size_t l> struct reset_state_impl
+    {
+        reset_state_impl()
+        {
+            get_layer<l>::reset_state();
+        }
+    };
+
+    //point a layer's calls on this thread at one of an instance's sequence states, or back at the layer's own if net is nullptr
+    template<size_t l> struct bind_thread_state_impl
+    {
+        bind_thread_state_impl(BasicNeuralNet<policy, layers...>* net, size_t sequence)
+        {
+            get_layer<l>::bind_state(net != nullptr ? &net->get_thread_states<l>()[sequence] : nullptr);
+        }
+    };
+
+    //size an instance's sequence states to n, only allocates if n changed. Kept sequences keep their state, new ones start empty
+    template<size_t l> struct resize_thread_states_impl
+    {
+        resize_thread_states_impl(BasicNeuralNet<policy, layers...>& net, size_t n)
+        {
+            if (net.get_thread_states<l>().size() != n)
+                net.get_thread_states<l>().resize(n);
+        }
+    };
+
+    //start every sequence of an instance over
+    template<size_t l> struct reset_thread_states_impl
+    {
+        reset_thread_states_impl(BasicNeuralNet<policy, layers...>& net)
+        {
+            for (size_t s = 0; s < net.get_thread_states<l>().size(); ++s)
+                net.get_thread_states<l>()[s].reset();
+        }
+    };
+
+    //feed forwards one step of several sequences using an instance's parameters/states: recurrent layers step each sequence on its own state, the rest run as a batch
+    template<size_t l> struct feed_forwards_lockstep_thread_impl
+    {
+        feed_forwards_lockstep_thread_impl(BasicNeuralNet<policy, layers...>& net)
+        {
+            feed_forwards(net, std::integral_constant<bool, get_layer<l>::type == MTNN_LAYER_LSTM>{});
+        }
+
+        static void feed_forwards(BasicNeuralNet<policy, layers...>& net, std::true_type)
+        {
+            get_layer<l>::feed_forwards_lockstep(net.get_thread_states<l>().data(), net.get_thread_batch_activations<l>(), net.get_thread_batch_activations<l + 1>(), net.get_aux_weights<l>(), net.get_aux_biases<l>());
+        }
+
+        static void feed_forwards(BasicNeuralNet<policy, layers...>& net, std::false_type)
+        {
+            get_layer<l>::feed_forwards(net.get_thread_batch_activations<l>(), net.get_thread_batch_activations<l + 1>(), net.get_aux_weights<l>(), net.get_aux_biases<l>());
+        }
+    };
+
 public:
 
     ////Architecture constexprs
@@ -888,8 +1218,7 @@ public:
 
     ////Loop bodies
 
-    template<typename file> using save_net_data = save_data_t<file>;
-    template<typename file> using load_net_data = load_data_t<file>;
+    template<size_t l> using signature_layer = signature_impl<l>;
 
     template<size_t l> using reset_layer_feature_maps = reset_impl<l, MTNN_DATA_FEATURE_MAP>;
     template<size_t l> using reset_layer_weights_gradient = reset_impl<l, MTNN_DATA_WEIGHT_GRAD>;
@@ -913,6 +1242,8 @@ public:
 
     template<size_t l> using feed_forwards_population_statistics_layer = feed_forwards_pop_stats_impl<l>;
 
+    template<size_t l> using fold_batch_norm_layer = fold_batch_norm_impl<l>;
+
     template<size_t l> using feed_backwards_layer_nosample = feed_backwards_impl<l, false>;
     template<size_t l> using feed_backwards_layer_sample = feed_backwards_impl<l, true>;
 
@@ -925,8 +1256,11 @@ public:
 
     template<size_t l> using add_weight_decay_layer = add_weight_decay_impl<l>;
 
-    template<size_t l> using apply_gradient_layer = apply_grad_impl<l, true>;
-    template<size_t l> using apply_gradient_noclear_layer = apply_grad_impl<l, false>;
+    template<typename optimizer> struct apply_gradient_using
+    {
+        template<size_t l> using layer = apply_grad_impl<l, true, optimizer>;
+        template<size_t l> using noclear_layer = apply_grad_impl<l, false, optimizer>;
+    };
 
     template<size_t l> using add_batch_activations = modify_batch_activations_vector_impl<l, true>;
     template<size_t l> using remove_batch_activations = modify_batch_activations_vector_impl<l, false>;
@@ -934,6 +1268,10 @@ public:
     template<size_t l> using add_batch_out_derivs = modify_batch_out_derivs_vector_impl<l, true>;
     template<size_t l> using remove_batch_out_derivs = modify_batch_out_derivs_vector_impl<l, false>;
 
+    template<size_t l> using resize_batch_vectors = resize_batch_vectors_impl<l>;
+
+    template<size_t l> using reset_layer_state = reset_state_impl<l>;
+
     //nonstatic versions
 
     template<size_t l> using reset_thread_feature_maps = reset_thread_impl<l, MTNN_DATA_FEATURE_MAP>;
@@ -962,6 +1300,16 @@ public:
     template<size_t l> using add_thread_batch_out_derivs = modify_thread_batch_out_derivs_vector_impl<l, true>;
     template<size_t l> using remove_thread_batch_out_derivs = modify_thread_batch_out_derivs_vector_impl<l, false>;
 
+    template<size_t l> using resize_thread_batch_vectors = resize_thread_batch_vectors_impl<l>;
+
+    template<size_t l> using bind_thread_state = bind_thread_state_impl<l>;
+    template<size_t l> using resize_thread_states = resize_thread_states_impl<l>;
+    template<size_t l> using reset_thread_states = reset_thread_states_impl<l>;
+
+    template<size_t l> using feed_forwards_lockstep_thread = feed_forwards_lockstep_thread_impl<l>;
+
+    template<size_t l> using refresh_folded_thread_layer = refresh_folded_thread_impl<l>;
+
     //incremental loop
     template<template<size_t> class loop_body, typename... Args> using loop_up_layers = for_loop<0, last_layer_index - 1, 1, loop_body, Args...>;
     //decremental loop
@@ -1012,9 +1360,15 @@ public:
     {
         return std::get<l, typename layers::feature_maps_vector_type...>(thread_batch_out_derivs);
     }
+    //fetch a layer's recurrent state of every sequence of an instance (empty structs for layers without state)
+    template<size_t l> std::vector<typename get_layer<l>::state_type>& get_thread_states()
+    {
+        return std::get<l, std::vector<typename layers::state_type>...>(thread_states);
+    }
 
     ////Hyperparameters
 
+    //runtime flags, only read where the policy doesn't fix them (see NeuralNet's Opt, Loss, Momentum and Dropout)
     static size_t loss_function;
     static size_t optimization_method;
     static bool use_dropout;
@@ -1039,6 +1393,27 @@ public:
     //must be set if using L2 weight decay
     static float weight_decay_factor;
 
+    //the flags in effect: the policy's value when it fixes one (a constant the compiler folds into the loops), else the runtime flag
+    static size_t policy_optimization_method()
+    {
+        return policy::optimization_method != MTNN_POLICY_RUNTIME ? policy::optimization_method : optimization_method;
+    }
+
+    static size_t policy_loss_function()
+    {
+        return policy::loss_function != MTNN_POLICY_RUNTIME ? policy::loss_function : loss_function;
+    }
+
+    static bool policy_use_momentum()
+    {
+        return policy::use_momentum != MTNN_POLICY_RUNTIME ? policy::use_momentum != 0 : use_momentum;
+    }
+
+    static bool policy_use_dropout()
+    {
+        return policy::use_dropout != MTNN_POLICY_RUNTIME ? policy::use_dropout != 0 : use_dropout;
+    }
+
     static typename get_type<0, layers...>::feature_maps_type input;
     static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type labels;
 
@@ -1053,6 +1428,27 @@ public:
     //only for batches and batch norm
     static std::tuple<typename layers::feature_maps_vector_type...> batch_out_derivs;
 
+    //deriv of the loss wrt the output, reused every step
+    static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type output_error_signals;
+
+    //deriv of the loss wrt the output for a batch, reused every step
+    static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type batch_error_signals;
+
+    //dropout masks and rbm sampling of the static net, stream 0 of the seed
+    static philox_stream random_stream;
+
+    //the static net's dropout of every layer's input in the last training feed forwards
+    static std::array<dropout_mask, sizeof...(layers)> dropout_masks;
+
+    //last seed(), instances made after it get stream (seed, instance number)
+    static uint64_t random_stream_seed;
+
+    //instances made so far
+    static std::atomic<uint64_t> instance_count;
+
+    //bumped by every fold_batch_normalization, instances compare it to the one their parameters are from
+    static size_t fold_generation;
+
     //NONSTATIC MEMBERS: Used for parallel
 
     //need for parallel
@@ -1073,13 +1469,48 @@ public:
     //need for parallel batches, can't use feature maps at all
     std::tuple<typename layers::feature_maps_vector_type...> thread_batch_out_derivs;
 
+    //deriv of the loss wrt the output for a given thread
+    typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type thread_output_error_signals;
+
+    //deriv of the loss wrt the output for a batch for a given thread
+    typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type thread_batch_error_signals;
+
+    //recurrent state of every layer, one per sequence (the single sequence functions use the first)
+    std::tuple<std::vector<typename layers::state_type>...> thread_states;
+
+    //dropout masks and rbm sampling of this instance
+    philox_stream thread_random_stream;
+
+    //this instance's dropout of every layer's input in the last training feed forwards
+    std::array<dropout_mask, sizeof...(layers)> thread_dropout_masks;
+
+    //fold_generation of this instance's parameters
+    size_t thread_fold_generation;
+
     ////Static Functions: General use and non parallel use
 
-    //save learned net
-    template<typename file_name_type> static void save_data();
+    //save learned net, false if the file couldn't be written
+    template<typename file_name_type> static bool save_data();
+
+    //load previously learned net, false (and nothing changed) if the file is missing, damaged or from another architecture
+    template<typename file_name_type> static bool load_data();
+
+    //map a saved net and use its pages as the parameters without copying (written pages become private to the process).
+    //verify_data also checks the data checksum, which reads the whole file. False (and nothing changed) like load_data
+    template<typename file_name_type> static bool load_mmap(bool verify_data = false);
+
+    //snapshot the parameters and write them on a background thread, training can go on right away. Waits for the
+    //previous async save first, the staging buffer is reused
+    template<typename file_name_type> static void save_data_async();
+
+    //wait for the last save_data_async, false if it failed
+    static bool wait_for_save();
+
+    //copy mapped parameters into owned memory and release the mapping (no-op if nothing is mapped)
+    static void unmap_data();
 
-    //load previously learned net
-    template<typename file_name_type> static void load_data();
+    //hash of every layer's kind and shapes, stored in model files to reject other architectures
+    static uint64_t signature();
 
     //set input (for discrimination)
     static void set_input(typename get_type<0, layers...>::feature_maps_type& new_input);
@@ -1092,6 +1523,19 @@ public:
 
     static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& discriminate(typename get_type<0, layers...>::feature_maps_vector_type& batch_input);
 
+    //streaming: feed the next time step of a sequence forwards, recurrent layers go on from their state. Skips discriminate's resets
+    static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& step(typename get_type<0, layers...>::feature_maps_type& new_input);
+
+    //streaming: feed the next chunk of time steps forwards at once (in order), the other layers run batched across time. Returns every step's output
+    static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& step(typename get_type<0, layers...>::feature_maps_vector_type& chunk);
+
+    //start a new sequence: clear every recurrent layer's state
+    static void reset_state();
+
+    //restart the static net's random stream (dropout, rbm sampling) from seed. Instances made afterwards get their own streams of it,
+    //set them with seed_thread (eg seed, worker index + 1) so a parallel run doesn't depend on construction order
+    static void seed(uint64_t seed);
+
     //feed backwards, returns a copy of the first layer (must be deallocated)
     static typename get_type<0, layers...>::feature_maps_type generate(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& input, size_t iterations, bool use_sampling);
 
@@ -1099,7 +1543,7 @@ public:
     static void pretrain(size_t markov_iterations);
 
     //backpropogate with selected method, returns error by loss function
-    static float train(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = NeuralNet<layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = labels);
+    static float train(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = BasicNeuralNet<policy, layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = labels);
 
     //backprop for a batch with selected method, returns mean error by loss function
     static float train_batch(typename get_type<0, layers...>::feature_maps_vector_type& batch_input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels, bool already_fed = false, bool apply = false);
@@ -1107,6 +1551,14 @@ public:
     //compute the population statistics for BN networks
     static void calculate_population_statistics(typename get_type<0, layers...>::feature_maps_vector_type& batch_input);
 
+    //compute the population statistics for BN networks from a training set in chunks, get_chunk(c) returns chunk c's inputs (a feature_maps_vector_type&).
+    //Only one chunk has to be resident at a time, the chunks are visited once per batch norm layer
+    template<typename chunk_func> static void calculate_population_statistics(size_t chunks, const chunk_func& get_chunk);
+
+    //export for inference: fold every batch norm layer into the linear convolution or fully connected layer (with biases) feeding it, which leaves
+    //the batch norm layer as an activation only pass. Others stay as they are. Returns the largest output difference to the unfolded net over check_inputs
+    static float fold_batch_normalization(typename get_type<0, layers...>::feature_maps_vector_type& check_inputs);
+
     //reset and apply gradient                                                                  
     static void apply_gradient(bool clear_gradients = true);
 
@@ -1118,21 +1570,83 @@ public:
 
 private:
 
-    //apply dropout with dropout probability on a layer (done in feed forwards)
-    template<size_t l> static void dropout();
+    //layers whose input can be dropped out: all but the input layer and softmaxes
+    template<size_t l> static constexpr bool drops_input()
+    {
+        return l != 0 && get_layer<l>::type != MTNN_LAYER_SOFTMAX;
+    }
+
+    //whether layer l's backprop has to go through its input's dropout
+    template<size_t l> static bool dropped_out(const dropout_mask& mask)
+    {
+        return drops_input<l>() && policy_use_dropout() && mask.active();
+    }
+
+    //in training with dropout draw a mask for the samples maps of layer l's input and apply it, otherwise clear the mask (done in feed forwards)
+    template<size_t l> static void dropout(bool training, philox_stream& rng, dropout_mask& mask, typename get_layer<l>::feature_maps_type* maps, size_t samples);
+
+    //after layer l's backprop without its input's activation derivative: zero the derivatives of dropped values and chain the activation
+    template<size_t l> static void dropout_back_prop(const dropout_mask& mask, typename get_layer<l>::feature_maps_type* activations, typename get_layer<l>::feature_maps_type* out_derivs, size_t samples);
+
+    //whether training goes through log_likelihood_impl: loglikelihood with a softmax right before the output layer
+    static bool fused_log_likelihood()
+    {
+        return get_layer<last_layer_index - 1>::type == MTNN_LAYER_SOFTMAX && policy_loss_function() == MTNN_LOSS_LOGLIKELIHOOD;
+    }
+
+    //fill in every header field but data_checksum and the index for this net
+    static void model_layout(model_file_header& header, model_tensor_entry* index);
+
+    //apply_gradient's layer loop for one optimizer
+    template<typename optimizer> static void apply_gradient_with(bool clear_gradients, const optimizer_step& step);
+
+    //folded batch norm layers run on the master's population statistics, so after a fold_batch_normalization an instance copies
+    //the folded layers' (and the layers they were folded into) parameters from the master before it runs again
+    void refresh_folded_thread();
+
+    //validate a model file image, returns its index or nullptr
+    static const model_tensor_entry* check_model(const unsigned char* image, size_t size, bool verify_data);
+
+    //backs the parameters after load_mmap
+    static model_mapping mapped_model;
+
+    //while alive the calling thread's recurrent layers work on one of an instance's sequence states instead of their own
+    struct state_scope
+    {
+        state_scope(BasicNeuralNet<policy, layers...>* net, size_t sequence = 0)
+        {
+#ifndef _MSC_VER
+            loop_all_layers<bind_thread_state, BasicNeuralNet<policy, layers...>*, size_t>{ net, sequence };
+#else
+            loop_all_layers<bind_thread_state, BasicNeuralNet<policy, layers...>*, size_t>{ net, sequence, 0 };
+#endif
+        }
+
+        ~state_scope()
+        {
+#ifndef _MSC_VER
+            loop_all_layers<bind_thread_state, BasicNeuralNet<policy, layers...>*, size_t>{ nullptr, 0 };
+#else
+            loop_all_layers<bind_thread_state, BasicNeuralNet<policy, layers...>*, size_t>{ nullptr, 0, 0 };
+#endif
+        }
+    };
+
+    //stages and writes save_data_async's images
+    static model_writer checkpoint_writer;
 
-    //get the deriv of the loss wrt the output
-    static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& output = get_batch_activations<last_layer_index>()[0], typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbls = labels);
+    //get the deriv of the loss wrt the output, written into out
+    static void error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& output, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbls, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& out);
 
-    //get the deriv of the loss wrt the output for a batch
-    static typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_outputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels);
+    //get the deriv of the loss wrt the output for a batch, out is only resized if the batch size changed
+    static void error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_outputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_out);
 
 public:
 
     //// NON-STATIC PARALLEL FUNCTIONS
 
     //instantiate a subnet
-    NeuralNet()
+    BasicNeuralNet()
     {
         aux_weights = std::make_tuple<typename layers::weights_type...>(typename layers::weights_type(layers::weights)...);
         aux_biases = std::make_tuple<typename layers::biases_type...>(typename layers::biases_type(layers::biases)...);
@@ -1140,10 +1654,13 @@ public:
         aux_biases_gradient = std::make_tuple<typename layers::biases_type...>(typename layers::biases_type()...);
         thread_batch_activations = std::make_tuple<typename layers::feature_maps_vector_type...>(typename layers::feature_maps_vector_type(1)...);
         thread_batch_out_derivs = std::make_tuple<typename layers::feature_maps_vector_type...>(typename layers::feature_maps_vector_type(1)...);
+        thread_states = std::make_tuple<std::vector<typename layers::state_type>...>(std::vector<typename layers::state_type>(1)...);
+        thread_random_stream.seed(random_stream_seed, ++instance_count);
+        thread_fold_generation = fold_generation;
     }
 
     //deallocates itself
-    ~NeuralNet() = default;
+    ~BasicNeuralNet() = default;
 
     //discriminate using an instances params
     typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& discriminate_thread(typename get_type<0, layers...>::feature_maps_type& new_input = input);
@@ -1151,6 +1668,22 @@ public:
     //discriminate using an instances params batch
     typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& discriminate_thread(typename get_type<0, layers...>::feature_maps_vector_type& batch_input);
 
+    //one step of several independent sequences in lockstep: batch_input[s] is the next input of sequence s, returns every sequence's output.
+    //Each sequence keeps its recurrent state in this instance, changing the number of sequences keeps the first ones and starts new ones empty
+    typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& discriminate_sequences_thread(typename get_type<0, layers...>::feature_maps_vector_type& batch_input);
+
+    //start every sequence of this instance over
+    void reset_state_thread();
+
+    //use stream of seed for this instance's random draws (0 is the static net's)
+    void seed_thread(uint64_t seed, uint64_t stream);
+
+    //step using an instances params and (first sequence's) state
+    typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& step_thread(typename get_type<0, layers...>::feature_maps_type& new_input);
+
+    //step a chunk using an instances params and (first sequence's) state
+    typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& step_thread(typename get_type<0, layers...>::feature_maps_vector_type& chunk);
+
     //feed backwards, returns a copy of the first layer (must be deallocated)
     typename get_type<0, layers...>::feature_maps_type generate_thread(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& input, size_t iterations, bool use_sampling); //todo: add par
 
@@ -1158,7 +1691,7 @@ public:
     void pretrain_thread(size_t markov_iterations); //todo: add par
 
     //backpropogate with selected method, returns error by loss function
-    float train_thread(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = NeuralNet<layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = labels);
+    float train_thread(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = BasicNeuralNet<policy, layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = labels);
 
     //backprop for a batch with selected method, returns mean error by loss function
     float train_batch_thread(typename get_type<0, layers...>::feature_maps_vector_type& batch_input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels, bool already_fed = false);
@@ -1167,48 +1700,270 @@ public:
 
 //Hyperparameter declarations
 
-template<typename... layers> size_t NeuralNet<layers...>::loss_function = MTNN_LOSS_L2;
-template<typename... layers> size_t NeuralNet<layers...>::optimization_method = MTNN_OPT_BACKPROP;
-template<typename... layers> bool NeuralNet<layers...>::use_dropout = false;
-template<typename... layers> bool NeuralNet<layers...>::use_batch_learning = false;
-template<typename... layers> bool NeuralNet<layers...>::use_momentum = false;
-template<typename... layers> bool NeuralNet<layers...>::use_l2_weight_decay = false;
-template<typename... layers> bool NeuralNet<layers...>::include_bias_decay = false;
-template<typename... layers> float NeuralNet<layers...>::learning_rate = .001f;
-template<typename... layers> float NeuralNet<layers...>::minimum_divisor = .1f;
-template<typename... layers> float NeuralNet<layers...>::momentum_term = .8f;
-template<typename... layers> float NeuralNet<layers...>::dropout_probability = .5f;
-template<typename... layers> float NeuralNet<layers...>::beta1 = .9f;
-template<typename... layers> float NeuralNet<layers...>::beta2 = .99f;
-template<typename... layers> float NeuralNet<layers...>::weight_decay_factor = .001f;
-template<typename... layers> size_t NeuralNet<layers...>::t_adam = 0;
-template<typename... layers> template<typename file_name_type> FILE* NeuralNet<layers...>::save_data_t<file_name_type>::fp = {};
-template<typename... layers> template<typename file_name_type> FILE* NeuralNet<layers...>::load_data_t<file_name_type>::fp = {};
-template<typename... layers> typename get_type<0, layers...>::feature_maps_type NeuralNet<layers...>::input = {};
-template<typename... layers> typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type NeuralNet<layers...>::labels = {};
-template<typename... layers> std::tuple<typename layers::feature_maps_vector_type...> NeuralNet<layers...>::batch_activations = {}; //init with one, will add more if necessary for batch
-template<typename... layers> std::tuple<typename layers::feature_maps_vector_type...> NeuralNet<layers...>::batch_out_derivs = {}; //init with zero, will add more if necessary for batch
+template<typename policy, typename... layers> size_t BasicNeuralNet<policy, layers...>::loss_function = MTNN_LOSS_L2;
+template<typename policy, typename... layers> size_t BasicNeuralNet<policy, layers...>::optimization_method = MTNN_OPT_BACKPROP;
+template<typename policy, typename... layers> bool BasicNeuralNet<policy, layers...>::use_dropout = false;
+template<typename policy, typename... layers> bool BasicNeuralNet<policy, layers...>::use_batch_learning = false;
+template<typename policy, typename... layers> bool BasicNeuralNet<policy, layers...>::use_momentum = false;
+template<typename policy, typename... layers> bool BasicNeuralNet<policy, layers...>::use_l2_weight_decay = false;
+template<typename policy, typename... layers> bool BasicNeuralNet<policy, layers...>::include_bias_decay = false;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::learning_rate = .001f;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::minimum_divisor = .1f;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::momentum_term = .8f;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::dropout_probability = .5f;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::beta1 = .9f;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::beta2 = .99f;
+template<typename policy, typename... layers> float BasicNeuralNet<policy, layers...>::weight_decay_factor = .001f;
+template<typename policy, typename... layers> size_t BasicNeuralNet<policy, layers...>::t_adam = 0;
+template<typename policy, typename... layers> model_mapping BasicNeuralNet<policy, layers...>::mapped_model = {};
+template<typename policy, typename... layers> philox_stream BasicNeuralNet<policy, layers...>::random_stream = {};
+template<typename policy, typename... layers> uint64_t BasicNeuralNet<policy, layers...>::random_stream_seed = 0;
+template<typename policy, typename... layers> std::array<dropout_mask, sizeof...(layers)> BasicNeuralNet<policy, layers...>::dropout_masks = {};
+template<typename policy, typename... layers> std::atomic<uint64_t> BasicNeuralNet<policy, layers...>::instance_count{ 0 };
+template<typename policy, typename... layers> size_t BasicNeuralNet<policy, layers...>::fold_generation = 0;
+template<typename policy, typename... layers> model_writer BasicNeuralNet<policy, layers...>::checkpoint_writer = {};
+template<typename policy, typename... layers> typename get_type<0, layers...>::feature_maps_type BasicNeuralNet<policy, layers...>::input = {};
+template<typename policy, typename... layers> typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type BasicNeuralNet<policy, layers...>::labels = {};
+template<typename policy, typename... layers> std::tuple<typename layers::feature_maps_vector_type...> BasicNeuralNet<policy, layers...>::batch_activations = {}; //init with one, will add more if necessary for batch
+template<typename policy, typename... layers> std::tuple<typename layers::feature_maps_vector_type...> BasicNeuralNet<policy, layers...>::batch_out_derivs = {}; //init with zero, will add more if necessary for batch
+template<typename policy, typename... layers> typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type BasicNeuralNet<policy, layers...>::output_error_signals = {};
+template<typename policy, typename... layers> typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type BasicNeuralNet<policy, layers...>::batch_error_signals = {};
 
 ////DEFINITIONS
 
-template<typename... layers>
+template<typename policy, typename... layers>
+inline uint64_t BasicNeuralNet<policy, layers...>::
+signature()
+{
+    uint64_t hash = model_hash(nullptr, 0);
+#ifndef _MSC_VER
+    loop_all_layers<signature_layer, uint64_t&>{ hash };
+#else
+    loop_all_layers<signature_layer, uint64_t&>{ hash, 0 };
+#endif
+    return hash;
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+model_layout(model_file_header& header, model_tensor_entry* index)
+{
+    //lay out the blobs
+    uint64_t offset = sizeof(model_file_header) + num_layers * MTNN_MODEL_TENSORS * sizeof(model_tensor_entry);
+#ifndef _MSC_VER
+    loop_all_layers<model_index_impl, model_tensor_entry*, uint64_t&>{ index, offset };
+#else
+    loop_all_layers<model_index_impl, model_tensor_entry*, uint64_t&>{ index, offset, 0 };
+#endif
+
+    header = {};
+    memcpy(header.magic, MTNN_MODEL_MAGIC, sizeof(header.magic));
+    header.version = MTNN_MODEL_VERSION;
+    header.byte_order = 0x01020304;
+    header.signature = signature();
+    header.layer_count = num_layers;
+    header.alignment = MTNN_ALIGNMENT;
+    header.file_size = offset;
+    header.index_checksum = model_hash(index, num_layers * MTNN_MODEL_TENSORS * sizeof(model_tensor_entry));
+}
+
+template<typename policy, typename... layers>
+inline const model_tensor_entry* BasicNeuralNet<policy, layers...>::
+check_model(const unsigned char* image, size_t size, bool verify_data)
+{
+    model_file_header expected_header;
+    model_tensor_entry expected[num_layers * MTNN_MODEL_TENSORS];
+    model_layout(expected_header, expected);
+
+    //header
+    model_file_header header;
+    if (image == nullptr || size < sizeof(header))
+        return nullptr;
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, MTNN_MODEL_MAGIC, sizeof(header.magic)) != 0 || header.version != MTNN_MODEL_VERSION || header.byte_order != 0x01020304
+        || header.signature != expected_header.signature || header.layer_count != num_layers || header.alignment != MTNN_ALIGNMENT || header.file_size != size)
+        return nullptr;
+
+    //index, also has to match this net's shapes entry by entry
+    size_t index_bytes = sizeof(expected);
+    if (size < sizeof(header) + index_bytes)
+        return nullptr;
+    const model_tensor_entry* index = reinterpret_cast<const model_tensor_entry*>(image + sizeof(header));
+    if (model_hash(index, index_bytes) != header.index_checksum)
+        return nullptr;
+    for (size_t e = 0; e < num_layers * MTNN_MODEL_TENSORS; ++e)
+        if (index[e].elements != expected[e].elements || index[e].offset % MTNN_ALIGNMENT != 0 || index[e].offset + index[e].elements * sizeof(float) > size)
+            return nullptr;
+
+    if (verify_data && model_data_checksum(image, index, num_layers * MTNN_MODEL_TENSORS) != header.data_checksum)
+        return nullptr;
+    return index;
+}
+
+template<typename policy, typename... layers>
 template<typename file_name_type>
-inline void NeuralNet<layers...>::
+inline bool BasicNeuralNet<policy, layers...>::
 save_data()
 {
-    save_net_data<file_name_type>();
+    model_file_header header;
+    model_tensor_entry index[num_layers * MTNN_MODEL_TENSORS];
+    model_layout(header, index);
+    uint64_t hash = model_hash(nullptr, 0);
+#ifndef _MSC_VER
+    loop_all_layers<model_checksum_impl, uint64_t&>{ hash };
+#else
+    loop_all_layers<model_checksum_impl, uint64_t&>{ hash, 0 };
+#endif
+    header.data_checksum = hash;
+
+#ifdef _MSC_VER
+    //windows can't replace a mapped file, the parameters move to owned memory first
+    if (mapped_model.maps(file_name_type::string))
+        unmap_data();
+#endif
+
+    //written next to the file and moved over it when complete, the file (maybe mapped by this net) is never truncated
+    std::string temp = model_temp_path(file_name_type::string);
+    FILE* fp = nullptr;
+#ifdef _MSC_VER
+    fopen_s(&fp, temp.c_str(), "wb");
+#else
+    fp = fopen(temp.c_str(), "wb");
+#endif
+    if (fp == nullptr)
+        return false;
+    setvbuf(fp, nullptr, _IOFBF, MTNN_MODEL_IO_BUFFER);
+
+    //blobs go out straight from the tensors, one write each
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(index, sizeof(index), 1, fp);
+    uint64_t position = sizeof(header) + sizeof(index);
+#ifndef _MSC_VER
+    loop_all_layers<model_write_impl, FILE*, const model_tensor_entry*, uint64_t&>{ fp, index, position };
+#else
+    loop_all_layers<model_write_impl, FILE*, const model_tensor_entry*, uint64_t&>{ fp, index, position, 0 };
+#endif
+
+    bool ok = ferror(fp) == 0;
+    ok = fclose(fp) == 0 && ok;
+    return model_replace(temp, file_name_type::string, ok);
+}
+
+template<typename policy, typename... layers>
+template<typename file_name_type>
+inline void BasicNeuralNet<policy, layers...>::
+save_data_async()
+{
+    //the previous image may still be going out of the staging buffer
+    checkpoint_writer.wait();
+
+    model_file_header header;
+    model_tensor_entry index[num_layers * MTNN_MODEL_TENSORS];
+    model_layout(header, index);
+
+    //only the copy happens here, the writer fills in data_checksum
+    std::vector<unsigned char>& image = checkpoint_writer.staging();
+    image.resize(static_cast<size_t>(header.file_size));
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + sizeof(header), index, sizeof(index));
+    uint64_t position = sizeof(header) + sizeof(index);
+#ifndef _MSC_VER
+    loop_all_layers<model_stage_impl, unsigned char*, const model_tensor_entry*, uint64_t&>{ image.data(), index, position };
+#else
+    loop_all_layers<model_stage_impl, unsigned char*, const model_tensor_entry*, uint64_t&>{ image.data(), index, position, 0 };
+#endif
+
+#ifdef _MSC_VER
+    //see save_data
+    if (mapped_model.maps(file_name_type::string))
+        unmap_data();
+#endif
+    checkpoint_writer.start(file_name_type::string);
+}
+
+template<typename policy, typename... layers>
+inline bool BasicNeuralNet<policy, layers...>::
+wait_for_save()
+{
+    return checkpoint_writer.wait();
 }
 
-template<typename... layers>
+template<typename policy, typename... layers>
 template<typename file_name_type>
-inline void NeuralNet<layers...>::
+inline bool BasicNeuralNet<policy, layers...>::
 load_data()
 {
-    load_net_data<file_name_type>();
+    FILE* fp = nullptr;
+#ifdef _MSC_VER
+    fopen_s(&fp, file_name_type::string, "rb");
+#else
+    fp = fopen(file_name_type::string, "rb");
+#endif
+    if (fp == nullptr)
+        return false;
+
+    //read the whole image first so a bad file leaves the net alone
+    std::vector<unsigned char> image;
+    bool ok = fseek(fp, 0, SEEK_END) == 0;
+    long size = ok ? ftell(fp) : -1;
+    if (size > 0 && fseek(fp, 0, SEEK_SET) == 0)
+    {
+        image.resize(static_cast<size_t>(size));
+        ok = fread(image.data(), 1, image.size(), fp) == image.size();
+    }
+    fclose(fp);
+    if (!ok || image.empty())
+        return false;
+
+    const model_tensor_entry* index = check_model(image.data(), image.size(), true);
+    if (index == nullptr)
+        return false;
+#ifndef _MSC_VER
+    loop_all_layers<model_read_impl, const unsigned char*, const model_tensor_entry*>{ image.data(), index };
+#else
+    loop_all_layers<model_read_impl, const unsigned char*, const model_tensor_entry*>{ image.data(), index, 0 };
+#endif
+    return true;
+}
+
+template<typename policy, typename... layers>
+template<typename file_name_type>
+inline bool BasicNeuralNet<policy, layers...>::
+load_mmap(bool verify_data = false)
+{
+    model_mapping next;
+    if (!next.map(file_name_type::string))
+        return false;
+    const model_tensor_entry* index = check_model(next.data(), next.size(), verify_data);
+    if (index == nullptr)
+        return false;
+
+#ifndef _MSC_VER
+    loop_all_layers<model_alias_impl, unsigned char*, const model_tensor_entry*>{ next.data(), index };
+#else
+    loop_all_layers<model_alias_impl, unsigned char*, const model_tensor_entry*>{ next.data(), index, 0 };
+#endif
+    //the previous mapping (if any) goes away with next
+    mapped_model.swap(next);
+    return true;
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+unmap_data()
+{
+    if (!mapped_model.is_mapped())
+        return;
+#ifndef _MSC_VER
+    loop_all_layers<model_alias_impl, unsigned char*, const model_tensor_entry*>{ nullptr, nullptr };
+#else
+    loop_all_layers<model_alias_impl, unsigned char*, const model_tensor_entry*>{ nullptr, nullptr, 0 };
+#endif
+    mapped_model.unmap();
 }
 
-template<typename... layers>
-inline void NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
 set_input(typename get_type<0, layers...>::feature_maps_type& new_input)
 {
 #ifndef _MSC_VER
@@ -1234,8 +1989,8 @@ set_input(typename get_type<0, layers...>::feature_maps_type& new_input)
     }
 }
 
-template<typename... layers>
-inline void NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
 set_labels(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& new_labels)
 {
     for (size_t f = 0; f < labels.size(); ++f)
@@ -1244,9 +1999,9 @@ set_labels(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type&
                 labels[f].at(i, j) = new_labels[f].at(i, j);
 }
 
-template<typename... layers>
-inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& NeuralNet<layers...>::
-discriminate(typename get_type<0, layers...>::feature_maps_type& new_input = NeuralNet<layers...>::input)
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& BasicNeuralNet<policy, layers...>::
+discriminate(typename get_type<0, layers...>::feature_maps_type& new_input = BasicNeuralNet<policy, layers...>::input)
 {
 #ifndef _MSC_VER
     if (get_batch_activations<0>().size() == 0)
@@ -1270,14 +2025,17 @@ discriminate(typename get_type<0, layers...>::feature_maps_type& new_input = Neu
     return get_batch_activations<last_layer_index>()[0];
 }
 
-template<typename... layers>
-inline  typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& NeuralNet<layers...>::
-discriminate_thread(typename get_type<0, layers...>::feature_maps_type& new_input = NeuralNet<layers...>::input)
+template<typename policy, typename... layers>
+inline  typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& BasicNeuralNet<policy, layers...>::
+discriminate_thread(typename get_type<0, layers...>::feature_maps_type& new_input = BasicNeuralNet<policy, layers...>::input)
 {
+    refresh_folded_thread();
+    state_scope scope(this);
+
 #ifndef _MSC_VER
-    loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this);
+    loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this);
 #else
-    loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this, 0);
+    loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this, 0);
 #endif
 
     //set input
@@ -1286,89 +2044,227 @@ discriminate_thread(typename get_type<0, layers...>::feature_maps_type& new_inpu
             for (size_t j = 0; j < get_layer<0>::feature_maps.cols(); ++j)
                 get_thread_batch_activations<0>()[0][f].at(i, j) = new_input[f].at(i, j);
 #ifndef _MSC_VER
-    loop_up_layers<feed_forwards_thread, NeuralNet<layers...>&>(*this);
+    loop_up_layers<feed_forwards_thread, BasicNeuralNet<policy, layers...>&>(*this);
 #else
-    loop_up_layers<feed_forwards_thread, NeuralNet<layers...>&>(*this, 0);
+    loop_up_layers<feed_forwards_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
 #endif
 
     return get_thread_batch_activations<last_layer_index>()[0];
 }
 
-template<typename... layers>
-inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& BasicNeuralNet<policy, layers...>::
 discriminate(typename get_type<0, layers...>::feature_maps_vector_type& batch_inputs)
 {
     //adjust batch data sizes
 #ifndef _MSC_VER
-    while (get_batch_activations<0>().size() != batch_inputs.size()) //fix sizes
-    {
-        if (get_batch_activations<0>().size() > batch_inputs.size())
-            loop_all_layers<remove_batch_activations>();
-        else
-            loop_all_layers<add_batch_activations>();
-    }
+    loop_all_layers<resize_batch_vectors, size_t>(batch_inputs.size());
 
     //reset batch activations
     loop_all_layers<reset_layer_feature_maps>();
 
     get_layer<0>::feed_forwards(batch_inputs, get_batch_activations<1>());
-    for_loop<1, last_layer_index - 1, 1, feed_forwards_batch_training_layer>();
+    for_loop<1, last_layer_index - 1, 1, feed_forwards_batch_layer>();
 #else
-    while (get_batch_activations<0>().size() != batch_inputs.size()) //fix sizes
-    {
-        if (get_batch_activations<0>().size() > batch_inputs.size())
-            loop_all_layers<remove_batch_activations>(0);
-        else
-            loop_all_layers<add_batch_activations>(0);
-    }
+    loop_all_layers<resize_batch_vectors, size_t>(batch_inputs.size(), 0);
 
     //reset batch activations
     loop_all_layers<reset_layer_feature_maps>(0);
 
     get_layer<0>::feed_forwards(batch_inputs, get_batch_activations<1>());
-    for_loop<1, last_layer_index - 1, 1, feed_forwards_batch_training_layer>(0);
+    for_loop<1, last_layer_index - 1, 1, feed_forwards_batch_layer>(0);
 #endif
 
     return get_batch_activations<last_layer_index>();
 }
 
-template<typename... layers>
-inline  typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline  typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& BasicNeuralNet<policy, layers...>::
 discriminate_thread(typename get_type<0, layers...>::feature_maps_vector_type& batch_inputs)
 {
+    refresh_folded_thread();
+    state_scope scope(this);
+
 #ifndef _MSC_VER
     //adjust and reset batch activations
-    while (get_thread_batch_activations<0>().size() != batch_inputs.size()) //fix sizes
-    {
-        if (get_thread_batch_activations<0>().size() > batch_inputs.size())
-            loop_all_layers<remove_thread_batch_activations, NeuralNet<layers...>&>(*this);
-        else
-            loop_all_layers<add_thread_batch_activations, NeuralNet<layers...>&>(*this);
-    }
-    loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this);
+    loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_inputs.size());
+    loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this);
 
     get_layer<0>::feed_forwards(batch_inputs, get_thread_batch_activations<1>());
-    loop_up_layers<feed_forwards_batch_thread, NeuralNet<layers...>&>(*this);
+    loop_up_layers<feed_forwards_batch_thread, BasicNeuralNet<policy, layers...>&>(*this);
 #else
     //adjust and reset batch activations
-    while (get_thread_batch_activations<0>().size() != batch_inputs.size()) //fix sizes
-    {
-        if (get_thread_batch_activations<0>().size() > batch_inputs.size())
-            loop_all_layers<remove_thread_batch_activations, NeuralNet<layers...>&>(*this, 0);
-        else
-            loop_all_layers<add_thread_batch_activations, NeuralNet<layers...>&>(*this, 0);
-    }
-    loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this, 0);
+    loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_inputs.size(), 0);
+    loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this, 0);
 
     get_layer<0>::feed_forwards(batch_inputs, get_thread_batch_activations<1>());
-    loop_up_layers<feed_forwards_batch_thread, NeuralNet<layers...>&>(*this, 0);
+    loop_up_layers<feed_forwards_batch_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
+#endif
+
+    return get_thread_batch_activations<last_layer_index>();
+}
+
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& BasicNeuralNet<policy, layers...>::
+discriminate_sequences_thread(typename get_type<0, layers...>::feature_maps_vector_type& batch_inputs)
+{
+    refresh_folded_thread();
+
+#ifndef _MSC_VER
+    //one activation and one state per sequence
+    loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_inputs.size());
+    loop_all_layers<resize_thread_states, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_inputs.size());
+    loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this);
+
+    get_layer<0>::feed_forwards(batch_inputs, get_thread_batch_activations<0>());
+    loop_up_layers<feed_forwards_lockstep_thread, BasicNeuralNet<policy, layers...>&>(*this);
+#else
+    //one activation and one state per sequence
+    loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_inputs.size(), 0);
+    loop_all_layers<resize_thread_states, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_inputs.size(), 0);
+    loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this, 0);
+
+    get_layer<0>::feed_forwards(batch_inputs, get_thread_batch_activations<0>());
+    loop_up_layers<feed_forwards_lockstep_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
+#endif
+
+    return get_thread_batch_activations<last_layer_index>();
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+reset_state_thread()
+{
+#ifndef _MSC_VER
+    loop_all_layers<reset_thread_states, BasicNeuralNet<policy, layers...>&>(*this);
+#else
+    loop_all_layers<reset_thread_states, BasicNeuralNet<policy, layers...>&>(*this, 0);
+#endif
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+seed_thread(uint64_t seed, uint64_t stream)
+{
+    thread_random_stream.seed(seed, stream);
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+refresh_folded_thread()
+{
+    if (thread_fold_generation == fold_generation)
+        return;
+#ifndef _MSC_VER
+    loop_all_layers<refresh_folded_thread_layer, BasicNeuralNet<policy, layers...>&>(*this);
+#else
+    loop_all_layers<refresh_folded_thread_layer, BasicNeuralNet<policy, layers...>&>(*this, 0);
+#endif
+    thread_fold_generation = fold_generation;
+}
+
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& BasicNeuralNet<policy, layers...>::
+step(typename get_type<0, layers...>::feature_maps_type& new_input)
+{
+    //every layer overwrites its outputs, so nothing is reset
+#ifndef _MSC_VER
+    if (get_batch_activations<0>().size() == 0)
+        loop_all_layers<add_batch_activations>();
+#else
+    if (get_batch_activations<0>().size() == 0)
+        loop_all_layers<add_batch_activations>(0);
+#endif
+
+    std::copy(new_input.data(), new_input.data() + new_input.elements(), get_batch_activations<0>()[0].data());
+#ifndef _MSC_VER
+    loop_up_layers<feed_forwards_layer>();
+#else
+    loop_up_layers<feed_forwards_layer>(0);
 #endif
+    return get_batch_activations<last_layer_index>()[0];
+}
+
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& BasicNeuralNet<policy, layers...>::
+step(typename get_type<0, layers...>::feature_maps_vector_type& chunk)
+{
+#ifndef _MSC_VER
+    loop_all_layers<resize_batch_vectors, size_t>(chunk.size());
+#else
+    loop_all_layers<resize_batch_vectors, size_t>(chunk.size(), 0);
+#endif
+
+    for (size_t in = 0; in < chunk.size(); ++in)
+        std::copy(chunk[in].data(), chunk[in].data() + chunk[in].elements(), get_batch_activations<0>()[in].data());
+#ifndef _MSC_VER
+    loop_up_layers<feed_forwards_batch_layer>();
+#else
+    loop_up_layers<feed_forwards_batch_layer>(0);
+#endif
+    return get_batch_activations<last_layer_index>();
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+reset_state()
+{
+#ifndef _MSC_VER
+    loop_all_layers<reset_layer_state>();
+#else
+    loop_all_layers<reset_layer_state>(0);
+#endif
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+seed(uint64_t seed)
+{
+    random_stream_seed = seed;
+    random_stream.seed(seed, 0);
+}
+
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& BasicNeuralNet<policy, layers...>::
+step_thread(typename get_type<0, layers...>::feature_maps_type& new_input)
+{
+    refresh_folded_thread();
+    state_scope scope(this);
+
+    std::copy(new_input.data(), new_input.data() + new_input.elements(), get_thread_batch_activations<0>()[0].data());
+#ifndef _MSC_VER
+    loop_up_layers<feed_forwards_thread, BasicNeuralNet<policy, layers...>&>(*this);
+#else
+    loop_up_layers<feed_forwards_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
+#endif
+    return get_thread_batch_activations<last_layer_index>()[0];
+}
+
+template<typename policy, typename... layers>
+inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& BasicNeuralNet<policy, layers...>::
+step_thread(typename get_type<0, layers...>::feature_maps_vector_type& chunk)
+{
+    refresh_folded_thread();
+    state_scope scope(this);
 
+#ifndef _MSC_VER
+    loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, chunk.size());
+#else
+    loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, chunk.size(), 0);
+#endif
+
+    for (size_t in = 0; in < chunk.size(); ++in)
+        std::copy(chunk[in].data(), chunk[in].data() + chunk[in].elements(), get_thread_batch_activations<0>()[in].data());
+#ifndef _MSC_VER
+    loop_up_layers<feed_forwards_batch_thread, BasicNeuralNet<policy, layers...>&>(*this);
+#else
+    loop_up_layers<feed_forwards_batch_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
+#endif
     return get_thread_batch_activations<last_layer_index>();
 }
 
-template<typename... layers>
-inline typename get_type<0, layers...>::feature_maps_type NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline typename get_type<0, layers...>::feature_maps_type BasicNeuralNet<policy, layers...>::
 generate(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& input, size_t iterations, bool use_sampling)
 {
 #ifndef _MSC_VER
@@ -1401,9 +2297,9 @@ generate(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& i
     for (size_t i = 0; i < iterations; ++i)
     {
         if (use_sampling)
-            rbm_layer::stochastic_sample(rbm_layer::feature_maps);
+            rbm_layer::stochastic_sample(rbm_layer::feature_maps, random_stream);
         rbm_layer::feed_forwards(get_layer<last_rbm_index + 1>::feature_maps);
-        get_layer<last_rbm_index + 1>::stochastic_sample(get_layer<last_rbm_index + 1>::feature_maps);
+        get_layer<last_rbm_index + 1>::stochastic_sample(get_layer<last_rbm_index + 1>::feature_maps, random_stream);
         rbm_layer::feed_backwards(get_layer<last_rbm_index + 1>::feature_maps);
     }
 
@@ -1425,8 +2321,8 @@ generate(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& i
     return output;
 }
 
-template<typename... layers>
-inline void NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
 pretrain(size_t markov_iterations)
 {
 #ifndef _MSC_VER
@@ -1458,12 +2354,12 @@ pretrain(size_t markov_iterations)
 
     using target_layer = get_layer<last_layer_index>; //todo add in target layer
     if (target_layer::type == MTNN_LAYER_CONVOLUTION || target_layer::type == MTNN_LAYER_PERCEPTRONFULLCONNECTIVITY)
-        target_layer::wake_sleep(learning_rate, use_dropout, markov_iterations);
+        target_layer::wake_sleep(learning_rate, policy_use_dropout(), markov_iterations);
 }
 
-template<typename... layers>
-inline float NeuralNet<layers...>::
-train(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = NeuralNet<layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = NeuralNet<layers...>::labels)
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
+train(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = BasicNeuralNet<policy, layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = BasicNeuralNet<policy, layers...>::labels)
 {
 #ifndef _MSC_VER
     if (get_batch_activations<0>().size() == 0)
@@ -1489,66 +2385,84 @@ train(bool already_fed = false, typename get_type<0, layers...>::feature_maps_ty
         loop_up_layers<feed_forwards_training_layer>(0);
 #endif
 
-        error = global_error(get_batch_activations<last_layer_index>()[0], lbl);
+        if (!fused_log_likelihood())
+            error = global_error(get_batch_activations<last_layer_index>()[0], lbl);
     }
 
-    //get error signals for output
-    auto errors = error_signals(get_batch_activations<last_layer_index>()[0], lbl);
+    if (fused_log_likelihood())
+        error = log_likelihood_impl<last_layer_index - 1>::back_prop(get_batch_activations<last_layer_index>()[0], lbl, get_batch_activations<last_layer_index - 1>()[0], get_layer<last_layer_index - 1>::feature_maps);
 
-    //back_prop for each layer (need to get activation derivatives for output first
-    get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
-        get_batch_activations<last_layer_index>()[0], get_layer<last_layer_index>::feature_maps,
-        !use_batch_learning && optimization_method == MTNN_OPT_BACKPROP, learning_rate,
-        use_momentum && !use_batch_learning, momentum_term,
-        use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+    else
+    {
+        //get error signals for output
+        auto& errors = output_error_signals;
+        error_signals(get_batch_activations<last_layer_index>()[0], lbl, errors);
+
+        //back_prop for each layer (need to get activation derivatives for output first
+        get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
+            get_batch_activations<last_layer_index>()[0], get_layer<last_layer_index>::feature_maps,
+            !use_batch_learning && policy_optimization_method() == MTNN_OPT_BACKPROP, learning_rate,
+            policy_use_momentum() && !use_batch_learning, momentum_term,
+            use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+    }
 #ifndef _MSC_VER
     for_loop<last_layer_index - 1, 1, 1, back_prop_layer>();
 #else
     for_loop<last_layer_index - 1, 1, 1, back_prop_layer>(0);
 #endif
 
-    if (!use_batch_learning && optimization_method != MTNN_OPT_BACKPROP) //online is applied directly in backprop otherwise
+    if (!use_batch_learning && policy_optimization_method() != MTNN_OPT_BACKPROP) //online is applied directly in backprop otherwise
         apply_gradient();
 
     return error;
 }
 
-template<typename... layers>
-inline float NeuralNet<layers...>::
-train_thread(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = NeuralNet<layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = NeuralNet<layers...>::labels)
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
+train_thread(bool already_fed = false, typename get_type<0, layers...>::feature_maps_type& new_input = BasicNeuralNet<policy, layers...>::input, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbl = BasicNeuralNet<policy, layers...>::labels)
 {
+    refresh_folded_thread();
+    state_scope scope(this);
+
     float error = 0.0f;
 
     if (!already_fed)
     {
 #ifndef _MSC_VER
-        loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this);
+        loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this);
 #else
-        loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this, 0);
+        loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this, 0);
 #endif
         //set input
         get_layer<0>::feed_forwards(new_input, get_thread_batch_activations<0>()[0]);
 
 #ifndef _MSC_VER
-        loop_up_layers<feed_forwards_training_thread, NeuralNet<layers...>&>(*this);
+        loop_up_layers<feed_forwards_training_thread, BasicNeuralNet<policy, layers...>&>(*this);
 #else
-        loop_up_layers<feed_forwards_training_thread, NeuralNet<layers...>&>(*this, 0);
+        loop_up_layers<feed_forwards_training_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
 #endif
     }
-    error = global_error(get_thread_batch_activations<last_layer_index>()[0], lbl);
+    if (fused_log_likelihood())
+        error = log_likelihood_impl<last_layer_index - 1>::back_prop(get_thread_batch_activations<last_layer_index>()[0], lbl, get_thread_batch_activations<last_layer_index - 1>()[0], get_thread_batch_out_derivs<last_layer_index - 1>()[0]);
+
+    else
+    {
+        error = global_error(get_thread_batch_activations<last_layer_index>()[0], lbl);
 
-    //get error signals for output
-    auto errors = error_signals(get_thread_batch_activations<last_layer_index>()[0], lbl);
+        //get error signals for output
+        auto& errors = thread_output_error_signals;
+        error_signals(get_thread_batch_activations<last_layer_index>()[0], lbl, errors);
 
-    //back_prop for each layer (need to get activation derivatives for output first
-    get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
-        get_thread_batch_activations<last_layer_index>()[0], get_thread_batch_out_derivs<last_layer_index>()[0],
-        false, learning_rate, false, momentum_term, false, false, false,
-        get_aux_weights<last_layer_index>(), get_aux_biases<last_layer_index>(), get_aux_weights_gradient<last_layer_index>(), get_aux_biases_gradient<last_layer_index>());
+        //back_prop for each layer (need to get activation derivatives for output first
+        get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
+            get_thread_batch_activations<last_layer_index>()[0], get_thread_batch_out_derivs<last_layer_index>()[0],
+            false, learning_rate, false, momentum_term, false, false, false,
+            get_aux_weights<last_layer_index>(), get_aux_biases<last_layer_index>(), get_aux_weights_gradient<last_layer_index>(), get_aux_biases_gradient<last_layer_index>());
+    }
 #ifndef _MSC_VER
-    for_loop<last_layer_index - 1, 1, 1, back_prop_thread, NeuralNet<layers...>&>(*this);
+    for_loop<last_layer_index - 1, 1, 1, back_prop_thread, BasicNeuralNet<policy, layers...>&>(*this);
 #else
-    for_loop<last_layer_index - 1, 1, 1, back_prop_thread, NeuralNet<layers...>&>(*this, 0);
+    for_loop<last_layer_index - 1, 1, 1, back_prop_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
 #endif
 
     //if (!use_batch_learning && optimization_method != MTNN_OPT_BACKPROP)
@@ -1557,8 +2471,8 @@ train_thread(bool already_fed = false, typename get_type<0, layers...>::feature_
     return error;
 }
 
-template<typename... layers>
-inline float NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
 train_batch(typename get_type<0, layers...>::feature_maps_vector_type& batch_inputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels, bool already_fed = false, bool apply = false)
 {
     bool temp_batch = use_batch_learning;
@@ -1568,20 +2482,7 @@ train_batch(typename get_type<0, layers...>::feature_maps_vector_type& batch_inp
     //adjust batch data sizes
     if (!already_fed)
     {
-        while (get_batch_activations<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_batch_activations<0>().size() > batch_labels.size())
-                loop_all_layers<remove_batch_activations>();
-            else
-                loop_all_layers<add_batch_activations>();
-        }
-        while (get_batch_out_derivs<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_batch_out_derivs<0>().size() > batch_labels.size())
-                loop_all_layers<remove_batch_out_derivs>();
-            else
-                loop_all_layers<add_batch_out_derivs>();
-        }
+        loop_all_layers<resize_batch_vectors, size_t>(batch_labels.size());
 
         //reset batch activations
         loop_all_layers<reset_layer_feature_maps>();
@@ -1593,20 +2494,7 @@ train_batch(typename get_type<0, layers...>::feature_maps_vector_type& batch_inp
     //adjust batch data sizes
     if (!already_fed)
     {
-        while (get_batch_activations<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_batch_activations<0>().size() > batch_labels.size())
-                loop_all_layers<remove_batch_activations>(0);
-            else
-                loop_all_layers<add_batch_activations>(0);
-        }
-        while (get_batch_out_derivs<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_batch_out_derivs<0>().size() > batch_labels.size())
-                loop_all_layers<remove_batch_out_derivs>(0);
-            else
-                loop_all_layers<add_batch_out_derivs>(0);
-        }
+        loop_all_layers<resize_batch_vectors, size_t>(batch_labels.size(), 0);
 
         //reset batch activations
         loop_all_layers<reset_layer_feature_maps>(0);
@@ -1616,16 +2504,27 @@ train_batch(typename get_type<0, layers...>::feature_maps_vector_type& batch_inp
     }
 #endif
 
-    float total_error = global_error(get_batch_activations<last_layer_index>(), batch_labels);
+    float total_error = 0.0f;
+    if (fused_log_likelihood())
+    {
+        for (size_t in = 0; in < batch_labels.size(); ++in)
+            total_error += log_likelihood_impl<last_layer_index - 1>::back_prop(get_batch_activations<last_layer_index>()[in], batch_labels[in], get_batch_activations<last_layer_index - 1>()[in], get_batch_out_derivs<last_layer_index - 1>()[in]);
+    }
+
+    else
+    {
+        total_error = global_error(get_batch_activations<last_layer_index>(), batch_labels);
 
-    //get error signals for output
-    auto errors = error_signals(get_batch_activations<last_layer_index>(), batch_labels);
+        //get error signals for output
+        auto& errors = batch_error_signals;
+        error_signals(get_batch_activations<last_layer_index>(), batch_labels, errors);
 
-    //back_prop for each layer (need to get activation derivatives for output first
-    get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
-        get_batch_activations<last_layer_index>(), get_batch_out_derivs<last_layer_index>(),
-        true, learning_rate, false, momentum_term,
-        use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+        //back_prop for each layer (need to get activation derivatives for output first
+        get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
+            get_batch_activations<last_layer_index>(), get_batch_out_derivs<last_layer_index>(),
+            true, learning_rate, false, momentum_term,
+            use_l2_weight_decay, include_bias_decay, weight_decay_factor);
+    }
 #ifndef _MSC_VER
     for_loop<last_layer_index - 1, 1, 1, back_prop_batch_layer>();
 #else
@@ -1638,90 +2537,87 @@ train_batch(typename get_type<0, layers...>::feature_maps_vector_type& batch_inp
     return total_error / batch_inputs.size();
 }
 
-template<typename... layers>
-inline float NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
 train_batch_thread(typename get_type<0, layers...>::feature_maps_vector_type& batch_inputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels, bool already_fed = false)
 {
+    refresh_folded_thread();
+    state_scope scope(this);
+
+    //only write the shared flag if it changes, several thread nets may be in here at once
     bool temp_batch = use_batch_learning;
-    use_batch_learning = true;
+    if (!temp_batch)
+        use_batch_learning = true;
 
 #ifndef _MSC_VER
     if (!already_fed)
     {
         //adjust batch data sizes
-        while (get_thread_batch_activations<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_thread_batch_activations<0>().size() > batch_labels.size())
-                loop_all_layers<remove_thread_batch_activations, NeuralNet<layers...>&>(*this);
-            else
-                loop_all_layers<add_thread_batch_activations, NeuralNet<layers...>&>(*this);
-        }
-        while (get_thread_batch_out_derivs<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_thread_batch_out_derivs<0>().size() > batch_labels.size())
-                loop_all_layers<remove_thread_batch_out_derivs, NeuralNet<layers...>&>(*this);
-            else
-                loop_all_layers<add_thread_batch_out_derivs, NeuralNet<layers...>&>(*this);
-        }
+        loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_labels.size());
 
         //reset batch activations
-        loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this);
+        loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this);
 
         get_layer<0>::feed_forwards(batch_inputs, get_thread_batch_activations<0>());
-        loop_up_layers<feed_forwards_batch_training_thread, NeuralNet<layers...>&>(*this);
+        loop_up_layers<feed_forwards_batch_training_thread, BasicNeuralNet<policy, layers...>&>(*this);
     }
 #else
     if (!already_fed)
     {
         //adjust batch data sizes
-        while (get_thread_batch_activations<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_thread_batch_activations<0>().size() > batch_labels.size())
-                loop_all_layers<remove_thread_batch_activations, NeuralNet<layers...>&>(*this, 0);
-            else
-                loop_all_layers<add_thread_batch_activations, NeuralNet<layers...>&>(*this, 0);
-        }
-        while (get_thread_batch_out_derivs<0>().size() != batch_labels.size()) //fix sizes
-        {
-            if (get_thread_batch_out_derivs<0>().size() > batch_labels.size())
-                loop_all_layers<remove_thread_batch_out_derivs, NeuralNet<layers...>&>(*this, 0);
-            else
-                loop_all_layers<add_thread_batch_out_derivs, NeuralNet<layers...>&>(*this, 0);
-        }
+        loop_all_layers<resize_thread_batch_vectors, BasicNeuralNet<policy, layers...>&, size_t>(*this, batch_labels.size(), 0);
 
         //reset batch activations
-        loop_all_layers<reset_thread_feature_maps, NeuralNet<layers...>&>(*this, 0);
+        loop_all_layers<reset_thread_feature_maps, BasicNeuralNet<policy, layers...>&>(*this, 0);
 
         get_layer<0>::feed_forwards(batch_inputs, get_thread_batch_activations<0>());
-        loop_up_layers<feed_forwards_batch_training_thread, NeuralNet<layers...>&>(*this, 0);
+        loop_up_layers<feed_forwards_batch_training_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
     }
 #endif
 
-    float total_error = global_error(get_thread_batch_activations<last_layer_index>(), batch_labels);
+    float total_error = 0.0f;
+    if (fused_log_likelihood())
+    {
+        for (size_t in = 0; in < batch_labels.size(); ++in)
+            total_error += log_likelihood_impl<last_layer_index - 1>::back_prop(get_thread_batch_activations<last_layer_index>()[in], batch_labels[in], get_thread_batch_activations<last_layer_index - 1>()[in], get_thread_batch_out_derivs<last_layer_index - 1>()[in]);
+    }
+
+    else
+    {
+        total_error = global_error(get_thread_batch_activations<last_layer_index>(), batch_labels);
 
-    //get error signals for output
-    auto errors = error_signals(get_thread_batch_activations<last_layer_index>(), batch_labels);
+        //get error signals for output
+        auto& errors = thread_batch_error_signals;
+        error_signals(get_thread_batch_activations<last_layer_index>(), batch_labels, errors);
 
-    //back_prop for each layer (need to get activation derivatives for output first
-    get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
-        get_thread_batch_activations<last_layer_index>(), get_thread_batch_out_derivs<last_layer_index>(),
-        true, learning_rate, false, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor,
-        get_aux_weights<last_layer_index>(), get_aux_biases<last_layer_index>(), get_aux_weights_gradient<last_layer_index>(), get_aux_biases_gradient<last_layer_index>());
+        //back_prop for each layer (need to get activation derivatives for output first
+        get_layer<last_layer_index>::back_prop(get_layer<last_layer_index>::activation, errors,
+            get_thread_batch_activations<last_layer_index>(), get_thread_batch_out_derivs<last_layer_index>(),
+            true, learning_rate, false, momentum_term, use_l2_weight_decay, include_bias_decay, weight_decay_factor,
+            get_aux_weights<last_layer_index>(), get_aux_biases<last_layer_index>(), get_aux_weights_gradient<last_layer_index>(), get_aux_biases_gradient<last_layer_index>());
+    }
 #ifndef _MSC_VER
-    for_loop<last_layer_index - 1, 1, 1, back_prop_batch_thread, NeuralNet<layers...>&>(*this);
+    for_loop<last_layer_index - 1, 1, 1, back_prop_batch_thread, BasicNeuralNet<policy, layers...>&>(*this);
 #else
-    for_loop<last_layer_index - 1, 1, 1, back_prop_batch_thread, NeuralNet<layers...>&>(*this, 0);
+    for_loop<last_layer_index - 1, 1, 1, back_prop_batch_thread, BasicNeuralNet<policy, layers...>&>(*this, 0);
 #endif    
 
     //apply_gradient(); don't apply gradient if parallel
-    use_batch_learning = temp_batch;
+    if (!temp_batch)
+        use_batch_learning = temp_batch;
     return total_error / batch_inputs.size();
 }
 
-template<typename... layers>
-inline void NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
 calculate_population_statistics(typename get_type<0, layers...>::feature_maps_vector_type& batch_inputs)
 {
+#ifndef _MSC_VER
+    loop_all_layers<resize_batch_vectors, size_t>(batch_inputs.size());
+#else
+    loop_all_layers<resize_batch_vectors, size_t>(batch_inputs.size(), 0);
+#endif
+
     //put in inputs
     get_layer<0>::feed_forwards(batch_inputs, get_batch_activations<1>());
 #ifndef _MSC_VER
@@ -1731,8 +2627,54 @@ calculate_population_statistics(typename get_type<0, layers...>::feature_maps_ve
 #endif    
 }
 
-template<typename... layers>
-inline void NeuralNet<layers...>::
+template<typename policy, typename... layers>
+template<typename chunk_func>
+inline void BasicNeuralNet<policy, layers...>::
+calculate_population_statistics(size_t chunks, const chunk_func& get_chunk)
+{
+#ifndef _MSC_VER
+    for_loop<1, last_layer_index - 1, 1, population_pass<chunk_func>::template impl, size_t, const chunk_func&>(chunks, get_chunk);
+#else
+    for_loop<1, last_layer_index - 1, 1, population_pass<chunk_func>::template impl, size_t, const chunk_func&>(chunks, get_chunk, 0);
+#endif
+}
+
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
+fold_batch_normalization(typename get_type<0, layers...>::feature_maps_vector_type& check_inputs)
+{
+    constexpr size_t out_size = get_type<sizeof...(layers)-1, layers...>::feature_maps_type::elements();
+
+    //outputs before folding
+    std::vector<float> expected(check_inputs.size() * out_size);
+    reset_state();
+    for (size_t in = 0; in < check_inputs.size(); ++in)
+    {
+        auto& out = discriminate(check_inputs[in]);
+        std::copy(out.data(), out.data() + out_size, expected.data() + in * out_size);
+    }
+
+#ifndef _MSC_VER
+    for_loop<1, last_layer_index - 1, 1, fold_batch_norm_layer>();
+#else
+    for_loop<1, last_layer_index - 1, 1, fold_batch_norm_layer>(0);
+#endif
+    ++fold_generation;
+
+    float difference = 0.0f;
+    reset_state();
+    for (size_t in = 0; in < check_inputs.size(); ++in)
+    {
+        auto& out = discriminate(check_inputs[in]);
+        for (size_t i = 0; i < out_size; ++i)
+            difference = std::max(difference, std::abs(out.data()[i] - expected[in * out_size + i]));
+    }
+    reset_state();
+    return difference;
+}
+
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
 apply_gradient(bool clear_gradients = true)
 {
 #ifndef _MSC_VER
@@ -1743,29 +2685,55 @@ apply_gradient(bool clear_gradients = true)
         loop_up_layers<add_weight_decay_layer>(0);
 #endif    
 
-    if (optimization_method == MTNN_OPT_ADAM)
+    if (policy_optimization_method() == MTNN_OPT_ADAM)
         ++t_adam;
 
+    //everything that is the same for every parameter, adam's bias correction included
+    optimizer_step step = {};
+    step.learning_rate = learning_rate;
+    step.momentum_term = momentum_term;
+    step.beta1 = beta1;
+    step.beta2 = beta2;
+    step.minimum_divisor = minimum_divisor;
+    if (policy_optimization_method() == MTNN_OPT_ADAM)
+        step.adam_step_size = learning_rate * (float)(sqrt(1.0 - pow(beta2, t_adam)) / (1.0 - pow(beta1, t_adam)));
+
+    //the method is picked once here, the layer loops are instantiated per method
+    if (policy_optimization_method() == MTNN_OPT_ADAM)
+        apply_gradient_with<optimizer_adam>(clear_gradients, step);
+    else if (policy_optimization_method() == MTNN_OPT_ADAGRAD)
+        apply_gradient_with<optimizer_adagrad>(clear_gradients, step);
+    else if (policy_use_momentum())
+        apply_gradient_with<optimizer_momentum>(clear_gradients, step);
+    else
+        apply_gradient_with<optimizer_sgd>(clear_gradients, step);
+}
+
+template<typename policy, typename... layers>
+template<typename optimizer>
+inline void BasicNeuralNet<policy, layers...>::
+apply_gradient_with(bool clear_gradients, const optimizer_step& step)
+{
 #ifndef _MSC_VER
     if (clear_gradients)
-        loop_up_layers<apply_gradient_layer>();
+        loop_up_layers<apply_gradient_using<optimizer>::template layer, const optimizer_step&>{ step };
     else
-        loop_up_layers<apply_gradient_noclear_layer>();
+        loop_up_layers<apply_gradient_using<optimizer>::template noclear_layer, const optimizer_step&>{ step };
 #else
     if (clear_gradients)
-        loop_up_layers<apply_gradient_layer>(0);
+        loop_up_layers<apply_gradient_using<optimizer>::template layer, const optimizer_step&>{ step, 0 };
     else
-        loop_up_layers<apply_gradient_noclear_layer>(0);
+        loop_up_layers<apply_gradient_using<optimizer>::template noclear_layer, const optimizer_step&>{ step, 0 };
 #endif
 }
 
-template<typename... layers>
-inline float NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
 global_error(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& output = get_batch_activations<last_layer_index>()[0], typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbls = labels)
 {
     float sum = 0.0f;
 
-    if (loss_function == MTNN_LOSS_L2)
+    if (policy_loss_function() == MTNN_LOSS_L2)
     {
         for (size_t f = 0; f < labels.size(); ++f)
             for (size_t i = 0; i < labels[f].rows(); ++i)
@@ -1773,7 +2741,7 @@ global_error(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_typ
                     sum += pow(output[f].at(i, j) - lbls[f].at(i, j), 2);
         return sum / 2;
     }
-    else if (loss_function == MTNN_LOSS_LOGLIKELIHOOD)
+    else if (policy_loss_function() == MTNN_LOSS_LOGLIKELIHOOD)
     {
         sum = 0.0f;
         for (size_t f = 0; f < labels.size(); ++f)
@@ -1782,80 +2750,104 @@ global_error(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_typ
                     sum += -1 * (labels[f].at(i, j) * log(output[f].at(i, j)));
         return sum;
     }
-    else if (loss_function == MTNN_LOSS_CUSTOMTARGETS)
+    else if (policy_loss_function() == MTNN_LOSS_CUSTOMTARGETS)
         return 0;
 }
 
-template<typename... layers>
-inline float NeuralNet<layers...>::
+template<typename policy, typename... layers>
+inline float BasicNeuralNet<policy, layers...>::
 global_error(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_outputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels)
 {
-    if (loss_function == MTNN_LOSS_CUSTOMTARGETS)
+    if (policy_loss_function() == MTNN_LOSS_CUSTOMTARGETS)
         return 0;
     float sum = 0.0f;
     for (size_t in = 0; in < batch_outputs.size(); ++in)
     {
-        if (loss_function == MTNN_LOSS_L2)
+        if (policy_loss_function() == MTNN_LOSS_L2)
             for (size_t f = 0; f < batch_labels[in].size(); ++f)
                 for (size_t i = 0; i < batch_labels[in][f].rows(); ++i)
                     for (size_t j = 0; j < batch_labels[in][f].cols(); ++j)
                         sum += pow(batch_outputs[in][f].at(i, j) - batch_labels[in][f].at(i, j), 2);
-        else if (loss_function == MTNN_LOSS_LOGLIKELIHOOD)
+        else if (policy_loss_function() == MTNN_LOSS_LOGLIKELIHOOD)
             for (size_t f = 0; f < labels.size(); ++f)
                 for (size_t i = 0; i < labels[f].rows(); ++i)
                     for (size_t j = 0; j < labels[f].cols(); ++j)
                         sum += -1 * (batch_labels[in][f].at(i, j) * log(batch_outputs[in][f].at(i, j)));
     }
-    if (loss_function == MTNN_LOSS_L2)
+    if (policy_loss_function() == MTNN_LOSS_L2)
         return sum / 2;
-    else if (loss_function == MTNN_LOSS_LOGLIKELIHOOD)
+    else if (policy_loss_function() == MTNN_LOSS_LOGLIKELIHOOD)
         return sum;
 }
 
-template<typename... layers>
+template<typename policy, typename... layers>
+template<size_t l>
+inline void BasicNeuralNet<policy, layers...>::
+dropout(bool training, philox_stream& rng, dropout_mask& mask, typename get_layer<l>::feature_maps_type* maps, size_t samples)
+{
+    if (!training || !policy_use_dropout())
+    {
+        mask.clear();
+        return;
+    }
+
+    //the whole batch's bits in one draw
+    constexpr size_t n = get_layer<l>::feature_maps_type::elements();
+    mask.draw(rng, samples, n, dropout_probability);
+    for (size_t s = 0; s < samples; ++s)
+    {
+        mask.apply(s, maps[s].data(), n);
+        maps[s].touch();
+    }
+}
+
+template<typename policy, typename... layers>
 template<size_t l>
-inline void NeuralNet<layers...>::
-dropout()
-{
-    using layer = get_layer<l>;
-    for (size_t f = 0; f < layer::feature_maps.size(); ++f)
-        for (size_t i = 0; i < layer::feature_maps.rows(); ++i)
-            for (size_t j = 0; j < layer::feature_maps.cols(); ++j)
-                if ((1.0f * rand()) / RAND_MAX <= dropout_probability)
-                    get_batch_activations<l>()[0][f].at(i, j) = 0;
+inline void BasicNeuralNet<policy, layers...>::
+dropout_back_prop(const dropout_mask& mask, typename get_layer<l>::feature_maps_type* activations, typename get_layer<l>::feature_maps_type* out_derivs, size_t samples)
+{
+    constexpr size_t n = get_layer<l>::feature_maps_type::elements();
+    samples = std::min(samples, mask.samples());
+    for (size_t s = 0; s < samples; ++s)
+    {
+        mask.back_prop(s, out_derivs[s].data(), activations[s].data(), n);
+        get_layer<l>::chain_activations(out_derivs[s], activations[s], get_layer<l - 1>::activation);
+        activations[s].touch();
+        out_derivs[s].touch();
+    }
 }
 
-template<typename... layers>
-inline typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type NeuralNet<layers...>::
-error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& output = get_batch_activations<last_layer_index>()[0], typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbls = NeuralNet<layers...>::labels)
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& output, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& lbls, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type& out)
 {
-    auto out = typename get_type<sizeof...(layers)-1, layers...>::feature_maps_type{ 0 };
-    if (loss_function == MTNN_LOSS_L2)
+    if (policy_loss_function() == MTNN_LOSS_L2)
         for (size_t f = 0; f < lbls.size(); ++f)
             for (size_t i = 0; i < lbls.rows(); ++i)
                 for (size_t j = 0; j < lbls.cols(); ++j)
                     out[f].at(i, j) = output[f].at(i, j) - lbls[f].at(i, j);
-    else if (loss_function == MTNN_LOSS_LOGLIKELIHOOD) //assumes next layer is softmax?
+    else if (policy_loss_function() == MTNN_LOSS_LOGLIKELIHOOD) //dL/dp of -sum(y * log(p)), the fused path handles a softmax right before the output
     {
         for (size_t f = 0; f < lbls.size(); ++f)
             for (size_t i = 0; i < lbls.rows(); ++i)
                 for (size_t j = 0; j < lbls.cols(); ++j)
-                    out[f].at(i, j) = lbls[f].at(i, j);
+                    out[f].at(i, j) = -lbls[f].at(i, j) / std::max(output[f].at(i, j), MTNN_LOGLIKELIHOOD_EPSILON);
     }
-    else if (loss_function == MTNN_LOSS_CUSTOMTARGETS)
+    else if (policy_loss_function() == MTNN_LOSS_CUSTOMTARGETS)
         for (size_t f = 0; f < lbls.size(); ++f)
             for (size_t i = 0; i < lbls.rows(); ++i)
                 for (size_t j = 0; j < lbls.cols(); ++j)
                     out[f].at(i, j) = lbls[f].at(i, j);
-    return out;
+    else
+        std::fill(out.data(), out.data() + out.elements(), 0.0f);
 }
 
-template<typename ...layers>
-inline typename typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type NeuralNet<layers...>::
-error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_outputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels)
+template<typename policy, typename... layers>
+inline void BasicNeuralNet<policy, layers...>::
+error_signals(typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_outputs, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_labels, typename get_type<sizeof...(layers)-1, layers...>::feature_maps_vector_type& batch_out)
 {
-    auto out = typename get_layer<last_layer_index>::feature_maps_vector_type(batch_outputs.size());
+    if (batch_out.size() != batch_outputs.size())
+        batch_out.resize(batch_outputs.size());
     for (size_t in = 0; in < batch_outputs.size(); ++in)
-        out[in] = error_signals(batch_outputs[in], batch_labels[in]);
-    return out;
-}
\ No newline at end of file
+        error_signals(batch_outputs[in], batch_labels[in], batch_out[in]);
+}
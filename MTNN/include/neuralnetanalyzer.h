@@ -37,6 +37,7 @@ private:
 
                             //decrement, get new error
                             layer::weights[d].at(i, j) -= .001f;
+                            layer::weights.touch();
                             net::discriminate();
                             float adj_error = net::global_error();
 
@@ -51,6 +52,7 @@ private:
 
                             //reset
                             layer::weights[d].at(i, j) += .001f;
+                            layer::weights.touch();
                         }
                     }
                 }
@@ -106,11 +108,13 @@ private:
 
                             //decrement, get new error
                             layer::weights[d].at(i, j) -= .001f;
+                            layer::weights.touch();
                             net::discriminate();
                             float h_minus = net::global_error();
 
                             //reincrement, get new error
                             layer::weights[d].at(i, j) += .002f;
+                            layer::weights.touch();
                             net::discriminate();
                             float h = net::global_error();
 
@@ -125,6 +129,7 @@ private:
 
                             //reset
                             layer::weights[d].at(i, j) -= .001f;
+                            layer::weights.touch();
                         }
                     }
                 }
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "imatrix.h"
+#include "ilayer.h"
+#include "neuralnet.h"
+#include "parallel.h"
+
+//Data parallel minibatch trainer. Keeps a pool of thread nets (instances of net), splits every batch across them,
+//tree reduces their gradients into the static (master) net, applies it and sends the new parameters back out
+template<typename net> class NeuralNetTrainer
+{
+public:
+    using input_vector_type = typename net::template get_layer<0>::feature_maps_vector_type;
+    using label_vector_type = typename net::template get_layer<net::last_layer_index>::feature_maps_vector_type;
+
+private:
+    //layers that keep per step state in statics (bn minibatch statistics) can't run on several threads at once. lstm layers keep their state
+    //per net, but they treat a batch as one sequence, which can't be split
+    template<size_t l, size_t last = net::last_layer_index> struct parallel_safe_impl
+    {
+        static constexpr size_t type = net::template get_layer<l>::type;
+        static constexpr bool value = (type == MTNN_LAYER_INPUT || type == MTNN_LAYER_CONVOLUTION || type == MTNN_LAYER_PERCEPTRONFULLCONNECTIVITY
+            || type == MTNN_LAYER_MAXPOOL || type == MTNN_LAYER_SOFTMAX || type == MTNN_LAYER_OUTPUT) && parallel_safe_impl<l + 1, last>::value;
+    };
+
+    template<size_t last> struct parallel_safe_impl<last, last>
+    {
+        static constexpr size_t type = net::template get_layer<last>::type;
+        static constexpr bool value = type == MTNN_LAYER_INPUT || type == MTNN_LAYER_CONVOLUTION || type == MTNN_LAYER_PERCEPTRONFULLCONNECTIVITY
+            || type == MTNN_LAYER_MAXPOOL || type == MTNN_LAYER_SOFTMAX || type == MTNN_LAYER_OUTPUT;
+    };
+
+    ////LAYER LOOP BODIES
+
+    //dst's gradients += src's gradients
+    template<size_t l> struct add_thread_gradients_impl
+    {
+        add_thread_gradients_impl(net& dst, net& src)
+        {
+            add(dst.template get_aux_weights_gradient<l>(), src.template get_aux_weights_gradient<l>());
+            add(dst.template get_aux_biases_gradient<l>(), src.template get_aux_biases_gradient<l>());
+        }
+
+        template<typename maps_type> static void add(maps_type& dst, maps_type& src)
+        {
+            float* out = dst.data();
+            const float* in = src.data();
+            for (size_t i = 0; i < maps_type::elements(); ++i)
+                out[i] += in[i];
+        }
+    };
+
+    //master's gradients += src's gradients
+    template<size_t l> struct add_master_gradients_impl
+    {
+        add_master_gradients_impl(net& src)
+        {
+            using layer = typename net::template get_layer<l>;
+            add_thread_gradients_impl<l>::add(layer::weights_gradient, src.template get_aux_weights_gradient<l>());
+            add_thread_gradients_impl<l>::add(layer::biases_gradient, src.template get_aux_biases_gradient<l>());
+        }
+    };
+
+    //copy the master's parameters into a thread net and clear its gradients
+    template<size_t l> struct broadcast_impl
+    {
+        broadcast_impl(net& dst)
+        {
+            using layer = typename net::template get_layer<l>;
+            copy(layer::weights, dst.template get_aux_weights<l>());
+            copy(layer::biases, dst.template get_aux_biases<l>());
+            std::fill(dst.template get_aux_weights_gradient<l>().data(), dst.template get_aux_weights_gradient<l>().data() + layer::weights_type::elements(), 0.0f);
+            std::fill(dst.template get_aux_biases_gradient<l>().data(), dst.template get_aux_biases_gradient<l>().data() + layer::biases_type::elements(), 0.0f);
+        }
+
+        template<typename maps_type> static void copy(maps_type& src, maps_type& dst)
+        {
+            std::copy(src.data(), src.data() + maps_type::elements(), dst.data());
+            //thread nets keep their own kernel caches
+            dst.touch();
+        }
+    };
+
+public:
+    //whether batches can be split for this architecture at all, otherwise train_batch is forwarded to the master
+    static constexpr bool parallel_safe = parallel_safe_impl<0>::value;
+
+    //spawns n_workers - 1 threads, the calling thread works as the first one
+    NeuralNetTrainer(size_t n_workers = std::thread::hardware_concurrency()) : generation(0), pending(0), stopping(false), task(nullptr), task_invoke(nullptr)
+    {
+        n_workers = std::max<size_t>(n_workers, 1);
+        for (size_t w = 0; w < n_workers; ++w)
+        {
+            nets.emplace_back(new net());
+            nets[w]->seed_thread(net::random_stream_seed, w + 1);
+        }
+        shard_inputs.resize(n_workers);
+        shard_labels.resize(n_workers);
+        shard_errors.resize(n_workers);
+
+        for (size_t w = 1; w < n_workers; ++w)
+            threads.emplace_back(&NeuralNetTrainer<net>::worker_loop, this, w);
+    }
+
+    //joins the pool
+    ~NeuralNetTrainer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+    }
+
+    NeuralNetTrainer(const NeuralNetTrainer<net>&) = delete;
+    NeuralNetTrainer<net>& operator=(const NeuralNetTrainer<net>&) = delete;
+
+    //reseeds the master's random stream and gives worker w stream w + 1 of the same seed, so runs with the same seed and
+    //number of workers draw the same numbers
+    void seed(uint64_t seed)
+    {
+        net::seed(seed);
+        for (size_t w = 0; w < nets.size(); ++w)
+            nets[w]->seed_thread(seed, w + 1);
+    }
+
+    //number of thread nets (including the calling thread's)
+    size_t workers() const
+    {
+        return nets.size();
+    }
+
+    //backprop for a batch split across the workers and apply the summed gradient to the master, returns mean error by loss function
+    float train_batch(input_vector_type& batch_inputs, label_vector_type& batch_labels)
+    {
+        size_t n_in = batch_inputs.size();
+        size_t active = std::min(nets.size(), n_in);
+        if (!parallel_safe || active < 2)
+            return net::train_batch(batch_inputs, batch_labels, false, true);
+
+        //set here so thread nets don't race on it
+        bool temp_batch = net::use_batch_learning;
+        net::use_batch_learning = true;
+
+        //contiguous shards, sizes differ by at most one
+        for (size_t w = 0; w < active; ++w)
+        {
+            size_t begin = n_in * w / active;
+            size_t end = n_in * (w + 1) / active;
+            shard_inputs[w].resize(end - begin);
+            shard_labels[w].resize(end - begin);
+            for (size_t in = begin; in < end; ++in)
+            {
+                std::copy(batch_inputs[in].data(), batch_inputs[in].data() + batch_inputs[in].elements(), shard_inputs[w][in - begin].data());
+                std::copy(batch_labels[in].data(), batch_labels[in].data() + batch_labels[in].elements(), shard_labels[w][in - begin].data());
+            }
+        }
+
+        run([this, active](size_t w)
+        {
+            //every worker already has a core, layers don't split their work any further
+            task_scheduler::serial_scope serial;
+            if (w < active)
+                shard_errors[w] = nets[w]->train_batch_thread(shard_inputs[w], shard_labels[w]) * shard_inputs[w].size();
+        });
+
+        //pairwise tree reduction into worker 0
+        for (size_t stride = 1; stride < active; stride *= 2)
+        {
+            run([this, active, stride](size_t w)
+            {
+                if (w % (2 * stride) == 0 && w + stride < active)
+                {
+#ifndef _MSC_VER
+                    typename net::template loop_all_layers<add_thread_gradients_impl, net&, net&>{ *nets[w], *nets[w + stride] };
+#else
+                    typename net::template loop_all_layers<add_thread_gradients_impl, net&, net&>{ *nets[w], *nets[w + stride], 0 };
+#endif
+                }
+            });
+        }
+
+#ifndef _MSC_VER
+        typename net::template loop_all_layers<add_master_gradients_impl, net&>{ *nets[0] };
+#else
+        typename net::template loop_all_layers<add_master_gradients_impl, net&>{ *nets[0], 0 };
+#endif
+        net::apply_gradient();
+        net::use_batch_learning = temp_batch;
+
+        synchronize();
+
+        float total_error = 0.0f;
+        for (size_t w = 0; w < active; ++w)
+            total_error += shard_errors[w];
+        return total_error / n_in;
+    }
+
+    //copy the master's parameters to every worker and clear their gradients. Call after changing the master outside of train_batch (eg load_data)
+    void synchronize()
+    {
+        run([this](size_t w)
+        {
+#ifndef _MSC_VER
+            typename net::template loop_all_layers<broadcast_impl, net&>{ *nets[w] };
+#else
+            typename net::template loop_all_layers<broadcast_impl, net&>{ *nets[w], 0 };
+#endif
+        });
+    }
+
+private:
+    //thread nets, worker w trains on nets[w]
+    std::vector<std::unique_ptr<net>> nets;
+    //per worker batch slices, reused between steps
+    std::vector<input_vector_type> shard_inputs;
+    std::vector<label_vector_type> shard_labels;
+    //per worker summed (not mean) error
+    std::vector<float> shard_errors;
+
+    //workers 1... (worker 0 is whoever calls train_batch)
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    //bumped for every task so sleeping workers know there is new work
+    size_t generation;
+    //workers still running the current task
+    size_t pending;
+    bool stopping;
+    //current job, type erased without std::function so handing it out never allocates
+    const void* task;
+    void(*task_invoke)(const void*, size_t);
+
+    template<typename func> static void call(const void* f, size_t w)
+    {
+        (*static_cast<const func*>(f))(w);
+    }
+
+    //run job(w) on every worker and wait for all of them
+    template<typename func> void run(const func& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &job;
+            task_invoke = &call<func>;
+            pending = threads.size();
+            ++generation;
+        }
+        start_cv.notify_all();
+
+        job(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return pending == 0; });
+    }
+
+    void worker_loop(size_t w)
+    {
+        size_t seen = 0;
+        while (true)
+        {
+            const void* job = nullptr;
+            void(*invoke)(const void*, size_t) = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [this, seen] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                job = task;
+                invoke = task_invoke;
+            }
+
+            invoke(job, w);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                done_cv.notify_one();
+        }
+    }
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parallel.h"
+#include "simd.h"
+
+//hyperparameters of one apply_gradient, anything that only depends on the step is worked out once here
+struct optimizer_step
+{
+    float learning_rate;
+    float momentum_term;
+    float beta1;
+    float beta2;
+    //learning_rate * sqrt(1 - beta2^t) / (1 - beta1^t), adam's bias correction
+    float adam_step_size;
+    float minimum_divisor;
+};
+
+//Fused update kernels. Each works on one vector (simd_float) or one float (scalar_float) of the parameters, the gradient,
+//the momentum and the aux data at once, so a layer's update is a single pass over its contiguous tensors
+
+//w -= lr * g
+struct optimizer_sgd
+{
+    //adam and adagrad aren't used for batch norm layers
+    static constexpr bool adaptive = false;
+
+    template<typename vec> static inline void update(float* w, const float* g, float*, float*, const optimizer_step& s)
+    {
+        (vec::load(w) - vec::set1(s.learning_rate) * vec::load(g)).store(w);
+    }
+};
+
+//m = momentum * m - lr * g, w += m
+struct optimizer_momentum
+{
+    static constexpr bool adaptive = false;
+
+    template<typename vec> static inline void update(float* w, const float* g, float* m, float*, const optimizer_step& s)
+    {
+        vec delta = vec::set1(s.momentum_term) * vec::load(m) - vec::set1(s.learning_rate) * vec::load(g);
+        (vec::load(w) + delta).store(w);
+        delta.store(m);
+    }
+};
+
+//m and v are the running first and second moments
+struct optimizer_adam
+{
+    static constexpr bool adaptive = true;
+
+    template<typename vec> static inline void update(float* w, const float* g, float* m, float* v, const optimizer_step& s)
+    {
+        vec grad = vec::load(g);
+        vec moment = vec::set1(s.beta1) * vec::load(m) + vec::set1(1.0f - s.beta1) * grad;
+        vec second = vec::set1(s.beta2) * vec::load(v) + vec::set1(1.0f - s.beta2) * grad * grad;
+        (vec::load(w) - vec::set1(s.adam_step_size) * moment / (sqrt(second) + vec::set1(1e-7f))).store(w);
+        moment.store(m);
+        second.store(v);
+    }
+};
+
+//v is the sum of squared gradients so far
+struct optimizer_adagrad
+{
+    static constexpr bool adaptive = true;
+
+    template<typename vec> static inline void update(float* w, const float* g, float*, float* v, const optimizer_step& s)
+    {
+        vec grad = vec::load(g);
+        vec sum = vec::load(v);
+        (vec::load(w) - vec::set1(s.learning_rate) / sqrt(sum + vec::set1(s.minimum_divisor)) * grad).store(w);
+        (sum + grad * grad).store(v);
+    }
+};
+
+//method over n parameters (whole vectors, then the tail), clearing the gradient too if erase. Big tensors are split over the scheduler
+template<typename method, bool erase> inline void optimizer_apply(float* w, float* g, float* m, float* v, size_t n, const optimizer_step& s)
+{
+    parallel_for(0, n, parallel_grain(8, simd_float::width), [=, &s](size_t begin, size_t end)
+    {
+        size_t i = begin;
+        for (; i + simd_float::width <= end; i += simd_float::width)
+        {
+            method::template update<simd_float>(w + i, g + i, m + i, v + i, s);
+            if (erase)
+                simd_float::zero().store(g + i);
+        }
+        for (; i < end; ++i)
+        {
+            method::template update<scalar_float>(w + i, g + i, m + i, v + i, s);
+            if (erase)
+                g[i] = 0.0f;
+        }
+    });
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//multiply-adds a task needs before it is worth handing to another thread
+#ifndef MTNN_PARALLEL_GRAIN
+#define MTNN_PARALLEL_GRAIN 32768
+#endif
+
+//threads the scheduler spreads work over (callers included), 0 is one per core
+#ifndef MTNN_PARALLEL_THREADS
+#define MTNN_PARALLEL_THREADS 0
+#endif
+
+//items per task when every item costs work_per_item multiply-adds, rounded up to a multiple. Layers evaluate this on their
+//compile time dimensions, a grain covering all items keeps the layer serial
+constexpr size_t parallel_grain(size_t work_per_item, size_t multiple = 1)
+{
+    return ((MTNN_PARALLEL_GRAIN + (work_per_item ? work_per_item : 1) - 1) / (work_per_item ? work_per_item : 1) + multiple - 1) / multiple * multiple;
+}
+
+//work stealing scheduler. Every thread that takes part has its own deque: ranges are split in halves, the owner keeps working on the
+//left half from the back while idle threads steal the big right halves from the front
+class task_scheduler
+{
+public:
+    static task_scheduler& instance()
+    {
+        static task_scheduler scheduler;
+        return scheduler;
+    }
+
+    //threads work is spread over, including the calling one
+    size_t threads() const
+    {
+        return pool.size() + 1;
+    }
+
+    //body(b, e) over [begin, end) in pieces of grain items (the last may be shorter), returns once every piece is done. The caller works too
+    template<typename func> void parallel_for(size_t begin, size_t end, size_t grain, const func& body)
+    {
+        grain = std::max<size_t>(grain, 1);
+        if (end - begin <= grain || pool.empty() || serial_depth() != 0)
+        {
+            body(begin, end);
+            return;
+        }
+
+        job j(body, grain, end - begin);
+        execute(task{ &j, begin, end });
+
+        //help (with anything) until our stolen pieces are back
+        while (j.remaining.load(std::memory_order_acquire) != 0)
+            if (!run_one())
+                std::this_thread::yield();
+    }
+
+    //parallel_for stays on this thread while one is alive, eg for thread nets that already have a core each
+    struct serial_scope
+    {
+        serial_scope()
+        {
+            ++serial_depth();
+        }
+
+        ~serial_scope()
+        {
+            --serial_depth();
+        }
+    };
+
+private:
+    //one parallel_for call, lives on the caller's stack
+    struct job
+    {
+        template<typename func> job(const func& f, size_t g, size_t n) : body(&f), invoke(&call<func>), grain(g), remaining(n) {}
+
+        template<typename func> static void call(const void* f, size_t b, size_t e)
+        {
+            (*static_cast<const func*>(f))(b, e);
+        }
+
+        const void* body;
+        void(*invoke)(const void*, size_t, size_t);
+        size_t grain;
+        //items not finished yet
+        std::atomic<size_t> remaining;
+    };
+
+    struct task
+    {
+        job* owner;
+        size_t begin;
+        size_t end;
+    };
+
+    //ring buffer deque, grows when full but never shrinks so steady state pushes don't allocate
+    struct task_queue
+    {
+        std::mutex mutex;
+        std::vector<task> ring;
+        size_t head = 0;
+        size_t count = 0;
+
+        task_queue() : ring(64) {}
+
+        bool empty() const
+        {
+            return count == 0;
+        }
+
+        void push_back(const task& t)
+        {
+            if (count == ring.size())
+            {
+                std::vector<task> bigger(ring.size() * 2);
+                for (size_t i = 0; i < count; ++i)
+                    bigger[i] = ring[(head + i) % ring.size()];
+                ring.swap(bigger);
+                head = 0;
+            }
+            ring[(head + count) % ring.size()] = t;
+            ++count;
+        }
+
+        task pop_back()
+        {
+            --count;
+            return ring[(head + count) % ring.size()];
+        }
+
+        task pop_front()
+        {
+            task t = ring[head];
+            head = (head + 1) % ring.size();
+            --count;
+            return t;
+        }
+    };
+
+    //a participating thread's deque, unregistered when the thread exits
+    struct local_queue_holder
+    {
+        task_scheduler* owner = nullptr;
+        task_queue queue;
+
+        ~local_queue_holder()
+        {
+            if (owner != nullptr)
+                owner->unregister_queue(&queue);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    //every participating thread's deque, steal targets
+    std::vector<task_queue*> queues;
+    std::mutex queues_mutex;
+
+    //queued tasks over all deques, idle pool threads sleep while it is 0
+    std::atomic<long> pending;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool stopping;
+
+    task_scheduler() : pending(0), stopping(false)
+    {
+        size_t n = MTNN_PARALLEL_THREADS != 0 ? MTNN_PARALLEL_THREADS : std::thread::hardware_concurrency();
+        for (size_t t = 1; t < n; ++t)
+            pool.emplace_back(&task_scheduler::worker_loop, this);
+    }
+
+    ~task_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (size_t t = 0; t < pool.size(); ++t)
+            pool[t].join();
+    }
+
+    static size_t& serial_depth()
+    {
+        static thread_local size_t depth = 0;
+        return depth;
+    }
+
+    task_queue& local_queue()
+    {
+        static thread_local local_queue_holder holder;
+        if (holder.owner == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            queues.push_back(&holder.queue);
+            holder.owner = this;
+        }
+        return holder.queue;
+    }
+
+    void unregister_queue(task_queue* queue)
+    {
+        std::lock_guard<std::mutex> lock(queues_mutex);
+        queues.erase(std::remove(queues.begin(), queues.end(), queue), queues.end());
+    }
+
+    void push(task_queue& queue, const task& t)
+    {
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.push_back(t);
+        }
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        sleep_cv.notify_one();
+    }
+
+    //split down to one grain (leaving the right halves for thieves), then run it
+    void execute(task t)
+    {
+        task_queue& own = local_queue();
+        size_t grain = t.owner->grain;
+        while (t.end - t.begin > grain)
+        {
+            size_t pieces = (t.end - t.begin + grain - 1) / grain;
+            size_t mid = t.begin + pieces / 2 * grain;
+            push(own, task{ t.owner, mid, t.end });
+            t.end = mid;
+        }
+
+        t.owner->invoke(t.owner->body, t.begin, t.end);
+        //the job may be gone as soon as this hits 0
+        t.owner->remaining.fetch_sub(t.end - t.begin, std::memory_order_release);
+    }
+
+    //newest task of our own deque, else the oldest of someone else's
+    bool run_one()
+    {
+        task_queue& own = local_queue();
+        task t;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.empty())
+            {
+                t = own.pop_back();
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            for (size_t q = 0; q < queues.size() && !found; ++q)
+            {
+                if (queues[q] == &own)
+                    continue;
+                std::lock_guard<std::mutex> victim_lock(queues[q]->mutex);
+                if (!queues[q]->empty())
+                {
+                    t = queues[q]->pop_front();
+                    found = true;
+                }
+            }
+        }
+
+        if (!found)
+            return false;
+        pending.fetch_sub(1);
+        execute(t);
+        return true;
+    }
+
+    void worker_loop()
+    {
+        local_queue();
+        while (true)
+        {
+            if (run_one())
+                continue;
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleep_cv.wait(lock, [this] { return stopping || pending.load() > 0; });
+            if (stopping)
+                return;
+        }
+    }
+};
+
+//shorthand for task_scheduler::instance().parallel_for
+template<typename func> inline void parallel_for(size_t begin, size_t end, size_t grain, const func& body)
+{
+    task_scheduler::instance().parallel_for(begin, end, grain, body);
+}
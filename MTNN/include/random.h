@@ -0,0 +1,368 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "simd.h"
+
+//Philox4x32-10 constants (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+#define MTNN_PHILOX_M0 0xD2511F53u
+#define MTNN_PHILOX_M1 0xCD9E8D57u
+#define MTNN_PHILOX_W0 0x9E3779B9u
+#define MTNN_PHILOX_W1 0xBB67AE85u
+
+//Philox words of MTNN_SIMD_WIDTH blocks side by side
+struct philox_lanes
+{
+#if MTNN_SIMD_WIDTH == 8
+    __m256i v;
+
+    static inline philox_lanes load(const uint32_t* p) { return{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)) }; }
+    static inline philox_lanes set1(uint32_t x) { return{ _mm256_set1_epi32(static_cast<int>(x)) }; }
+    inline void store(uint32_t* p) const { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+    friend inline philox_lanes operator^(philox_lanes a, philox_lanes b) { return{ _mm256_xor_si256(a.v, b.v) }; }
+    //full 64 bit products of every lane with m, split into high and low words
+    static inline void multiply(philox_lanes a, uint32_t m, philox_lanes& hi, philox_lanes& lo)
+    {
+        __m256i mv = _mm256_set1_epi32(static_cast<int>(m));
+        __m256i even = _mm256_mul_epu32(a.v, mv);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a.v, 32), mv);
+        lo.v = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+        hi.v = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+    }
+    //bit per lane: whether its top 24 bits are below threshold
+    static inline uint32_t below(philox_lanes a, uint32_t threshold)
+    {
+        __m256i top = _mm256_srli_epi32(a.v, 8);
+        return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(threshold)), top))));
+    }
+#elif MTNN_SIMD_WIDTH == 4
+    __m128i v;
+
+    static inline philox_lanes load(const uint32_t* p) { return{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)) }; }
+    static inline philox_lanes set1(uint32_t x) { return{ _mm_set1_epi32(static_cast<int>(x)) }; }
+    inline void store(uint32_t* p) const { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+    friend inline philox_lanes operator^(philox_lanes a, philox_lanes b) { return{ _mm_xor_si128(a.v, b.v) }; }
+    //no 32 bit blend before SSE4.1, the halves are masked instead
+    static inline void multiply(philox_lanes a, uint32_t m, philox_lanes& hi, philox_lanes& lo)
+    {
+        __m128i mv = _mm_set1_epi32(static_cast<int>(m));
+        __m128i even = _mm_mul_epu32(a.v, mv);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a.v, 32), mv);
+        __m128i low_words = _mm_set_epi32(0, -1, 0, -1);
+        lo.v = _mm_or_si128(_mm_and_si128(even, low_words), _mm_slli_epi64(odd, 32));
+        hi.v = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low_words, odd));
+    }
+    static inline uint32_t below(philox_lanes a, uint32_t threshold)
+    {
+        __m128i top = _mm_srli_epi32(a.v, 8);
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(static_cast<int>(threshold)), top))));
+    }
+#else
+    uint32_t v;
+
+    static inline philox_lanes load(const uint32_t* p) { return{ *p }; }
+    static inline philox_lanes set1(uint32_t x) { return{ x }; }
+    inline void store(uint32_t* p) const { *p = v; }
+    friend inline philox_lanes operator^(philox_lanes a, philox_lanes b) { return{ a.v ^ b.v }; }
+    static inline void multiply(philox_lanes a, uint32_t m, philox_lanes& hi, philox_lanes& lo)
+    {
+        uint64_t p = static_cast<uint64_t>(m) * a.v;
+        hi.v = static_cast<uint32_t>(p >> 32);
+        lo.v = static_cast<uint32_t>(p);
+    }
+    static inline uint32_t below(philox_lanes a, uint32_t threshold)
+    {
+        return (a.v >> 8) < threshold ? 1u : 0u;
+    }
+#endif
+
+    static constexpr size_t width = MTNN_SIMD_WIDTH;
+};
+
+//stream ids with these bits are reserved, thread_rng() and idx_loader use them so they never meet a net's streams
+#define MTNN_STREAM_THREAD (1ull << 63)
+#define MTNN_STREAM_LOADER (1ull << 62)
+
+//Counter based generator: block n of stream s under key k is Philox4x32-10 of the counter (n, s), so any number of streams
+//(one per net instance, thread or sample) come from one seed without sharing state, and a stream's output doesn't depend on
+//how it's consumed or on which thread. The bulk functions run MTNN_SIMD_WIDTH blocks at once, one per vector lane (see
+//philox_lanes), and give the same words as drawing the blocks one by one. Single draws and bulk draws both take whole blocks, a
+//bulk call drops what's left of the block of the last single draw
+class philox_stream
+{
+public:
+    using result_type = uint32_t;
+
+    philox_stream(uint64_t seed = 0, uint64_t stream = 0)
+    {
+        this->seed(seed, stream);
+    }
+
+    //start stream over at block 0
+    void seed(uint64_t seed, uint64_t stream = 0)
+    {
+        key[0] = static_cast<uint32_t>(seed);
+        key[1] = static_cast<uint32_t>(seed >> 32);
+        id = stream;
+        position = 0;
+        used = 4;
+    }
+
+    //one 32 bit draw (so it works as a UniformRandomBitGenerator)
+    uint32_t operator()()
+    {
+        if (used == 4)
+        {
+            block(position++, buffered);
+            used = 0;
+        }
+        return buffered[used++];
+    }
+
+    static constexpr uint32_t min()
+    {
+        return 0;
+    }
+
+    static constexpr uint32_t max()
+    {
+        return 0xFFFFFFFFu;
+    }
+
+    //n raw words
+    void bits(uint32_t* out, size_t n)
+    {
+        used = 4;
+        constexpr size_t lanes = philox_lanes::width;
+        size_t i = 0;
+        for (; i + 4 * lanes <= n; i += 4 * lanes)
+            blocks(out + i);
+        uint32_t last[4];
+        for (; i < n; i += 4)
+        {
+            block(position++, last);
+            for (size_t w = 0; w < 4 && i + w < n; ++w)
+                out[i + w] = last[w];
+        }
+    }
+
+    //n floats uniform in [low, high) (24 bits each)
+    void uniform(float* out, size_t n, float low = 0.0f, float high = 1.0f)
+    {
+        float scale = (high - low) / 16777216.0f;
+        for_chunks(n, [&](const uint32_t* words, size_t begin, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                out[begin + i] = static_cast<float>(static_cast<int32_t>(words[i] >> 8)) * scale + low;
+        });
+    }
+
+    //n floats, on with probability p else off
+    void bernoulli(float* out, size_t n, float p, float on = 1.0f, float off = 0.0f)
+    {
+        float threshold = p * 16777216.0f;
+        for_chunks(n, [&](const uint32_t* words, size_t begin, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                out[begin + i] = static_cast<float>(static_cast<int32_t>(words[i] >> 8)) < threshold ? on : off;
+        });
+    }
+
+    //n bits packed 32 to a word from bit 0 up, set with probability p (the same draws as bernoulli). The words
+    //are compared a vector at a time and the results packed with a movemask
+    void bernoulli_bits(uint32_t* out, size_t n, float p)
+    {
+        //the 24 bit draws below p * 2^24 are the ones below its ceiling
+        uint32_t threshold = p > 0.0f ? static_cast<uint32_t>(std::ceil(std::min(p, 1.0f) * 16777216.0f)) : 0;
+        constexpr size_t lanes = philox_lanes::width;
+        for_chunks(n, [&](const uint32_t* words, size_t begin, size_t count)
+        {
+            //chunks are whole words of bits
+            for (size_t i = 0; i < count; i += 32)
+            {
+                size_t last = count - i < 32 ? count - i : 32;
+                uint32_t packed = 0;
+                size_t k = 0;
+                for (; k + lanes <= last; k += lanes)
+                    packed |= philox_lanes::below(philox_lanes::load(words + i + k), threshold) << k;
+                for (; k < last; ++k)
+                    packed |= ((words[i + k] >> 8) < threshold ? 1u : 0u) << k;
+                out[(begin + i) / 32] = packed;
+            }
+        });
+    }
+
+    //replaces each of n probabilities with a draw of it, 1 or 0 (sampling binary units)
+    void sample(float* probabilities, size_t n)
+    {
+        for_chunks(n, [&](const uint32_t* words, size_t begin, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                probabilities[begin + i] = static_cast<float>(static_cast<int32_t>(words[i] >> 8)) < probabilities[begin + i] * 16777216.0f ? 1.0f : 0.0f;
+        });
+    }
+
+    //n normal floats (Box-Muller on pairs of words)
+    void normal(float* out, size_t n, float mean = 0.0f, float stddev = 1.0f)
+    {
+        for_chunks(n + (n & 1), [&](const uint32_t* words, size_t begin, size_t count)
+        {
+            for (size_t i = 0; i < count; i += 2)
+            {
+                //(0, 1] so the log is finite
+                float u = (static_cast<float>(static_cast<int32_t>(words[i] >> 8)) + 1.0f) / 16777216.0f;
+                float angle = static_cast<float>(static_cast<int32_t>(words[i + 1] >> 8)) * (2 * 3.1415926f / 16777216.0f);
+                float radius = stddev * std::sqrt(-2.0f * std::log(u));
+                out[begin + i] = radius * std::cos(angle) + mean;
+                if (begin + i + 1 < n)
+                    out[begin + i + 1] = radius * std::sin(angle) + mean;
+            }
+        });
+    }
+
+private:
+    uint32_t key[2];
+    uint64_t id;
+    //next block
+    uint64_t position;
+    uint32_t buffered[4];
+    size_t used;
+
+    static inline void round(uint32_t& x0, uint32_t& x1, uint32_t& x2, uint32_t& x3, uint32_t k0, uint32_t k1)
+    {
+        uint64_t p0 = static_cast<uint64_t>(MTNN_PHILOX_M0) * x0;
+        uint64_t p1 = static_cast<uint64_t>(MTNN_PHILOX_M1) * x2;
+        uint32_t y0 = static_cast<uint32_t>(p1 >> 32) ^ x1 ^ k0;
+        uint32_t y2 = static_cast<uint32_t>(p0 >> 32) ^ x3 ^ k1;
+        x1 = static_cast<uint32_t>(p1);
+        x3 = static_cast<uint32_t>(p0);
+        x0 = y0;
+        x2 = y2;
+    }
+
+    void block(uint64_t n, uint32_t* out) const
+    {
+        uint32_t x0 = static_cast<uint32_t>(n);
+        uint32_t x1 = static_cast<uint32_t>(n >> 32);
+        uint32_t x2 = static_cast<uint32_t>(id);
+        uint32_t x3 = static_cast<uint32_t>(id >> 32);
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for (size_t r = 0; r < 10; ++r)
+        {
+            round(x0, x1, x2, x3, k0, k1);
+            k0 += MTNN_PHILOX_W0;
+            k1 += MTNN_PHILOX_W1;
+        }
+        out[0] = x0;
+        out[1] = x1;
+        out[2] = x2;
+        out[3] = x3;
+    }
+
+    //the next philox_lanes::width blocks into out, in block order
+    void blocks(uint32_t* out)
+    {
+        constexpr size_t lanes = philox_lanes::width;
+        uint32_t words[4][lanes];
+        for (size_t l = 0; l < lanes; ++l)
+        {
+            words[0][l] = static_cast<uint32_t>(position + l);
+            words[1][l] = static_cast<uint32_t>((position + l) >> 32);
+        }
+        philox_lanes x0 = philox_lanes::load(words[0]);
+        philox_lanes x1 = philox_lanes::load(words[1]);
+        philox_lanes x2 = philox_lanes::set1(static_cast<uint32_t>(id));
+        philox_lanes x3 = philox_lanes::set1(static_cast<uint32_t>(id >> 32));
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for (size_t r = 0; r < 10; ++r)
+        {
+            philox_lanes hi0, lo0, hi1, lo1;
+            philox_lanes::multiply(x0, MTNN_PHILOX_M0, hi0, lo0);
+            philox_lanes::multiply(x2, MTNN_PHILOX_M1, hi1, lo1);
+            x0 = hi1 ^ x1 ^ philox_lanes::set1(k0);
+            x1 = lo1;
+            x2 = hi0 ^ x3 ^ philox_lanes::set1(k1);
+            x3 = lo0;
+            k0 += MTNN_PHILOX_W0;
+            k1 += MTNN_PHILOX_W1;
+        }
+        x0.store(words[0]);
+        x1.store(words[1]);
+        x2.store(words[2]);
+        x3.store(words[3]);
+        for (size_t l = 0; l < lanes; ++l)
+            for (size_t w = 0; w < 4; ++w)
+                out[4 * l + w] = words[w][l];
+        position += lanes;
+    }
+
+    //hands n fresh words to func(words, begin, count) a stack buffer at a time
+    template<typename func> void for_chunks(size_t n, const func& f)
+    {
+        constexpr size_t chunk = 256;
+        uint32_t words[chunk];
+        for (size_t begin = 0; begin < n; begin += chunk)
+        {
+            size_t count = n - begin < chunk ? n - begin : chunk;
+            bits(words, count);
+            f(words, begin, count);
+        }
+    }
+};
+
+//seed of every thread_rng(), 0 until random_seed() is called
+inline std::atomic<uint64_t>& random_seed_value()
+{
+    static std::atomic<uint64_t> value{ 0 };
+    return value;
+}
+
+//bumped by random_seed() so thread_rng()s know to start over
+inline std::atomic<uint64_t>& random_seed_generation()
+{
+    static std::atomic<uint64_t> generation{ 0 };
+    return generation;
+}
+
+//reseeds thread_rng() on every thread (each at its next use)
+inline void random_seed(uint64_t seed)
+{
+    random_seed_value() = seed;
+    ++random_seed_generation();
+}
+
+//the calling thread's stream, for anything without a stream of its own (weight initialization, layer level sampling). Threads
+//get stream ids in the order they first ask, so the thread that initializes the weights (usually the only one then) is stream 0
+inline philox_stream& thread_rng()
+{
+    static std::atomic<uint64_t> threads{ 0 };
+    thread_local uint64_t ordinal = threads++;
+    thread_local uint64_t seen = ~0ull;
+    thread_local philox_stream rng;
+    uint64_t generation = random_seed_generation();
+    if (seen != generation)
+    {
+        seen = generation;
+        rng.seed(random_seed_value(), MTNN_STREAM_THREAD | ordinal);
+    }
+    return rng;
+}
+
+//n values uniform between low and high from the calling thread's stream
+inline void random_uniform(float* out, size_t n, float low, float high)
+{
+    thread_rng().uniform(out, n, low, high);
+}
+
+template<typename T> inline void random_uniform(T* out, size_t n, T low, T high)
+{
+    philox_stream& rng = thread_rng();
+    for (size_t i = 0; i < n; ++i)
+        out[i] = static_cast<T>(low + (high - low) * ((rng() >> 8) / 16777216.0));
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cmath>
+#include <stddef.h>
+#include <stdint.h>
+
+//widest float vector the target supports; everything here is resolved at compile time
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MTNN_SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MTNN_SIMD_WIDTH 4
+#else
+#define MTNN_SIMD_WIDTH 1
+#endif
+
+//thin wrapper over one float vector so kernels can be written once for AVX2, SSE and scalar
+struct simd_float
+{
+#if MTNN_SIMD_WIDTH == 8
+    __m256 v;
+
+    static inline simd_float load(const float* p) { return{ _mm256_loadu_ps(p) }; }
+    static inline simd_float set1(float x) { return{ _mm256_set1_ps(x) }; }
+    static inline simd_float zero() { return{ _mm256_setzero_ps() }; }
+    inline void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    //p[0], p[2], ..., p[14] (reads 16 floats)
+    static inline simd_float load_even(const float* p)
+    {
+        __m256 evens = _mm256_shuffle_ps(_mm256_loadu_ps(p), _mm256_loadu_ps(p + 8), _MM_SHUFFLE(2, 0, 2, 0));
+        return{ _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(evens), _MM_SHUFFLE(3, 1, 2, 0))) };
+    }
+
+    //a * b + c
+    friend inline simd_float fmadd(simd_float a, simd_float b, simd_float c)
+    {
+#if defined(__FMA__) || defined(_MSC_VER)
+        return{ _mm256_fmadd_ps(a.v, b.v, c.v) };
+#else
+        return{ _mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v) };
+#endif
+    }
+    friend inline simd_float operator+(simd_float a, simd_float b) { return{ _mm256_add_ps(a.v, b.v) }; }
+    friend inline simd_float operator-(simd_float a, simd_float b) { return{ _mm256_sub_ps(a.v, b.v) }; }
+    friend inline simd_float operator*(simd_float a, simd_float b) { return{ _mm256_mul_ps(a.v, b.v) }; }
+    friend inline simd_float operator/(simd_float a, simd_float b) { return{ _mm256_div_ps(a.v, b.v) }; }
+    friend inline simd_float sqrt(simd_float a) { return{ _mm256_sqrt_ps(a.v) }; }
+    friend inline simd_float min(simd_float a, simd_float b) { return{ _mm256_min_ps(a.v, b.v) }; }
+    friend inline simd_float max(simd_float a, simd_float b) { return{ _mm256_max_ps(a.v, b.v) }; }
+    //x where m > 0, else 0
+    friend inline simd_float mask_positive(simd_float m, simd_float x) { return{ _mm256_and_ps(_mm256_cmp_ps(m.v, _mm256_setzero_ps(), _CMP_GT_OQ), x.v) }; }
+    //x where bit lane of bits is set, else 0
+    friend inline simd_float mask_bits(uint32_t bits, simd_float x)
+    {
+        __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(static_cast<int>(bits)), lanes), lanes);
+        return{ _mm256_and_ps(_mm256_castsi256_ps(set), x.v) };
+    }
+    //largest lane
+    inline float hmax() const
+    {
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+    }
+    //sum of the lanes
+    inline float hsum() const
+    {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+    }
+    //2^n for whole n (in floats) between -126 and 127
+    static inline simd_float exp2i(simd_float n) { return{ _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n.v), _mm256_set1_epi32(127)), 23)) }; }
+    static inline simd_float round(simd_float a) { return{ _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+    static inline simd_float floor(simd_float a) { return{ _mm256_floor_ps(a.v) }; }
+    //base[index[0]], ..., base[index[7]]
+    static inline simd_float gather(const float* base, const int* index) { return{ _mm256_i32gather_ps(base, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index)), 4) }; }
+    //lanes truncated to ints
+    inline void store_int(int* p) const { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm256_cvttps_epi32(v)); }
+
+#elif MTNN_SIMD_WIDTH == 4
+    __m128 v;
+
+    static inline simd_float load(const float* p) { return{ _mm_loadu_ps(p) }; }
+    static inline simd_float set1(float x) { return{ _mm_set1_ps(x) }; }
+    static inline simd_float zero() { return{ _mm_setzero_ps() }; }
+    inline void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    //p[0], p[2], p[4], p[6] (reads 8 floats)
+    static inline simd_float load_even(const float* p)
+    {
+        return{ _mm_shuffle_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4), _MM_SHUFFLE(2, 0, 2, 0)) };
+    }
+
+    friend inline simd_float fmadd(simd_float a, simd_float b, simd_float c) { return{ _mm_add_ps(_mm_mul_ps(a.v, b.v), c.v) }; }
+    friend inline simd_float operator+(simd_float a, simd_float b) { return{ _mm_add_ps(a.v, b.v) }; }
+    friend inline simd_float operator-(simd_float a, simd_float b) { return{ _mm_sub_ps(a.v, b.v) }; }
+    friend inline simd_float operator*(simd_float a, simd_float b) { return{ _mm_mul_ps(a.v, b.v) }; }
+    friend inline simd_float operator/(simd_float a, simd_float b) { return{ _mm_div_ps(a.v, b.v) }; }
+    friend inline simd_float sqrt(simd_float a) { return{ _mm_sqrt_ps(a.v) }; }
+    friend inline simd_float min(simd_float a, simd_float b) { return{ _mm_min_ps(a.v, b.v) }; }
+    friend inline simd_float max(simd_float a, simd_float b) { return{ _mm_max_ps(a.v, b.v) }; }
+    friend inline simd_float mask_positive(simd_float m, simd_float x) { return{ _mm_and_ps(_mm_cmpgt_ps(m.v, _mm_setzero_ps()), x.v) }; }
+    friend inline simd_float mask_bits(uint32_t bits, simd_float x)
+    {
+        __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+        __m128i set = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(static_cast<int>(bits)), lanes), lanes);
+        return{ _mm_and_ps(_mm_castsi128_ps(set), x.v) };
+    }
+    inline float hmax() const
+    {
+        __m128 m = _mm_max_ps(v, _mm_movehl_ps(v, v));
+        return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+    }
+    inline float hsum() const
+    {
+        __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+    }
+    static inline simd_float exp2i(simd_float n) { return{ _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n.v), _mm_set1_epi32(127)), 23)) }; }
+    //round to nearest, exact below 2^23 (larger floats are whole already)
+    static inline simd_float round(simd_float a) { return{ _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)) }; }
+    //truncate, then one down where that went up (negatives), same range as round
+    static inline simd_float floor(simd_float a)
+    {
+        __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+        return{ _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f))) };
+    }
+    static inline simd_float gather(const float* base, const int* index) { return{ _mm_setr_ps(base[index[0]], base[index[1]], base[index[2]], base[index[3]]) }; }
+    inline void store_int(int* p) const { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_cvttps_epi32(v)); }
+
+#else
+    float v;
+
+    static inline simd_float load(const float* p) { return{ *p }; }
+    static inline simd_float set1(float x) { return{ x }; }
+    static inline simd_float zero() { return{ 0.0f }; }
+    inline void store(float* p) const { *p = v; }
+
+    //p[0] (reads 2 floats to keep the same contract as the vector versions)
+    static inline simd_float load_even(const float* p) { return{ *p }; }
+
+    friend inline simd_float fmadd(simd_float a, simd_float b, simd_float c) { return{ a.v * b.v + c.v }; }
+    friend inline simd_float operator+(simd_float a, simd_float b) { return{ a.v + b.v }; }
+    friend inline simd_float operator-(simd_float a, simd_float b) { return{ a.v - b.v }; }
+    friend inline simd_float operator*(simd_float a, simd_float b) { return{ a.v * b.v }; }
+    friend inline simd_float operator/(simd_float a, simd_float b) { return{ a.v / b.v }; }
+    friend inline simd_float sqrt(simd_float a) { return{ std::sqrt(a.v) }; }
+    friend inline simd_float min(simd_float a, simd_float b) { return{ a.v < b.v ? a.v : b.v }; }
+    friend inline simd_float max(simd_float a, simd_float b) { return{ a.v > b.v ? a.v : b.v }; }
+    friend inline simd_float mask_positive(simd_float m, simd_float x) { return{ m.v > 0.0f ? x.v : 0.0f }; }
+    friend inline simd_float mask_bits(uint32_t bits, simd_float x) { return{ (bits & 1) ? x.v : 0.0f }; }
+    inline float hmax() const { return v; }
+    inline float hsum() const { return v; }
+    static inline simd_float exp2i(simd_float n) { return{ std::ldexp(1.0f, static_cast<int>(n.v)) }; }
+    static inline simd_float round(simd_float a) { return{ std::nearbyint(a.v) }; }
+    static inline simd_float floor(simd_float a) { return{ std::floor(a.v) }; }
+    static inline simd_float gather(const float* base, const int* index) { return{ base[*index] }; }
+    inline void store_int(int* p) const { *p = static_cast<int>(v); }
+#endif
+
+    static constexpr size_t width = MTNN_SIMD_WIDTH;
+};
+
+//simd_float's interface on a single float, for the tails of vectorized loops
+struct scalar_float
+{
+    float v;
+
+    static inline scalar_float load(const float* p) { return{ *p }; }
+    static inline scalar_float set1(float x) { return{ x }; }
+    static inline scalar_float zero() { return{ 0.0f }; }
+    inline void store(float* p) const { *p = v; }
+
+    friend inline scalar_float operator+(scalar_float a, scalar_float b) { return{ a.v + b.v }; }
+    friend inline scalar_float operator-(scalar_float a, scalar_float b) { return{ a.v - b.v }; }
+    friend inline scalar_float operator*(scalar_float a, scalar_float b) { return{ a.v * b.v }; }
+    friend inline scalar_float operator/(scalar_float a, scalar_float b) { return{ a.v / b.v }; }
+    friend inline scalar_float sqrt(scalar_float a) { return{ std::sqrt(a.v) }; }
+    friend inline scalar_float min(scalar_float a, scalar_float b) { return{ a.v < b.v ? a.v : b.v }; }
+    friend inline scalar_float max(scalar_float a, scalar_float b) { return{ a.v > b.v ? a.v : b.v }; }
+    friend inline scalar_float mask_positive(scalar_float m, scalar_float x) { return{ m.v > 0.0f ? x.v : 0.0f }; }
+    friend inline scalar_float mask_bits(uint32_t bits, scalar_float x) { return{ (bits & 1) ? x.v : 0.0f }; }
+    inline float hmax() const { return v; }
+    inline float hsum() const { return v; }
+    static inline scalar_float exp2i(scalar_float n) { return{ std::ldexp(1.0f, static_cast<int>(n.v)) }; }
+    static inline scalar_float round(scalar_float a) { return{ std::nearbyint(a.v) }; }
+    static inline scalar_float floor(scalar_float a) { return{ std::floor(a.v) }; }
+    static inline scalar_float gather(const float* base, const int* index) { return{ base[*index] }; }
+    inline void store_int(int* p) const { *p = static_cast<int>(v); }
+
+    static constexpr size_t width = 1;
+};
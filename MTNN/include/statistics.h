@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+#include "simd.h"
+
+//Per element mean and (biased) variance over a stream of samples. Samples are visited one contiguous plane at a time
+//(sample outer, element inner) with Welford updates, each worker keeps its own partial over a slice of the samples and
+//partials are merged pairwise (Chan et al.), so nothing is computed as sum(x^2) / n - mean^2
+class moment_accumulator
+{
+public:
+    //start over with elements floats per sample, keeps its memory
+    void reset(size_t elements)
+    {
+        n_elements = elements;
+        total = 0;
+        mean.assign(elements, 0.0f);
+        m2.assign(elements, 0.0f);
+    }
+
+    //samples seen so far
+    size_t count() const
+    {
+        return total;
+    }
+
+    //add samples[begin...end), anything with a data() of elements floats
+    template<typename maps_vector> void add(maps_vector& samples, size_t begin, size_t end)
+    {
+        size_t n_in = end - begin;
+        if (n_in == 0)
+            return;
+
+        //one slice per thread, unless there isn't enough work for that
+        size_t slices = std::min(task_scheduler::instance().threads(), std::max<size_t>(n_in / parallel_grain(4 * n_elements), 1));
+        partial_mean.resize(slices * n_elements);
+        partial_m2.resize(slices * n_elements);
+
+        float* p_mean = partial_mean.data();
+        float* p_m2 = partial_m2.data();
+        size_t e = n_elements;
+        parallel_for(0, slices, 1, [&, p_mean, p_m2, e](size_t s_begin, size_t s_end)
+        {
+            for (size_t s = s_begin; s < s_end; ++s)
+            {
+                float* m = p_mean + s * e;
+                float* v = p_m2 + s * e;
+                std::fill(m, m + e, 0.0f);
+                std::fill(v, v + e, 0.0f);
+                size_t first = begin + n_in * s / slices;
+                size_t last = begin + n_in * (s + 1) / slices;
+                for (size_t in = first; in < last; ++in)
+                    welford(samples[in].data(), m, v, e, 1.0f / (in - first + 1));
+            }
+        });
+
+        //pairwise tree over the slices, then into the running totals
+        for (size_t stride = 1; stride < slices; stride *= 2)
+            for (size_t s = 0; s + stride < slices; s += 2 * stride)
+                merge(p_mean + s * e, p_m2 + s * e, slice_size(n_in, slices, s, stride), p_mean + (s + stride) * e, p_m2 + (s + stride) * e, slice_size(n_in, slices, s + stride, stride), e);
+        merge(mean.data(), m2.data(), total, p_mean, p_m2, n_in, e);
+        total += n_in;
+    }
+
+    template<typename maps_vector> void add(maps_vector& samples)
+    {
+        add(samples, 0, samples.size());
+    }
+
+    //write out the mean and the biased variance (m2 / count)
+    void finish(float* out_mean, float* out_variance) const
+    {
+        float inv = total > 0 ? 1.0f / total : 0.0f;
+        for (size_t i = 0; i < n_elements; ++i)
+        {
+            out_mean[i] = mean[i];
+            out_variance[i] = m2[i] * inv;
+        }
+    }
+
+private:
+    size_t n_elements = 0;
+    size_t total = 0;
+    std::vector<float> mean;
+    std::vector<float> m2;
+    //per slice partials, reused between calls
+    std::vector<float> partial_mean;
+    std::vector<float> partial_m2;
+
+    //samples in slices s...s + stride (clamped)
+    static size_t slice_size(size_t n_in, size_t slices, size_t s, size_t stride)
+    {
+        return n_in * std::min(s + stride, slices) / slices - n_in * s / slices;
+    }
+
+    //one sample into a partial, inv_count is 1 / (samples in the partial including this one)
+    static void welford(const float* x, float* m, float* v, size_t n, float inv_count)
+    {
+        simd_float inv = simd_float::set1(inv_count);
+        size_t i = 0;
+        for (; i + simd_float::width <= n; i += simd_float::width)
+        {
+            simd_float xi = simd_float::load(x + i);
+            simd_float delta = xi - simd_float::load(m + i);
+            simd_float mi = simd_float::load(m + i) + delta * inv;
+            mi.store(m + i);
+            (simd_float::load(v + i) + delta * (xi - mi)).store(v + i);
+        }
+        for (; i < n; ++i)
+        {
+            float delta = x[i] - m[i];
+            m[i] += delta * inv_count;
+            v[i] += delta * (x[i] - m[i]);
+        }
+    }
+
+    //partial b (count nb) into partial a (count na)
+    static void merge(float* m_a, float* v_a, size_t na, const float* m_b, const float* v_b, size_t nb, size_t n)
+    {
+        if (nb == 0)
+            return;
+        float n_ab = static_cast<float>(na + nb);
+        float w_b = nb / n_ab;
+        float w_ab = static_cast<float>(na) * nb / n_ab;
+        for (size_t i = 0; i < n; ++i)
+        {
+            float delta = m_b[i] - m_a[i];
+            m_a[i] += delta * w_b;
+            v_a[i] += v_b[i] + delta * delta * w_ab;
+        }
+    }
+};
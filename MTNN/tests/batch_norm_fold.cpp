@@ -0,0 +1,118 @@
+//fold_batch_normalization must leave the master's outputs as they were, and instances made before the fold must give the same
+//outputs as the master (single) and as an instance made after it (batch, where the unfolded batch norm layer uses the batch's statistics).
+//Returns 1 if any difference is over 1e-4
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#include "../include/imatrix.h"
+#include "../include/ilayer.h"
+#include "../include/neuralnet.h"
+
+#define SAMPLES 16
+#define TOLERANCE 1e-4f
+
+//the last batch norm layer follows a logistic layer, so it stays unfolded
+typedef NeuralNet<
+    InputLayer<1, 2, 6, 6>,
+    ConvolutionLayer<1, 2, 6, 6, 3, 1, 3, MTNN_FUNC_LINEAR, true, true>,
+    BatchNormalizationLayer<2, 3, 6, 6, MTNN_FUNC_RELU>,
+    PerceptronFullConnectivityLayer<3, 3, 6, 6, 1, 13, 1, MTNN_FUNC_LINEAR, true>,
+    BatchNormalizationLayer<4, 1, 13, 1, MTNN_FUNC_TANH>,
+    PerceptronFullConnectivityLayer<5, 1, 13, 1, 1, 5, 1, MTNN_FUNC_LOGISTIC, true>,
+    BatchNormalizationLayer<6, 1, 5, 1, MTNN_FUNC_LINEAR>,
+    OutputLayer<7, 1, 5, 1>> Net;
+
+static bool failed = false;
+
+static void expect(const char* name, float diff)
+{
+    bool ok = diff <= TOLERANCE;
+    failed |= !ok;
+    printf("%s: max abs diff %g %s\n", name, diff, ok ? "ok" : "FAILED");
+}
+
+static float max_diff(const float* a, const float* b, size_t n)
+{
+    float diff = 0.0f;
+    for (size_t i = 0; i < n; ++i)
+        diff = std::max(diff, std::fabs(a[i] - b[i]));
+    return diff;
+}
+
+template<size_t l> void randomize()
+{
+    using layer = typename Net::get_layer<l>;
+    layer::weights = typename layer::weights_type(-0.3f, 0.3f);
+    layer::biases = typename layer::biases_type(-0.3f, 0.3f);
+    layer::weights.touch();
+    layer::biases.touch();
+}
+
+//a convolution only takes a batch norm that is the same all over a map
+template<size_t l> void statistics(size_t positions)
+{
+    using layer = typename Net::get_layer<l>;
+    auto gamma = typename layer::weights_type(0.5f, 1.5f);
+    auto beta = typename layer::biases_type(-1.0f, 1.0f);
+    auto mean = typename layer::feature_maps_type(-1.0f, 1.0f);
+    auto variance = typename layer::feature_maps_type(0.1f, 0.9f);
+    for (size_t e = 0; e < layer::feature_maps_type::elements(); ++e)
+    {
+        size_t first = e - e % positions;
+        layer::weights.data()[e] = gamma.data()[first];
+        layer::biases.data()[e] = beta.data()[first];
+        layer::activations_population_mean.data()[e] = mean.data()[first];
+        layer::activations_population_variance.data()[e] = variance.data()[first];
+    }
+    layer::weights.touch();
+    layer::biases.touch();
+}
+
+int main()
+{
+    constexpr size_t out_size = Net::get_layer<Net::last_layer_index>::feature_maps_type::elements();
+    constexpr size_t hidden_size = Net::get_layer<5>::feature_maps_type::elements();
+
+    randomize<1>();
+    randomize<3>();
+    randomize<5>();
+    statistics<2>(36);
+    statistics<4>(1);
+    statistics<6>(1);
+
+    FeatureMapVector<2, 6, 6> inputs(SAMPLES);
+    for (auto& input : inputs)
+        input = FeatureMap<2, 6, 6>(-1.0f, 1.0f);
+
+    //made before the fold, so their parameters are the unfolded ones
+    std::unique_ptr<Net> single(new Net());
+    std::unique_ptr<Net> batch(new Net());
+
+    expect("master folded vs unfolded", Net::fold_batch_normalization(inputs));
+    if (!Net::get_layer<2>::folded || !Net::get_layer<4>::folded)
+    {
+        printf("batch norm layers 2 and 4 weren't folded FAILED\n");
+        return 1;
+    }
+
+    float diff = 0.0f;
+    for (size_t in = 0; in < SAMPLES; ++in)
+    {
+        auto& expected = Net::discriminate(inputs[in]);
+        std::vector<float> master(expected.data(), expected.data() + out_size);
+        diff = std::max(diff, max_diff(single->discriminate_thread(inputs[in]).data(), master.data(), out_size));
+    }
+    expect("instance made before the fold vs master", diff);
+
+    //layer 5's input, before the unfolded batch norm mixes the samples
+    std::unique_ptr<Net> fresh(new Net());
+    fresh->discriminate_thread(inputs);
+    batch->discriminate_thread(inputs);
+    diff = 0.0f;
+    for (size_t in = 0; in < SAMPLES; ++in)
+        diff = std::max(diff, max_diff(batch->get_thread_batch_activations<5>()[in].data(), fresh->get_thread_batch_activations<5>()[in].data(), hidden_size));
+    expect("batch instance made before the fold vs after", diff);
+    return failed ? 1 : 0;
+}
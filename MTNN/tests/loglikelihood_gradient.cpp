@@ -0,0 +1,93 @@
+//MTNN_LOSS_LOGLIKELIHOOD without the fused softmax path: the softmax is followed by a maxpool, so the output layer gets the
+//error signals -y / p. train_batch's weight gradients must match central differences of -sum(y * log(p)) over the batch.
+//Returns 1 if any gradient is off by more than 1e-2 relative to the largest one
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+
+#include "../include/imatrix.h"
+#include "../include/ilayer.h"
+#include "../include/neuralnet.h"
+
+#define SAMPLES 5
+#define STEP 1e-2f
+#define TOLERANCE 1e-2
+
+typedef NeuralNet<Loss<MTNN_LOSS_LOGLIKELIHOOD>,
+    InputLayer<1, 1, 6, 1>,
+    PerceptronFullConnectivityLayer<2, 1, 6, 1, 1, 11, 1, MTNN_FUNC_TANH, true>,
+    PerceptronFullConnectivityLayer<3, 1, 11, 1, 1, 10, 1, MTNN_FUNC_LINEAR, true>,
+    SoftMaxLayer<4, 1, 10, 1>,
+    MaxpoolLayer<5, 1, 10, 1, 5, 1>,
+    OutputLayer<6, 1, 5, 1>> Net;
+
+static bool failed = false;
+
+static FeatureMapVector<1, 6, 1> inputs(SAMPLES);
+static FeatureMapVector<1, 5, 1> labels(SAMPLES);
+
+static double loss()
+{
+    double sum = 0.0;
+    for (size_t in = 0; in < SAMPLES; ++in)
+    {
+        auto& output = Net::discriminate(inputs[in]);
+        for (size_t i = 0; i < labels[in].elements(); ++i)
+            sum -= labels[in].data()[i] * std::log(static_cast<double>(output.data()[i]));
+    }
+    return sum;
+}
+
+template<size_t l> void check()
+{
+    using layer = typename Net::get_layer<l>;
+    double diff = 0.0;
+    double largest = 0.0;
+    for (size_t i = 0; i < layer::weights.elements(); ++i)
+    {
+        float w = layer::weights.data()[i];
+        layer::weights.data()[i] = w + STEP;
+        layer::weights.touch();
+        double up = loss();
+        layer::weights.data()[i] = w - STEP;
+        layer::weights.touch();
+        double down = loss();
+        layer::weights.data()[i] = w;
+        layer::weights.touch();
+
+        double numeric = (up - down) / (2 * STEP);
+        diff = std::max(diff, std::fabs(numeric - layer::weights_gradient.data()[i]));
+        largest = std::max(largest, std::fabs(numeric));
+    }
+    bool ok = diff <= TOLERANCE * std::max(1.0, largest);
+    failed |= !ok;
+    printf("layer %zu weights: max abs diff %g largest gradient %g %s\n", l, diff, largest, ok ? "ok" : "FAILED");
+}
+
+template<size_t l> void reset()
+{
+    using layer = typename Net::get_layer<l>;
+    layer::weights = typename layer::weights_type(-1.0f, 1.0f);
+    layer::weights.touch();
+    std::fill(layer::weights_gradient.data(), layer::weights_gradient.data() + layer::weights_gradient.elements(), 0.0f);
+}
+
+int main()
+{
+    static_assert(Net::get_layer<Net::last_layer_index - 1>::type != MTNN_LAYER_SOFTMAX, "net must not take the fused path");
+
+    reset<1>();
+    reset<2>();
+    for (size_t in = 0; in < SAMPLES; ++in)
+    {
+        inputs[in] = FeatureMap<1, 6, 1>(-1.0f, 1.0f);
+        labels[in] = FeatureMap<1, 5, 1>(0.0f);
+        labels[in].data()[in % labels[in].elements()] = 1.0f;
+    }
+
+    //gradients only, nothing applied
+    Net::train_batch(inputs, labels, false, false);
+    check<1>();
+    check<2>();
+    return failed ? 1 : 0;
+}
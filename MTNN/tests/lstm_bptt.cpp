@@ -0,0 +1,133 @@
+//LSTMLayer bptt over a whole sequence: with the loss sum_t(d_t . h_t), the weight, bias and input gradients must match central
+//differences, both backpropagating the sequence as a batch and one step at a time (newest first).
+//Returns 1 if any gradient is off by more than 1e-2 relative to the largest one
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "../include/imatrix.h"
+#include "../include/ilayer.h"
+
+#define STEPS 6
+#define STEP 1e-2f
+#define TOLERANCE 1e-2
+
+typedef LSTMLayer<0, 1, 5, 1, 1, 7, 1, 8> Layer;
+
+static bool failed = false;
+
+static FeatureMapVector<1, 5, 1> inputs(STEPS);
+static FeatureMapVector<1, 7, 1> derivs(STEPS);
+
+static double loss()
+{
+    Layer::reset_state();
+    FeatureMap<1, 7, 1> output;
+    double sum = 0.0;
+    for (size_t t = 0; t < STEPS; ++t)
+    {
+        Layer::feed_forwards(inputs[t], output);
+        for (size_t i = 0; i < output.elements(); ++i)
+            sum += derivs[t].data()[i] * output.data()[i];
+    }
+    return sum;
+}
+
+//central differences of every element
+static std::vector<double> numeric(float* data, size_t n)
+{
+    std::vector<double> grad(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        float v = data[i];
+        data[i] = v + STEP;
+        double up = loss();
+        data[i] = v - STEP;
+        double down = loss();
+        data[i] = v;
+        grad[i] = (up - down) / (2 * STEP);
+    }
+    return grad;
+}
+
+static void expect(const char* name, const std::vector<double>& expected, const float* actual)
+{
+    double diff = 0.0;
+    double largest = 0.0;
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        diff = std::max(diff, std::fabs(expected[i] - actual[i]));
+        largest = std::max(largest, std::fabs(expected[i]));
+    }
+    bool ok = diff <= TOLERANCE * std::max(1.0, largest);
+    failed |= !ok;
+    printf("%s: max abs diff %g largest gradient %g %s\n", name, diff, largest, ok ? "ok" : "FAILED");
+}
+
+static void clear_gradients()
+{
+    std::fill(Layer::weights_gradient.data(), Layer::weights_gradient.data() + Layer::weights_gradient.elements(), 0.0f);
+    std::fill(Layer::biases_gradient.data(), Layer::biases_gradient.data() + Layer::biases_gradient.elements(), 0.0f);
+}
+
+int main()
+{
+    Layer::weights = Layer::weights_type(-0.5f, 0.5f);
+    Layer::weights.touch();
+    for (size_t t = 0; t < STEPS; ++t)
+    {
+        inputs[t] = FeatureMap<1, 5, 1>(-2.0f, 2.0f);
+        derivs[t] = FeatureMap<1, 7, 1>(-2.0f, 2.0f);
+    }
+
+    auto weights = numeric(Layer::weights.data(), Layer::weights.elements());
+    auto biases = numeric(Layer::biases.data(), Layer::biases.elements());
+    std::vector<double> input_derivs;
+    for (size_t t = 0; t < STEPS; ++t)
+    {
+        auto step = numeric(inputs[t].data(), inputs[t].elements());
+        input_derivs.insert(input_derivs.end(), step.begin(), step.end());
+    }
+
+    //input derivs stacked like input_derivs
+    std::vector<float> out(input_derivs.size());
+    auto stack = [&](FeatureMapVector<1, 5, 1>& out_derivs)
+    {
+        for (size_t t = 0; t < STEPS; ++t)
+            std::copy(out_derivs[t].data(), out_derivs[t].data() + out_derivs[t].elements(), out.data() + t * out_derivs[t].elements());
+    };
+
+    //batch
+    Layer::reset_state();
+    clear_gradients();
+    FeatureMapVector<1, 7, 1> outputs(STEPS);
+    FeatureMapVector<1, 5, 1> batch_out_derivs(STEPS);
+    Layer::feed_forwards(inputs, outputs);
+    Layer::back_prop(MTNN_FUNC_LINEAR, derivs, inputs, batch_out_derivs, false, 0.0f, false, 0.0f, false, false, 0.0f);
+    stack(batch_out_derivs);
+    expect("batch weights", weights, Layer::weights_gradient.data());
+    expect("batch biases", biases, Layer::biases_gradient.data());
+    expect("batch inputs", input_derivs, out.data());
+
+    //one step at a time, newest first
+    Layer::reset_state();
+    clear_gradients();
+    FeatureMap<1, 7, 1> output;
+    FeatureMapVector<1, 5, 1> single_out_derivs(STEPS);
+    for (size_t t = 0; t < STEPS; ++t)
+        Layer::feed_forwards(inputs[t], output);
+    for (size_t t = STEPS; t-- > 0;)
+        Layer::back_prop(MTNN_FUNC_LINEAR, derivs[t], inputs[t], single_out_derivs[t], false, 0.0f, false, 0.0f, false, false, 0.0f);
+    stack(single_out_derivs);
+    expect("single weights", weights, Layer::weights_gradient.data());
+    expect("single biases", biases, Layer::biases_gradient.data());
+    expect("single inputs", input_derivs, out.data());
+
+    //every step was backpropagated, another call has nothing to do
+    FeatureMap<1, 5, 1> extra = { 0 };
+    Layer::back_prop(MTNN_FUNC_LINEAR, derivs[0], inputs[0], extra, false, 0.0f, false, 0.0f, false, false, 0.0f);
+    std::vector<double> zero(extra.elements(), 0.0);
+    expect("past the first step", zero, extra.data());
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+//Winograd F(2x2, 3x3) against the direct and GEMM convolutions, forwards and input derivatives, for 3x3 stride 1 layers that select it.
+//Fails (returns 1) if any difference is over the documented bound: 1e-6 relative to the largest reference value
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+
+#include "../include/ilayer.h"
+
+#define MTNN_WINOGRAD_TOLERANCE 1e-6f
+
+static bool failed = false;
+
+static float max_abs(const float* values, size_t n)
+{
+    float m = 0.0f;
+    for (size_t i = 0; i < n; ++i)
+        m = std::max(m, std::fabs(values[i]));
+    return m;
+}
+
+static void expect(const char* name, size_t features, size_t rows, size_t cols, bool use_padding, const float* result, const float* reference, size_t n)
+{
+    float diff = 0.0f;
+    for (size_t i = 0; i < n; ++i)
+        diff = std::max(diff, std::fabs(result[i] - reference[i]));
+    float bound = MTNN_WINOGRAD_TOLERANCE * std::max(1.0f, max_abs(reference, n));
+    bool ok = diff <= bound;
+    failed |= !ok;
+    printf("%s F%zu R%zu C%zu P%d: max abs diff %g bound %g %s\n", name, features, rows, cols, use_padding ? 1 : 0, diff, bound, ok ? "ok" : "FAILED");
+}
+
+template<size_t features, size_t rows, size_t cols, size_t out_features, bool use_padding> void check(size_t samples)
+{
+    using layer = ConvolutionLayer<1, features, rows, cols, 3, 1, out_features, MTNN_FUNC_LINEAR, false, use_padding>;
+    using maps_type = typename layer::feature_maps_type;
+    using out_maps_type = typename layer::out_feature_maps_type;
+    static_assert(layer::use_winograd, "shape doesn't select Winograd");
+
+    constexpr size_t in_size = maps_type::elements();
+    constexpr size_t out_size = out_maps_type::elements();
+
+    typename layer::weights_type weights(-0.5f, 0.5f);
+    typename layer::biases_type biases = { 0 };
+    std::vector<maps_type> inputs(samples);
+    std::vector<out_maps_type> derivs(samples);
+    for (size_t in = 0; in < samples; ++in)
+    {
+        inputs[in] = maps_type(-1.0f, 1.0f);
+        derivs[in] = out_maps_type(-1.0f, 1.0f);
+    }
+
+    //forwards
+    std::vector<out_maps_type> winograd(samples);
+    std::vector<out_maps_type> reference(samples);
+    layer::feed_forwards_winograd(samples, inputs.data(), winograd.data(), weights, biases);
+    layer::feed_forwards_gemm(samples, inputs.data(), reference.data(), weights, biases);
+    for (size_t in = 0; in < samples; ++in)
+        expect("forwards vs gemm", features, rows, cols, use_padding, winograd[in].data(), reference[in].data(), out_size);
+    if (layer::conv_direct::specialized)
+    {
+        layer::feed_forwards_direct(samples, inputs.data(), reference.data(), weights, biases);
+        for (size_t in = 0; in < samples; ++in)
+            expect("forwards vs direct", features, rows, cols, use_padding, winograd[in].data(), reference[in].data(), out_size);
+    }
+
+    //input derivatives, the reference is the transpose of the (linear, no bias) GEMM forwards applied to every unit input
+    std::vector<maps_type> out_derivs(samples);
+    for (auto& d : out_derivs)
+        std::fill(d.data(), d.data() + in_size, 0.0f);
+    typename layer::weights_type w_grad = { 0 };
+    typename layer::biases_type b_grad = { 0 };
+    layer::back_prop_gemm(samples, MTNN_FUNC_LINEAR, derivs.data(), inputs.data(), out_derivs.data(), weights, w_grad, b_grad);
+
+    std::vector<maps_type> units(in_size);
+    std::vector<out_maps_type> responses(in_size);
+    for (size_t i = 0; i < in_size; ++i)
+    {
+        std::fill(units[i].data(), units[i].data() + in_size, 0.0f);
+        units[i].data()[i] = 1.0f;
+    }
+    layer::feed_forwards_gemm(in_size, units.data(), responses.data(), weights, biases);
+
+    std::vector<float> expected(in_size);
+    for (size_t in = 0; in < samples; ++in)
+    {
+        for (size_t i = 0; i < in_size; ++i)
+        {
+            double sum = 0.0;
+            for (size_t o = 0; o < out_size; ++o)
+                sum += static_cast<double>(responses[i].data()[o]) * derivs[in].data()[o];
+            expected[i] = static_cast<float>(sum);
+        }
+        expect("input derivatives", features, rows, cols, use_padding, out_derivs[in].data(), expected.data(), in_size);
+    }
+}
+
+int main()
+{
+    check<8, 8, 8, 4, true>(2);
+    check<8, 9, 7, 5, true>(2);
+    check<8, 9, 7, 5, false>(2);
+    check<16, 12, 12, 8, true>(3);
+    check<12, 16, 10, 6, false>(1);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+//Steady state training must not allocate: after a few warm up batches of one size, train_batch (serial, with dropout, and through
+//NeuralNetTrainer) makes no heap or aligned allocations. Scratch is kept per thread (see the README), so this runs every net on the
+//same threads. Returns 1 if any net allocated
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+static std::atomic<long> allocations{ 0 };
+
+#define MTNN_ALLOCATION_HOOK(bytes) ++allocations
+
+void* operator new(size_t n)
+{
+    ++allocations;
+    void* ptr = malloc(n != 0 ? n : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+#include "../include/imatrix.h"
+#include "../include/ilayer.h"
+#include "../include/neuralnet.h"
+#include "../include/neuralnettrainer.h"
+
+#define WARM_UP_BATCHES 3
+#define COUNTED_BATCHES 5
+
+typedef NeuralNet<
+    InputLayer<1, 8, 8, 8>,
+    ConvolutionLayer<1, 8, 8, 8, 3, 1, 4, MTNN_FUNC_LOGISTIC, true, true>,
+    MaxpoolLayer<1, 4, 8, 8, 4, 4>,
+    PerceptronFullConnectivityLayer<1, 4, 4, 4, 1, 3, 1, MTNN_FUNC_LINEAR, true>,
+    SoftMaxLayer<1, 1, 3, 1>,
+    OutputLayer<1, 1, 3, 1>> ConvNet;
+
+typedef NeuralNet<
+    InputLayer<2, 8, 8, 8>,
+    ConvolutionLayer<2, 8, 8, 8, 5, 1, 4, MTNN_FUNC_RELU, true, true>,
+    PerceptronFullConnectivityLayer<2, 4, 8, 8, 1, 3, 1, MTNN_FUNC_LINEAR, true>,
+    SoftMaxLayer<2, 1, 3, 1>,
+    OutputLayer<2, 1, 3, 1>> ParallelNet;
+
+typedef NeuralNet<
+    InputLayer<3, 8, 8, 8>,
+    ConvolutionLayer<3, 8, 8, 8, 3, 1, 4, MTNN_FUNC_LINEAR, true, true>,
+    BatchNormalizationLayer<3, 4, 8, 8, MTNN_FUNC_RELU>,
+    PerceptronFullConnectivityLayer<3, 4, 8, 8, 1, 3, 1, MTNN_FUNC_LINEAR, true>,
+    OutputLayer<3, 1, 3, 1>> BatchNormNet;
+
+typedef NeuralNet<
+    InputLayer<4, 1, 8, 1>,
+    LSTMLayer<4, 1, 8, 1, 1, 16, 1, 4>,
+    PerceptronFullConnectivityLayer<4, 1, 16, 1, 1, 3, 1, MTNN_FUNC_LINEAR, true>,
+    OutputLayer<4, 1, 3, 1>> RecurrentNet;
+
+static bool failed = false;
+
+static void expect(const char* name, long counted)
+{
+    failed |= counted != 0;
+    printf("%s: %ld allocations in %d steady batches %s\n", name, counted, COUNTED_BATCHES, counted == 0 ? "ok" : "FAILED");
+}
+
+template<typename net> void fill(typename net::template get_layer<0>::feature_maps_vector_type& inputs, typename net::template get_layer<net::last_layer_index>::feature_maps_vector_type& labels)
+{
+    for (size_t in = 0; in < inputs.size(); ++in)
+    {
+        for (size_t i = 0; i < inputs[in].elements(); ++i)
+            inputs[in].data()[i] = rand() / static_cast<float>(RAND_MAX) - 0.5f;
+        std::fill(labels[in].data(), labels[in].data() + labels[in].elements(), 0.0f);
+        labels[in].data()[in % labels[in].elements()] = 1.0f;
+    }
+}
+
+template<typename net> void serial(const char* name, size_t batch_size)
+{
+    typename net::template get_layer<0>::feature_maps_vector_type inputs(batch_size);
+    typename net::template get_layer<net::last_layer_index>::feature_maps_vector_type labels(batch_size);
+    fill<net>(inputs, labels);
+
+    for (size_t b = 0; b < WARM_UP_BATCHES; ++b)
+        net::train_batch(inputs, labels, false, true);
+    long before = allocations;
+    for (size_t b = 0; b < COUNTED_BATCHES; ++b)
+        net::train_batch(inputs, labels, false, true);
+    expect(name, allocations - before);
+}
+
+template<typename net> void trainer(const char* name, size_t batch_size, size_t workers)
+{
+    typename net::template get_layer<0>::feature_maps_vector_type inputs(batch_size);
+    typename net::template get_layer<net::last_layer_index>::feature_maps_vector_type labels(batch_size);
+    fill<net>(inputs, labels);
+
+    NeuralNetTrainer<net> parallel(workers);
+    for (size_t b = 0; b < WARM_UP_BATCHES; ++b)
+        parallel.train_batch(inputs, labels);
+    long before = allocations;
+    for (size_t b = 0; b < COUNTED_BATCHES; ++b)
+        parallel.train_batch(inputs, labels);
+    expect(name, allocations - before);
+}
+
+int main()
+{
+    ConvNet::learning_rate = 0.01f;
+    ParallelNet::learning_rate = 0.01f;
+    BatchNormNet::learning_rate = 0.01f;
+    RecurrentNet::learning_rate = 0.01f;
+
+    serial<ConvNet>("conv, maxpool, fc, softmax", 13);
+    ConvNet::use_dropout = true;
+    serial<ConvNet>("conv, maxpool, fc, softmax with dropout", 13);
+    ConvNet::use_dropout = false;
+    serial<ParallelNet>("conv 5x5, fc, softmax", 13);
+    serial<BatchNormNet>("conv, batch norm, fc", 13);
+    serial<RecurrentNet>("lstm, fc", 6);
+    trainer<ParallelNet>("trainer, conv 5x5, fc, softmax", 13, 4);
+    ParallelNet::use_dropout = true;
+    trainer<ParallelNet>("trainer with dropout", 13, 4);
+    return failed ? 1 : 0;
+}